@@ -54,3 +54,226 @@ osync_bool evo2_translate_capabilities(OSyncCapabilities *caps, GList *fields, c
 osync_bool evo2_capbilities_translate_ebook(OSyncCapabilities *caps, GList *fields, OSyncError **error) {
 	return evo2_translate_capabilities(caps, fields, "contact", error);
 }
+
+/* iCalendar properties the calendar sinks can carry, per component kind.
+ * The names match the evo2 side of the capability tables in
+ * evolution2_format.c. */
+static const char *evo2_event_properties[] = {
+	"ATTACH", "ATTENDEE", "CATEGORIES", "CLASS", "COMMENT", "CONTACT",
+	"CREATED", "DESCRIPTION", "DTEND", "DTSTAMP", "DTSTART", "DURATION",
+	"EXDATE", "EXRULE", "GEO", "LAST-MODIFIED", "LOCATION", "ORGANIZER",
+	"PRIORITY", "RDATE", "RECURRENCE-ID", "RELATED-TO", "RESOURCES", "RRULE",
+	"SEQUENCE", "STATUS", "SUMMARY", "TRANSP", "UID", "URL", "VALARM", NULL
+};
+
+static const char *evo2_todo_properties[] = {
+	"ATTACH", "ATTENDEE", "CATEGORIES", "CLASS", "COMMENT", "COMPLETED",
+	"CONTACT", "CREATED", "DESCRIPTION", "DTSTAMP", "DTSTART", "DUE",
+	"DURATION", "EXDATE", "EXRULE", "GEO", "LAST-MODIFIED", "LOCATION",
+	"ORGANIZER", "PERCENT-COMPLETE", "PRIORITY", "RDATE", "RECURRENCE-ID",
+	"RELATED-TO", "RESOURCES", "RRULE", "SEQUENCE", "STATUS", "SUMMARY",
+	"UID", "URL", "VALARM", NULL
+};
+
+static const char *evo2_journal_properties[] = {
+	"ATTACH", "ATTENDEE", "CATEGORIES", "CLASS", "COMMENT", "CONTACT",
+	"CREATED", "DESCRIPTION", "DTSTAMP", "DTSTART", "EXDATE", "EXRULE",
+	"LAST-MODIFIED", "ORGANIZER", "RDATE", "RECURRENCE-ID", "RELATED-TO",
+	"RRULE", "SEQUENCE", "STATUS", "SUMMARY", "UID", "URL", NULL
+};
+
+/* Properties the probe object carries. Everything not listed here (UID,
+ * DTSTAMP, mutually exclusive ones like DURATION) is assumed to be kept.
+ * ORGANIZER and ATTENDEE are left out on purpose: groupware backends send
+ * invitations for them, so only the static capabilities decide those. */
+static const char *evo2_probe_event =
+	"BEGIN:VEVENT\r\n"
+	"DTSTART:20090101T100000Z\r\nDTEND:20090101T110000Z\r\n"
+	"TRANSP:TRANSPARENT\r\nLOCATION:probe\r\nGEO:0;0\r\nPRIORITY:5\r\n"
+	"RESOURCES:probe\r\nSTATUS:CONFIRMED\r\n";
+static const char *evo2_probe_todo =
+	"BEGIN:VTODO\r\n"
+	"DTSTART:20090101T100000Z\r\nDUE:20090102T100000Z\r\n"
+	"COMPLETED:20090101T120000Z\r\nPERCENT-COMPLETE:10\r\nLOCATION:probe\r\n"
+	"GEO:0;0\r\nPRIORITY:5\r\nRESOURCES:probe\r\nSTATUS:IN-PROCESS\r\n";
+static const char *evo2_probe_journal =
+	"BEGIN:VJOURNAL\r\n"
+	"DTSTART:20090101T100000Z\r\nSTATUS:DRAFT\r\n";
+static const char *evo2_probe_common =
+	"SUMMARY:OpenSync capability probe\r\nDESCRIPTION:probe\r\n"
+	"CATEGORIES:probe\r\nCLASS:PRIVATE\r\nCOMMENT:probe\r\nCONTACT:probe\r\n"
+	"CREATED:20090101T000000Z\r\nLAST-MODIFIED:20090101T000000Z\r\nSEQUENCE:1\r\n"
+	"URL:http://www.opensync.org/\r\nATTACH:http://www.opensync.org/\r\n"
+	"RELATED-TO:opensync-evo2-probe-parent\r\n"
+	"RRULE:FREQ=DAILY;COUNT=3\r\nEXDATE:20090102T100000Z\r\n";
+static const char *evo2_probe_alarm =
+	"BEGIN:VALARM\r\nACTION:DISPLAY\r\nTRIGGER:-PT15M\r\nDESCRIPTION:probe\r\nEND:VALARM\r\n";
+
+static void evo2_ecal_drop_property(GHashTable *supported, const char *name)
+{
+	if (g_hash_table_remove(supported, name))
+		osync_trace(TRACE_INTERNAL, "Backend does not support %s", name);
+}
+
+/* What the backend announces as static capabilities */
+static void evo2_ecal_apply_static_caps(ECal *cal, icalcomponent_kind kind, GHashTable *supported)
+{
+	if (e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_AUDIO_ALARMS) &&
+	    e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_DISPLAY_ALARMS) &&
+	    e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_EMAIL_ALARMS) &&
+	    e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_PROCEDURE_ALARMS))
+		evo2_ecal_drop_property(supported, "VALARM");
+	if (e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_TRANSPARENCY))
+		evo2_ecal_drop_property(supported, "TRANSP");
+	if (e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_ORGANIZER))
+		evo2_ecal_drop_property(supported, "ORGANIZER");
+	if (kind == ICAL_VTODO_COMPONENT && e_cal_get_static_capability(cal, CAL_STATIC_CAPABILITY_NO_TASK_ASSIGNMENT)) {
+		evo2_ecal_drop_property(supported, "ORGANIZER");
+		evo2_ecal_drop_property(supported, "ATTENDEE");
+	}
+}
+
+/* Removes the probe again. Discovery has no context to report to, so a
+ * probe left behind is a warning on the log rather than a trace. */
+static void evo2_ecal_remove_probe(ECal *cal, const char *uid)
+{
+	GError *gerror = NULL;
+
+	evo2_metrics_eds_call();
+	if (!e_cal_remove_object(cal, uid, &gerror)) {
+		g_warning("Unable to remove capability probe %s, please delete it by hand: %s", uid, gerror ? gerror->message : "None");
+		osync_trace(TRACE_ERROR, "Unable to remove capability probe %s: %s", uid, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+	}
+}
+
+/* Stores an object carrying every probed property, reads it back and
+ * drops whatever the backend did not keep. The object is removed again. */
+static osync_bool evo2_ecal_probe(ECal *cal, icalcomponent_kind kind, GHashTable *supported, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %i, %p, %p)", __func__, cal, kind, supported, error);
+	icalcomponent *probe = NULL, *stored = NULL;
+	icalproperty *prop = NULL;
+	GHashTable *kept = NULL;
+	GHashTableIter iter;
+	gpointer name;
+	GError *gerror = NULL;
+	char *uid = NULL, *ical = NULL;
+
+	ical = g_strdup_printf("%s%sUID:opensync-evo2-probe-%08x\r\n%sEND:%s\r\n",
+			kind == ICAL_VEVENT_COMPONENT ? evo2_probe_event : kind == ICAL_VTODO_COMPONENT ? evo2_probe_todo : evo2_probe_journal,
+			evo2_probe_common,
+			g_random_int(),
+			kind == ICAL_VJOURNAL_COMPONENT ? "" : evo2_probe_alarm,
+			icalcomponent_kind_to_string(kind));
+	probe = icalcomponent_new_from_string(ical);
+	g_free(ical);
+	if (!probe) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to build capability probe");
+		goto error;
+	}
+
+	evo2_metrics_eds_call();
+	if (!e_cal_create_object(cal, probe, &uid, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to store capability probe: %s", gerror ? gerror->message : "None");
+		goto error_free_probe;
+	}
+
+	evo2_metrics_eds_call();
+	if (!e_cal_get_object(cal, uid, NULL, &stored, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to read back capability probe: %s", gerror ? gerror->message : "None");
+		goto error_remove_probe;
+	}
+
+	kept = g_hash_table_new(g_str_hash, g_str_equal);
+	for (prop = icalcomponent_get_first_property(stored, ICAL_ANY_PROPERTY); prop; prop = icalcomponent_get_next_property(stored, ICAL_ANY_PROPERTY))
+		g_hash_table_insert(kept, (gpointer) icalproperty_kind_to_string(icalproperty_isa(prop)), NULL);
+	if (icalcomponent_get_first_component(probe, ICAL_VALARM_COMPONENT) && !icalcomponent_get_first_component(stored, ICAL_VALARM_COMPONENT))
+		evo2_ecal_drop_property(supported, "VALARM");
+
+	for (prop = icalcomponent_get_first_property(probe, ICAL_ANY_PROPERTY); prop; prop = icalcomponent_get_next_property(probe, ICAL_ANY_PROPERTY)) {
+		const char *probed = icalproperty_kind_to_string(icalproperty_isa(prop));
+		if (!g_hash_table_lookup_extended(kept, probed, NULL, NULL))
+			evo2_ecal_drop_property(supported, probed);
+	}
+
+	g_hash_table_destroy(kept);
+	icalcomponent_free(stored);
+
+	evo2_ecal_remove_probe(cal, uid);
+	g_free(uid);
+	icalcomponent_free(probe);
+
+	g_hash_table_iter_init(&iter, supported);
+	while (g_hash_table_iter_next(&iter, &name, NULL))
+		osync_trace(TRACE_INTERNAL, "Probed support for %s", (const char *)name);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+
+ error_remove_probe:
+	g_clear_error(&gerror);
+	evo2_ecal_remove_probe(cal, uid);
+	g_free(uid);
+ error_free_probe:
+	icalcomponent_free(probe);
+ error:
+	g_clear_error(&gerror);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+osync_bool evo2_capbilities_translate_ecal(OSyncCapabilities *caps, ECal *cal, const char *objtype, icalcomponent_kind kind, osync_bool probe, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %s, %i, %i, %p)", __func__, caps, cal, objtype, kind, probe, error);
+	const char **properties = NULL;
+	GHashTable *supported = NULL;
+	GList *fields = NULL;
+	osync_bool success;
+	int i;
+
+	switch (kind) {
+		case ICAL_VEVENT_COMPONENT:
+			properties = evo2_event_properties;
+			break;
+		case ICAL_VTODO_COMPONENT:
+			properties = evo2_todo_properties;
+			break;
+		default:
+			properties = evo2_journal_properties;
+			break;
+	}
+
+	supported = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; properties[i]; i++)
+		g_hash_table_insert(supported, (gpointer) properties[i], NULL);
+
+	evo2_ecal_apply_static_caps(cal, kind, supported);
+
+	/* a failed probe leaves us with the static view */
+	if (probe) {
+		OSyncError *probe_error = NULL;
+		if (!evo2_ecal_probe(cal, kind, supported, &probe_error)) {
+			osync_trace(TRACE_INTERNAL, "Capability probe failed: %s", osync_error_print(&probe_error));
+			osync_error_unref(&probe_error);
+		}
+	}
+
+	/* keep the table order */
+	for (i = 0; properties[i]; i++) {
+		if (g_hash_table_lookup_extended(supported, properties[i], NULL, NULL))
+			fields = g_list_prepend(fields, (gpointer) properties[i]);
+	}
+	fields = g_list_reverse(fields);
+	g_hash_table_destroy(supported);
+
+	success = fields ? evo2_translate_capabilities(caps, fields, objtype, error) : TRUE;
+	g_list_free(fields);
+
+	if (!success) {
+		osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+		return FALSE;
+	}
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+}
@@ -32,5 +32,20 @@
  */
 
 osync_bool evo2_capbilities_translate_ebook(OSyncCapabilities *caps, GList *fields, OSyncError **error);
+
+/*! @brief Adds the properties a calendar backend supports to caps
+ *
+ * Starts from all properties of the component kind and removes the ones
+ * the backend's static capabilities rule out. With probe set, a scratch
+ * object is stored and read back to find out what the backend drops.
+ *
+ * @param caps The capabilities to add the objtype to
+ * @param cal An opened ECal
+ * @param objtype The objtype of the calendar sink
+ * @param kind The component kind the sink stores
+ * @param probe Whether to store a probe object in the calendar
+ * @param error Error information if return value is False
+ */
+osync_bool evo2_capbilities_translate_ecal(OSyncCapabilities *caps, ECal *cal, const char *objtype, icalcomponent_kind kind, osync_bool probe, OSyncError **error);
 #endif /* EVO2_CAPABILITIES_H */
 
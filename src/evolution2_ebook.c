@@ -27,10 +27,20 @@
 #include <opensync/opensync-plugin.h>
 
 #include "evolution2_capabilities.h"
+#include "evolution2_record.h"
 
 #include "evolution2_ebook.h"
 
-EBook *evo2_ebook_open_book(const char *path, OSyncError **error) 
+static void evo2_ebook_flush(OSyncEvoEnv *env);
+static void evo2_ebook_drain(OSyncEvoEnv *env);
+static osync_bool evo2_ebook_hash_refresh(OSyncEvoEnv *env, OSyncError **error);
+static osync_bool evo2_ebook_filter_compile(OSyncEvoEnv *env, OSyncError **error);
+static void evo2_ebook_peer_track(OSyncEvoEnv *env, const char *uid, OSyncChangeType type);
+static GList *evo2_ebook_project_fields(OSyncEvoEnv *env, GList *fields);
+static osync_bool evo2_ebook_projection_load(OSyncEvoEnv *env, OSyncError **error);
+static void evo2_ebook_projection_free(OSyncEvoEnv *env);
+
+EBook *evo2_ebook_open_book(OSyncEvoEnv *env, const char *path, OSyncError **error) 
 {
 	EBook *addressbook = NULL;
 	GError *gerror = NULL;
@@ -44,17 +54,25 @@ EBook *evo2_ebook_open_book(const char *path, OSyncError **error)
 	}
 
 	if (strcmp(path, "default")) {
-		if (!e_book_get_addressbooks(&sources, &gerror)) {
-	  		osync_error_set(error, OSYNC_ERROR_GENERIC, "Error getting addressbooks: %s", gerror ? gerror->message : "None");
-	  		goto error;
+		if (!env->book_sources) {
+			if (!e_book_get_addressbooks(&sources, &gerror)) {
+		  		osync_error_set(error, OSYNC_ERROR_GENERIC, "Error getting addressbooks: %s", gerror ? gerror->message : "None");
+		  		goto error;
+			}
+			env->book_sources = evo2_source_index_new(sources);
 		}
 		
-		if (!(source = evo2_find_source(sources, path))) {
+		if ((source = evo2_source_index_lookup(env->book_sources, path))) {
+			addressbook = e_book_new(source, &gerror);
+			g_object_unref(source);
+		} else if (strstr(path, "://")) {
+			/* not a configured source, e.g. a file:// book */
+			addressbook = e_book_new_from_uri(path, &gerror);
+		} else {
 			osync_error_set(error, OSYNC_ERROR_GENERIC, "Error finding source \"%s\"", path);
 	  		goto error;
 		}
-		
-		if (!(addressbook = e_book_new(source, &gerror))) {
+		if (!addressbook) {
 			osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to alloc new addressbook: %s", gerror ? gerror->message : "None");
 	  		goto error;
 		}
@@ -66,6 +84,7 @@ EBook *evo2_ebook_open_book(const char *path, OSyncError **error)
 		}
 	}
 
+	evo2_metrics_eds_call();
 	if (!e_book_open(addressbook, TRUE, &gerror)) {
 		osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to alloc new addressbook: %s", gerror ? gerror->message : "None");
 	  	goto error_free_book;
@@ -85,6 +104,19 @@ EBook *evo2_ebook_open_book(const char *path, OSyncError **error)
 
 }
 
+/* Returns a reference on the cached book, opening it on first use */
+static EBook *evo2_ebook_get_book(OSyncEvoEnv *env, OSyncError **error)
+{
+	char *key = evo2_handle_key("contact", env->addressbook_path);
+	EBook *book = (EBook *)evo2_handle_lookup(env, key);
+
+	if (!book && (book = evo2_ebook_open_book(env, env->addressbook_path, error)))
+		evo2_handle_store(env, key, G_OBJECT(book));
+
+	g_free(key);
+	return book;
+}
+
 osync_bool evo2_ebook_discover(OSyncEvoEnv *env, OSyncCapabilities *caps, OSyncError **error) 
 {
 	EBook *book = NULL;
@@ -98,13 +130,14 @@ osync_bool evo2_ebook_discover(OSyncEvoEnv *env, OSyncCapabilities *caps, OSyncE
 	osync_assert(caps);
 
 	if (env->contact_sink) {
-		if (!(book = evo2_ebook_open_book(env->addressbook_path, error))) {
+		if (!(book = evo2_ebook_get_book(env, error))) {
 			goto error;
 		}
 		writable = e_book_is_writable(book);
 		osync_objtype_sink_set_write(env->contact_sink, writable);
 		osync_trace(TRACE_INTERNAL, "Set sink write status to %s", writable ? "TRUE" : "FALSE");
 
+		evo2_metrics_eds_call();
 		success = e_book_get_supported_fields (book, &fields, &gerror);
 		g_object_unref(book);
 		if (!success) {
@@ -112,6 +145,7 @@ osync_bool evo2_ebook_discover(OSyncEvoEnv *env, OSyncCapabilities *caps, OSyncE
 			goto error;
 		}
 		
+		fields = evo2_ebook_project_fields(env, fields);
 		success = evo2_capbilities_translate_ebook(caps, fields, error);
 		while (fields) {
 			g_free(fields->data);
@@ -139,25 +173,34 @@ static void evo2_ebook_connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OS
 	OSyncEvoEnv *env = (OSyncEvoEnv *)userdata;
 	osync_bool state_match;
 
-	if (!(env->addressbook = evo2_ebook_open_book(env->addressbook_path, &error))) {
+	if (!(env->addressbook = evo2_ebook_get_book(env, &error))) {
 		goto error;
 	}
+	if (!evo2_ebook_filter_compile(env, &error))
+		goto error_free_book;
+	if (!evo2_ebook_projection_load(env, &error))
+		goto error_free_book;
 	
 	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
 	if (!state_db) {
 		osync_error_set(&error, OSYNC_ERROR_GENERIC, "State database missing for objtype \"%s\"", osync_objtype_sink_get_name(sink));
 		goto error_free_book;
 	}
-	if (!osync_sink_state_equal(state_db, "path", env->addressbook_path, &state_match, &error)) {
+	if (!evo2_state_equal(state_db, "path", env->addressbook_path, &state_match, &error)) {
 		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Anchor comparison failed for objtype \"%s\"", osync_objtype_sink_get_name(sink));
 		goto error_free_book;
 	}
+	if (state_match && !evo2_state_equal(state_db, "filter", env->contact_filter_expr, &state_match, &error))
+		goto error_free_book;
+	if (state_match && !evo2_state_equal(state_db, "fields", env->contact_fields, &state_match, &error))
+		goto error_free_book;
 	if (!state_match) {
 		osync_trace(TRACE_INTERNAL, "EBook slow sync, due to anchor mismatch");
 		osync_context_report_slowsync(ctx);
 	}
 
-	
+	/* cleared again if get_changes reads the change database */
+	env->contact_checkpoint = TRUE;
 	osync_context_report_success(ctx);
 	
 	osync_trace(TRACE_EXIT, "%s", __func__);
@@ -177,6 +220,19 @@ static void evo2_ebook_disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info,
 	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, userdata, info, ctx);
 	OSyncEvoEnv *env = (OSyncEvoEnv *)userdata;
 	
+	/* complete anything committed_all did not get to flush */
+	if (env->contact_queue && !g_queue_is_empty(env->contact_queue))
+		evo2_ebook_flush(env);
+	if (env->contact_queue)
+		evo2_ebook_drain(env);
+	evo2_uid_index_free(env->contact_uids);
+	env->contact_uids = NULL;
+	if (env->contact_filter) {
+		e_book_query_unref(env->contact_filter);
+		env->contact_filter = NULL;
+	}
+	evo2_ebook_projection_free(env);
+
 	if (env->addressbook) {
 		g_object_unref(env->addressbook);
 		env->addressbook = NULL;
@@ -199,10 +255,34 @@ static void evo2_ebook_sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info,
 		osync_error_set(&error, OSYNC_ERROR_GENERIC, "State database missing for objtype \"%s\"", osync_objtype_sink_get_name(sink));
 		goto error;
 	}
-	if (!osync_sink_state_set(state_db, "path", env->addressbook_path, &error))
+	if (!evo2_state_set(state_db, "path", env->addressbook_path, &error))
 		goto error;
-	
+	if (!evo2_state_set(state_db, "filter", env->contact_filter_expr ? env->contact_filter_expr : "", &error))
+		goto error;
+	if (!evo2_state_set(state_db, "fields", env->contact_fields ? env->contact_fields : "", &error))
+		goto error;
+
+	if (env->contact_hashed) {
+		/* no backend change marker to move on */
+		if (!evo2_ebook_hash_refresh(env, &error))
+			goto error;
+		osync_context_report_success(ctx);
+		osync_trace(TRACE_EXIT, "%s", __func__);
+		return;
+	}
+
+	/* e_book_get_changes() in get_changes already moved the change
+	 * marker. It only has to be moved again if that did not happen or
+	 * if our own commits have to be hidden from the next sync. */
+	if (!env->contact_checkpoint) {
+		osync_trace(TRACE_INTERNAL, "EBook change marker is up to date");
+		osync_context_report_success(ctx);
+		osync_trace(TRACE_EXIT, "%s", __func__);
+		return;
+	}
+
 	GList *changes = NULL;
+	evo2_metrics_eds_call();
 	if (!e_book_get_changes(env->addressbook, env->change_id, &changes, &gerror)) {
 		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to update EBook time of last sync: %s", gerror ? gerror->message : "None");
 		g_clear_error(&gerror);
@@ -248,10 +328,924 @@ void evo2_report_change(OSyncContext *ctx, OSyncObjFormat *format, char *data, u
 	osync_data_unref(odata);
 
 	osync_context_report_change(ctx, change);
+	evo2_metrics_reported(size);
 	
 	osync_change_unref(change);
 }
 
+/* With the evo2-contact format a contact is reported as a record of its
+ * EVCard attributes, taken over as parsed by EDS, and rebuilt the same
+ * way on commit. Neither direction goes through vCard text. */
+static char *evo2_ebook_contact_to_record(EContact *contact, unsigned int *size)
+{
+	GString *record = g_string_new(NULL);
+	GString *params = g_string_new(NULL);
+	GString *value = g_string_new(NULL);
+	GList *a, *p, *v;
+
+	for (a = e_vcard_get_attributes(E_VCARD(contact)); a; a = a->next) {
+		EVCardAttribute *attr = a->data;
+
+		g_string_truncate(params, 0);
+		for (p = e_vcard_attribute_get_params(attr); p; p = p->next) {
+			EVCardAttributeParam *param = p->data;
+			if (params->len)
+				g_string_append_c(params, ';');
+			g_string_append(params, e_vcard_attribute_param_get_name(param));
+			for (v = e_vcard_attribute_param_get_values(param); v; v = v->next)
+				g_string_append_printf(params, "%c%s", v == e_vcard_attribute_param_get_values(param) ? '=' : ',', (const char *) v->data);
+		}
+
+		g_string_truncate(value, 0);
+		for (v = e_vcard_attribute_get_values(attr); v; v = v->next) {
+			if (v != e_vcard_attribute_get_values(attr))
+				g_string_append_c(value, EVO2_RECORD_LIST_SEPARATOR);
+			g_string_append(value, (const char *) v->data);
+		}
+
+		if (e_vcard_attribute_get_group(attr)) {
+			char *name = g_strdup_printf("%s.%s", e_vcard_attribute_get_group(attr), e_vcard_attribute_get_name(attr));
+			evo2_record_append(record, name, params->str, value->str);
+			g_free(name);
+		} else {
+			evo2_record_append(record, e_vcard_attribute_get_name(attr), params->str, value->str);
+		}
+	}
+
+	g_string_free(params, TRUE);
+	g_string_free(value, TRUE);
+
+	*size = record->len;
+	return g_string_free(record, FALSE);
+}
+
+static EContact *evo2_ebook_contact_from_record(const char *data, unsigned int size)
+{
+	EContact *contact = e_contact_new();
+	OSyncEvoRecordAttr rattr;
+	unsigned int offset = 0;
+	char **list, **item, **values, **value;
+
+	while (evo2_record_next(data, size, &offset, &rattr)) {
+		const char *name = evo2_record_name_ungrouped(rattr.name);
+		char *group = name != rattr.name ? g_strndup(rattr.name, name - rattr.name - 1) : NULL;
+		EVCardAttribute *attr = e_vcard_attribute_new(group, name);
+		g_free(group);
+
+		list = evo2_record_split_params(rattr.params);
+		for (item = list; *item; item++) {
+			char *eq = strchr(*item, '=');
+			EVCardAttributeParam *param = NULL;
+			if (eq)
+				*eq = '\0';
+			param = e_vcard_attribute_param_new(*item);
+			if (eq) {
+				values = g_strsplit(eq + 1, ",", 0);
+				for (value = values; *value; value++)
+					e_vcard_attribute_param_add_value(param, *value);
+				g_strfreev(values);
+			}
+			e_vcard_attribute_add_param(attr, param);
+		}
+		g_strfreev(list);
+
+		values = evo2_record_split_value(rattr.value);
+		for (value = values; *value; value++)
+			e_vcard_attribute_add_value(attr, *value);
+		g_strfreev(values);
+
+		e_vcard_add_attribute(E_VCARD(contact), attr);
+	}
+
+	return contact;
+}
+
+/* ContactFields: the vCard attributes the peer keeps, e.g. "FN,N,TEL,EMAIL".
+ * OpenSync does not tell the plugin what the peer accepts, so the list is
+ * configured; at connect it is cut down to what the backend supports.
+ * The list is an anchor: the peer only has the fields of the last one, so
+ * changing it means a slow sync. Views are asked for just those fields,
+ * and reported contacts are stripped of every other attribute before
+ * serializing, so large attributes like PHOTO never reach the engine. A
+ * modification coming back from the peer with only projected attributes
+ * gets the others from the stored contact so that they survive the
+ * commit; one that carries others is taken as the whole contact. */
+static osync_bool evo2_ebook_field_projected(OSyncEvoEnv *env, EContactField field)
+{
+	const char *attr = e_contact_vcard_attribute(field);
+	char **name;
+
+	if (!env->contact_field_names)
+		return TRUE;
+	if (!attr)
+		return FALSE;
+	for (name = env->contact_field_names; *name; name++) {
+		if (!g_ascii_strcasecmp(*name, attr))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Drops the fields outside ContactFields from a supported fields list */
+static GList *evo2_ebook_project_fields(OSyncEvoEnv *env, GList *fields)
+{
+	GList *l = fields, *next = NULL;
+
+	while (l) {
+		next = l->next;
+		if (!evo2_ebook_field_projected(env, e_contact_field_id((const char *)l->data))) {
+			g_free(l->data);
+			fields = g_list_delete_link(fields, l);
+		}
+		l = next;
+	}
+	return fields;
+}
+
+static void evo2_ebook_projection_free(OSyncEvoEnv *env)
+{
+	if (env->contact_projection)
+		g_hash_table_destroy(env->contact_projection);
+	env->contact_projection = NULL;
+	g_list_free(env->contact_view_fields);
+	env->contact_view_fields = NULL;
+}
+
+static osync_bool evo2_ebook_projection_load(OSyncEvoEnv *env, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __func__, env, error);
+	GList *fields = NULL, *l = NULL;
+	GError *gerror = NULL;
+	char **name;
+
+	if (!env->contact_field_names) {
+		osync_trace(TRACE_EXIT, "%s: no projection", __func__);
+		return TRUE;
+	}
+
+	evo2_metrics_eds_call();
+	if (!e_book_get_supported_fields(env->addressbook, &fields, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to get supported fields: %s", gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		goto error;
+	}
+	fields = evo2_ebook_project_fields(env, fields);
+
+	evo2_ebook_projection_free(env);
+	env->contact_projection = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_insert(env->contact_projection, g_strdup(EVC_VERSION), NULL);
+	g_hash_table_insert(env->contact_projection, g_strdup(EVC_UID), NULL);
+	g_hash_table_insert(env->contact_projection, g_strdup(EVC_REV), NULL);
+	env->contact_view_fields = g_list_append(NULL, (gpointer) e_contact_field_name(E_CONTACT_UID));
+	env->contact_view_fields = g_list_append(env->contact_view_fields, (gpointer) e_contact_field_name(E_CONTACT_REV));
+
+	for (l = fields; l; l = l->next) {
+		EContactField field = e_contact_field_id((const char *)l->data);
+		env->contact_view_fields = g_list_append(env->contact_view_fields, (gpointer) e_contact_field_name(field));
+		g_hash_table_insert(env->contact_projection, g_ascii_strup(e_contact_vcard_attribute(field), -1), NULL);
+		g_free(l->data);
+	}
+	g_list_free(fields);
+
+	/* names the backend has no field for, e.g. X- extensions, are kept as they are */
+	for (name = env->contact_field_names; *name; name++)
+		g_hash_table_insert(env->contact_projection, g_ascii_strup(*name, -1), NULL);
+
+	osync_trace(TRACE_EXIT, "%s: %u attributes", __func__, g_hash_table_size(env->contact_projection));
+	return TRUE;
+
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+static osync_bool evo2_ebook_attribute_projected(OSyncEvoEnv *env, EVCardAttribute *attr)
+{
+	char *name = g_ascii_strup(e_vcard_attribute_get_name(attr), -1);
+	osync_bool projected = g_hash_table_lookup_extended(env->contact_projection, name, NULL, NULL);
+
+	g_free(name);
+	return projected;
+}
+
+static void evo2_ebook_project(OSyncEvoEnv *env, EContact *contact)
+{
+	GList *a = NULL, *dropped = NULL;
+
+	for (a = e_vcard_get_attributes(E_VCARD(contact)); a; a = a->next) {
+		if (!evo2_ebook_attribute_projected(env, a->data))
+			dropped = g_list_prepend(dropped, a->data);
+	}
+	for (a = dropped; a; a = a->next)
+		e_vcard_remove_attribute(E_VCARD(contact), a->data);
+	g_list_free(dropped);
+}
+
+/* Takes the attributes outside the projection over from the stored
+ * contact, if contact has none of them */
+static void evo2_ebook_project_merge(OSyncEvoEnv *env, EContact *contact, const char *uid)
+{
+	EContact *stored = NULL;
+	GError *gerror = NULL;
+	GList *a = NULL, *kept = NULL;
+
+	if (!env->contact_projection)
+		return;
+	for (a = e_vcard_get_attributes(E_VCARD(contact)); a; a = a->next) {
+		if (!evo2_ebook_attribute_projected(env, a->data))
+			return;
+	}
+
+	evo2_metrics_eds_call();
+	if (!e_book_get_contact(env->addressbook, uid, &stored, &gerror)) {
+		osync_trace(TRACE_INTERNAL, "Unable to fetch contact %s to merge: %s", uid, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		return;
+	}
+	/* unless the peer sent them after all */
+	for (a = e_vcard_get_attributes(E_VCARD(stored)); a; a = a->next) {
+		if (!evo2_ebook_attribute_projected(env, a->data)
+		    && !e_vcard_get_attribute(E_VCARD(contact), e_vcard_attribute_get_name(a->data)))
+			kept = g_list_prepend(kept, e_vcard_attribute_copy(a->data));
+	}
+	kept = g_list_reverse(kept);
+	for (a = kept; a; a = a->next)
+		e_vcard_add_attribute(E_VCARD(contact), a->data);
+	g_list_free(kept);
+	g_object_unref(stored);
+}
+
+/* ContactBlobDedup: PHOTO and LOGO usually make up most of a vCard, and
+ * a peer that did not touch them may leave them out of a modification.
+ * The sink state keeps, per contact, the SHA-1 of the PHOTO and LOGO the
+ * last commit left in the book ("blob_<uid>_<attr>"). A modification
+ * that comes without one gets it back from the book when it still has
+ * that blob, instead of losing it. Nothing is tracked on get_changes. */
+static const char *evo2_ebook_blob_attrs[] = { EVC_PHOTO, EVC_LOGO, NULL };
+
+static char *evo2_ebook_blob_hash(EVCardAttribute *attr)
+{
+	EVCard *vcard = e_vcard_new();
+	char *text = NULL, *hash = NULL;
+
+	e_vcard_add_attribute(vcard, e_vcard_attribute_copy(attr));
+	text = e_vcard_to_string(vcard, EVC_FORMAT_VCARD_30);
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, text, -1);
+	g_free(text);
+	g_object_unref(vcard);
+	return hash;
+}
+
+/* The hash of the blob the last commit left for uid, NULL for none */
+static char *evo2_ebook_blob_committed_hash(OSyncEvoEnv *env, const char *uid, const char *name)
+{
+	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(env->contact_sink);
+	OSyncError *error = NULL;
+	char *key = g_strdup_printf("blob_%s_%s", uid, name);
+	char *value = evo2_state_get(state_db, key, &error);
+	char *hash = NULL;
+
+	if (!value && error) {
+		osync_trace(TRACE_INTERNAL, "Unable to read %s: %s", key, osync_error_print(&error));
+		osync_error_unref(&error);
+	}
+	if (value && *value)
+		hash = g_strdup(value);
+	if (value)
+		osync_free(value);
+	g_free(key);
+	return hash;
+}
+
+/* Puts the committed blobs a modification from the peer left out back in */
+static void evo2_ebook_blobs_restore(OSyncEvoEnv *env, EContact *contact, const char *uid)
+{
+	char *hashes[G_N_ELEMENTS(evo2_ebook_blob_attrs)] = { NULL };
+	EContact *stored = NULL;
+	GError *gerror = NULL;
+	osync_bool missing = FALSE;
+	unsigned int i;
+
+	if (!env->contact_blob_dedup || !uid)
+		return;
+
+	for (i = 0; evo2_ebook_blob_attrs[i]; i++) {
+		if (e_vcard_get_attribute(E_VCARD(contact), evo2_ebook_blob_attrs[i]))
+			continue;
+		hashes[i] = evo2_ebook_blob_committed_hash(env, uid, evo2_ebook_blob_attrs[i]);
+		missing |= hashes[i] != NULL;
+	}
+	/* the book is only asked when there is something to restore */
+	if (!missing)
+		return;
+
+	evo2_metrics_eds_call();
+	if (!e_book_get_contact(env->addressbook, uid, &stored, &gerror)) {
+		osync_trace(TRACE_INTERNAL, "Unable to get %s to restore its blobs: %s", uid, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		stored = NULL;
+	}
+
+	for (i = 0; evo2_ebook_blob_attrs[i]; i++) {
+		EVCardAttribute *attr = NULL;
+		char *hash = NULL;
+
+		if (!hashes[i])
+			continue;
+		if (stored && (attr = e_vcard_get_attribute(E_VCARD(stored), evo2_ebook_blob_attrs[i])))
+			hash = evo2_ebook_blob_hash(attr);
+		/* one changed in the book since is not what the peer left out */
+		if (hash && !strcmp(hash, hashes[i])) {
+			osync_trace(TRACE_INTERNAL, "Restored unchanged %s of %s", evo2_ebook_blob_attrs[i], uid);
+			e_vcard_add_attribute(E_VCARD(contact), e_vcard_attribute_copy(attr));
+		}
+		g_free(hash);
+		g_free(hashes[i]);
+	}
+	if (stored)
+		g_object_unref(stored);
+}
+
+/* Records the blobs a successful commit left in the book */
+static void evo2_ebook_blobs_committed(OSyncEvoEnv *env, OSyncChange *change, EContact *contact)
+{
+	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(env->contact_sink);
+	const char *uid = osync_change_get_uid(change);
+	OSyncError *error = NULL;
+	const char **name;
+
+	if (!env->contact_blob_dedup || !uid)
+		return;
+
+	for (name = evo2_ebook_blob_attrs; *name; name++) {
+		EVCardAttribute *attr = contact ? e_vcard_get_attribute(E_VCARD(contact), *name) : NULL;
+		char *hash = attr ? evo2_ebook_blob_hash(attr) : NULL;
+		char *key = g_strdup_printf("blob_%s_%s", uid, *name);
+
+		if (!evo2_state_set(state_db, key, hash ? hash : "", &error)) {
+			osync_trace(TRACE_INTERNAL, "Unable to store %s: %s", key, osync_error_print(&error));
+			osync_error_unref(&error);
+		}
+		g_free(key);
+		g_free(hash);
+	}
+}
+
+/* Serializes a contact in the format the sink reports */
+static char *evo2_ebook_serialize(OSyncEvoEnv *env, EContact *contact, unsigned int *size)
+{
+	char *data = NULL;
+
+	if (env->contact_projection)
+		evo2_ebook_project(env, contact);
+	if (env->contact_native)
+		return evo2_ebook_contact_to_record(contact, size);
+
+	data = e_vcard_to_string(E_VCARD(contact), EVC_FORMAT_VCARD_30);
+	*size = strlen(data) + 1;
+	return data;
+}
+
+static EContact *evo2_ebook_parse(OSyncEvoEnv *env, OSyncChange *change)
+{
+	OSyncData *odata = osync_change_get_data(change);
+	char *plain = NULL;
+	unsigned int size = 0;
+
+	osync_data_get_data(odata, &plain, &size);
+	if (env->contact_native)
+		return evo2_ebook_contact_from_record(plain, size);
+	return e_contact_new_from_vcard(plain);
+}
+
+/* Rough heap footprint of a contact, for the memory accounting */
+#define EVO2_CONTACT_BYTES	256
+#define EVO2_ATTRIBUTE_BYTES	160
+
+static gsize evo2_ebook_footprint(EContact *contact)
+{
+	return EVO2_CONTACT_BYTES + g_list_length(e_vcard_get_attributes(E_VCARD(contact))) * EVO2_ATTRIBUTE_BYTES;
+}
+
+/* Slow sync is streamed through an EBookView rather than fetched with
+ * e_book_get_contacts(): the backend hands out the matching contacts in
+ * small notification chunks, each chunk is reported to the engine as it
+ * arrives and released by the view afterwards. This keeps the memory
+ * footprint bounded by the chunk size instead of the size of the book. */
+typedef struct OSyncEvoBookStream {
+	OSyncEvoEnv *env;
+	OSyncContext *ctx;
+	OSyncHashTable *table;
+	GList *fields;
+	GList *pending;
+	EBookViewStatus status;
+	osync_bool done;
+	unsigned int reported;
+	/* UIDs seen by a filter match, see evo2_ebook_filter_changes() */
+	GHashTable *matched;
+} OSyncEvoBookStream;
+
+static void evo2_ebook_stream_contacts_added(EBookView *view, const GList *contacts, gpointer userdata)
+{
+	OSyncEvoBookStream *stream = (OSyncEvoBookStream *)userdata;
+	const GList *l;
+	unsigned int chunk = 0;
+
+	for (l = contacts; l; l = l->next) {
+		EContact *contact = E_CONTACT(l->data);
+		unsigned int size = 0;
+		char *data = evo2_ebook_serialize(stream->env, contact, &size);
+		const char *uid = e_contact_get_const(contact, E_CONTACT_UID);
+		evo2_uid_index_insert(stream->env->contact_uids, uid);
+		if (stream->env->contact_tracked)
+			evo2_ebook_peer_track(stream->env, uid, OSYNC_CHANGE_TYPE_ADDED);
+		evo2_report_change(stream->ctx, stream->env->contact_format, data, size, uid, OSYNC_CHANGE_TYPE_ADDED);
+		chunk++;
+	}
+	stream->reported += chunk;
+	osync_trace(TRACE_INTERNAL, "Reported chunk of %u contacts (%u so far)", chunk, stream->reported);
+}
+
+static void evo2_ebook_stream_sequence_complete(EBookView *view, EBookViewStatus status, gpointer userdata)
+{
+	OSyncEvoBookStream *stream = (OSyncEvoBookStream *)userdata;
+
+	stream->status = status;
+	stream->done = TRUE;
+}
+
+/* Runs a book view for query to completion, passing every notified chunk
+ * to contacts_added. fields optionally restricts the fields the backend
+ * has to fill in. */
+static osync_bool evo2_ebook_run_view(OSyncEvoBookStream *stream, EBookQuery *query, GList *fields, GCallback contacts_added, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, stream, query, fields, error);
+	EBookView *view = NULL;
+	GError *gerror = NULL;
+
+	evo2_metrics_eds_call();
+	if (!e_book_get_book_view(stream->env->addressbook, query, fields, 0, &view, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to get book view: %s", gerror ? gerror->message : "None");
+		goto error;
+	}
+
+	g_signal_connect(view, "contacts_added", contacts_added, stream);
+	g_signal_connect(view, "sequence_complete", G_CALLBACK(evo2_ebook_stream_sequence_complete), stream);
+
+	e_book_view_start(view);
+	while (!stream->done)
+		g_main_context_iteration(g_main_context_get_thread_default(), TRUE);
+	e_book_view_stop(view);
+
+	g_signal_handlers_disconnect_matched(view, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, stream);
+	g_object_unref(view);
+
+	if (stream->status != E_BOOK_VIEW_STATUS_OK) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Book view finished with status %i after %u contacts", stream->status, stream->reported);
+		goto error;
+	}
+
+	osync_trace(TRACE_EXIT, "%s: %u contacts", __func__, stream->reported);
+	return TRUE;
+
+ error:
+	if (gerror)
+		g_clear_error(&gerror);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+/* The UID index of the book is built once per connection: for free by a
+ * slow sync or hashtable scan, which see every contact anyway, otherwise
+ * by a UID-only view on the first add or modify. Commits keep it up to
+ * date, disconnect drops it. */
+static void evo2_ebook_index_contacts_added(EBookView *view, const GList *contacts, gpointer userdata)
+{
+	OSyncEvoBookStream *stream = (OSyncEvoBookStream *)userdata;
+	const GList *l;
+
+	for (l = contacts; l; l = l->next) {
+		evo2_uid_index_insert(stream->env->contact_uids, e_contact_get_const(E_CONTACT(l->data), E_CONTACT_UID));
+		stream->reported++;
+	}
+}
+
+/* Starts a fresh index for a view that sees every contact */
+static void evo2_ebook_uid_index_reset(OSyncEvoEnv *env)
+{
+	evo2_uid_index_free(env->contact_uids);
+	env->contact_uids = evo2_uid_index_new();
+}
+
+/* Drops an index that may have missed contacts */
+static void evo2_ebook_uid_index_drop(OSyncEvoEnv *env)
+{
+	evo2_uid_index_free(env->contact_uids);
+	env->contact_uids = NULL;
+}
+
+/* FALSE only if the book is known not to have uid. Without an index, one
+ * is loaded; if that fails, the caller tries modify first as before. */
+static osync_bool evo2_ebook_has_uid(OSyncEvoEnv *env, const char *uid)
+{
+	OSyncEvoBookStream stream;
+	OSyncError *error = NULL;
+	GList *fields = NULL;
+
+	if (!env->contact_uids) {
+		memset(&stream, 0, sizeof(stream));
+		stream.env = env;
+		evo2_ebook_uid_index_reset(env);
+
+		fields = g_list_append(fields, (gpointer) e_contact_field_name(E_CONTACT_UID));
+		EBookQuery *query = e_book_query_any_field_contains("");
+		osync_bool loaded = evo2_ebook_run_view(&stream, query, fields, G_CALLBACK(evo2_ebook_index_contacts_added), &error);
+		e_book_query_unref(query);
+		g_list_free(fields);
+
+		if (!loaded) {
+			osync_trace(TRACE_INTERNAL, "Unable to load the UID index: %s", osync_error_print(&error));
+			osync_error_unref(&error);
+			evo2_ebook_uid_index_drop(env);
+			return TRUE;
+		}
+		osync_trace(TRACE_INTERNAL, "Loaded UID index of %u contacts", stream.reported);
+	}
+
+	return evo2_uid_index_contains(env->contact_uids, uid);
+}
+
+/* ContactFilter: an EBookQuery s-expression, e.g.
+ * (or (is "category_list" "Customers") (exists "phone")), compiled at
+ * connect and stored as an anchor, so changing it means a slow sync.
+ * Slow syncs and hashtable scans hand it to the backend as the view
+ * query. Changes from the change database are matched by asking the
+ * backend which of the changed UIDs satisfy the filter, and the sink's
+ * hashtable keeps the UIDs the peer has: a change inside the filter is
+ * an addition if the peer lacks it, one outside or a deletion is only
+ * reported as a deletion if the peer has it. Filtered views do not see
+ * every contact, so they leave the UID index to be loaded unfiltered on
+ * demand. */
+#define EVO2_FILTER_UIDS_PER_QUERY	64
+
+/* Returns a new reference on the query selecting the contacts to sync */
+static EBookQuery *evo2_ebook_query(OSyncEvoEnv *env)
+{
+	if (env->contact_filter)
+		return e_book_query_ref(env->contact_filter);
+	return e_book_query_any_field_contains("");
+}
+
+static osync_bool evo2_ebook_peer_has(OSyncEvoEnv *env, const char *uid)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(env->contact_sink);
+	OSyncError *error = NULL;
+	OSyncChange *change = osync_change_new(&error);
+	osync_bool has;
+
+	if (!change) {
+		/* a deletion too many does less harm than a lost one */
+		osync_trace(TRACE_INTERNAL, "Unable to look up %s: %s", uid, osync_error_print(&error));
+		osync_error_unref(&error);
+		return TRUE;
+	}
+	osync_change_set_uid(change, uid);
+	osync_change_set_hash(change, "");
+	has = evo2_hashtable_get_changetype(table, change) != OSYNC_CHANGE_TYPE_ADDED;
+	osync_change_unref(change);
+	return has;
+}
+
+static void evo2_ebook_peer_track(OSyncEvoEnv *env, const char *uid, OSyncChangeType type)
+{
+	OSyncError *error = NULL;
+	OSyncChange *change = osync_change_new(&error);
+
+	if (!change) {
+		osync_trace(TRACE_INTERNAL, "Unable to track %s: %s", uid, osync_error_print(&error));
+		osync_error_unref(&error);
+		return;
+	}
+	osync_change_set_uid(change, uid);
+	osync_change_set_hash(change, "");
+	osync_change_set_changetype(change, type);
+	evo2_hashtable_update_change(osync_objtype_sink_get_hashtable(env->contact_sink), change);
+	osync_change_unref(change);
+}
+
+static osync_bool evo2_ebook_filter_compile(OSyncEvoEnv *env, OSyncError **error)
+{
+	if (!env->contact_filter_expr || !*env->contact_filter_expr)
+		return TRUE;
+
+	if (!(env->contact_filter = e_book_query_from_string(env->contact_filter_expr))) {
+		osync_error_set(error, OSYNC_ERROR_MISCONFIGURATION, "Invalid ContactFilter \"%s\"", env->contact_filter_expr);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void evo2_ebook_match_contacts_added(EBookView *view, const GList *contacts, gpointer userdata)
+{
+	OSyncEvoBookStream *stream = (OSyncEvoBookStream *)userdata;
+	const GList *l;
+
+	for (l = contacts; l; l = l->next) {
+		const char *uid = e_contact_get_const(E_CONTACT(l->data), E_CONTACT_UID);
+		if (uid)
+			g_hash_table_insert(stream->matched, g_strdup(uid), NULL);
+		stream->reported++;
+	}
+}
+
+/* Runs the filter restricted to uids and adds the matching ones to matched */
+static osync_bool evo2_ebook_filter_match(OSyncEvoEnv *env, GList *uids, GHashTable *matched, OSyncError **error)
+{
+	OSyncEvoBookStream stream;
+	EBookQuery **tests = NULL;
+	GList *fields = NULL, *l = NULL;
+	int n = 0;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.env = env;
+	stream.matched = matched;
+
+	tests = g_new0(EBookQuery *, g_list_length(uids));
+	for (l = uids; l; l = l->next)
+		tests[n++] = e_book_query_field_test(E_CONTACT_UID, E_BOOK_QUERY_IS, (const char *)l->data);
+	EBookQuery *among = e_book_query_or(n, tests, TRUE);
+	g_free(tests);
+
+	EBookQuery *both[2] = { e_book_query_ref(env->contact_filter), among };
+	EBookQuery *query = e_book_query_and(2, both, TRUE);
+
+	fields = g_list_append(fields, (gpointer) e_contact_field_name(E_CONTACT_UID));
+	osync_bool run = evo2_ebook_run_view(&stream, query, fields, G_CALLBACK(evo2_ebook_match_contacts_added), error);
+	g_list_free(fields);
+	e_book_query_unref(query);
+	return run;
+}
+
+/* Returns the UIDs of the added and modified contacts in changes that
+ * satisfy the filter, or NULL on error */
+static GHashTable *evo2_ebook_filter_changes(OSyncEvoEnv *env, GList *changes, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, env, changes, error);
+	GHashTable *matched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GList *uids = NULL, *l = NULL;
+	unsigned int n = 0;
+
+	for (l = changes; l; l = l->next) {
+		EBookChange *ebc = (EBookChange *)l->data;
+		const char *uid = e_contact_get_const(ebc->contact, E_CONTACT_UID);
+
+		if (ebc->change_type == E_BOOK_CHANGE_CARD_DELETED || !uid)
+			continue;
+		uids = g_list_prepend(uids, (gpointer) uid);
+		if (++n == EVO2_FILTER_UIDS_PER_QUERY) {
+			if (!evo2_ebook_filter_match(env, uids, matched, error))
+				goto error;
+			g_list_free(uids);
+			uids = NULL;
+			n = 0;
+		}
+	}
+	if (uids && !evo2_ebook_filter_match(env, uids, matched, error))
+		goto error;
+	g_list_free(uids);
+
+	osync_trace(TRACE_EXIT, "%s: %u matching", __func__, g_hash_table_size(matched));
+	return matched;
+
+ error:
+	g_list_free(uids);
+	g_hash_table_destroy(matched);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return NULL;
+}
+
+/* Hashtable change detection (ChangeDetection=hashtable): instead of the
+ * backend's change database, the sink's OpenSync hashtable keeps one hash
+ * per UID, the contact's REV or, without REV, a checksum of its vCard.
+ * A fast sync only asks the backend for UID and REV of every contact,
+ * compares them with the hashtable and fetches the full contact just for
+ * the ones that changed; UIDs the scan did not see are reported deleted.
+ * Reported and committed changes update the hashtable as they happen. */
+static char *evo2_ebook_contact_hash(EContact *contact)
+{
+	const char *rev = e_contact_get_const(contact, E_CONTACT_REV);
+	char *vcard = NULL, *hash = NULL;
+
+	if (rev)
+		return g_strdup(rev);
+
+	vcard = e_vcard_to_string(E_VCARD(contact), EVC_FORMAT_VCARD_30);
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, vcard, -1);
+	g_free(vcard);
+	return hash;
+}
+
+static void evo2_ebook_report_hashed(OSyncEvoBookStream *stream, OSyncChange *change, EContact *contact)
+{
+	unsigned int size = 0;
+
+	char *data = evo2_ebook_serialize(stream->env, contact, &size);
+
+	evo2_report_hashed_change(stream->ctx, stream->table, change, stream->env->contact_format, data, size);
+	stream->reported++;
+}
+
+static void evo2_ebook_scan_contacts_added(EBookView *view, const GList *contacts, gpointer userdata)
+{
+	OSyncEvoBookStream *stream = (OSyncEvoBookStream *)userdata;
+	OSyncError *error = NULL;
+	const GList *l;
+
+	for (l = contacts; l; l = l->next) {
+		EContact *contact = E_CONTACT(l->data);
+		const char *rev = e_contact_get_const(contact, E_CONTACT_REV);
+		char *hash = NULL;
+
+		OSyncChange *change = osync_change_new(&error);
+		if (!change) {
+			osync_context_report_osyncwarning(stream->ctx, error);
+			osync_error_unref(&error);
+			continue;
+		}
+		osync_change_set_uid(change, e_contact_get_const(contact, E_CONTACT_UID));
+		evo2_uid_index_insert(stream->env->contact_uids, e_contact_get_const(contact, E_CONTACT_UID));
+
+		if (stream->fields && !rev) {
+			/* no REV to compare, decide once the full contact is fetched */
+			stream->pending = g_list_prepend(stream->pending, change);
+			continue;
+		}
+
+		hash = stream->fields ? g_strdup(rev) : evo2_ebook_contact_hash(contact);
+		osync_change_set_hash(change, hash);
+		g_free(hash);
+
+		osync_change_set_changetype(change, evo2_hashtable_get_changetype(stream->table, change));
+		if (osync_change_get_changetype(change) == OSYNC_CHANGE_TYPE_UNMODIFIED) {
+			osync_change_unref(change);
+			continue;
+		}
+
+		if (stream->fields) {
+			stream->pending = g_list_prepend(stream->pending, change);
+		} else {
+			evo2_ebook_report_hashed(stream, change, contact);
+			osync_change_unref(change);
+		}
+	}
+}
+
+static osync_bool evo2_ebook_get_hashed_changes(OSyncEvoEnv *env, OSyncObjTypeSink *sink, OSyncContext *ctx, osync_bool slow_sync, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %i, %p)", __func__, env, sink, ctx, slow_sync, error);
+	OSyncEvoBookStream stream;
+	OSyncList *deleted = NULL, *d = NULL;
+	GError *gerror = NULL;
+	GList *l = NULL;
+	osync_bool scanned;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.env = env;
+	stream.ctx = ctx;
+	stream.table = osync_objtype_sink_get_hashtable(sink);
+
+	if (slow_sync && !evo2_hashtable_slowsync(stream.table, error))
+		goto error;
+
+	/* a slow sync needs every contact in full anyway */
+	if (!slow_sync) {
+		stream.fields = g_list_append(stream.fields, (gpointer) e_contact_field_name(E_CONTACT_UID));
+		stream.fields = g_list_append(stream.fields, (gpointer) e_contact_field_name(E_CONTACT_REV));
+	}
+
+	if (env->contact_filter)
+		evo2_ebook_uid_index_drop(env);
+	else
+		evo2_ebook_uid_index_reset(env);
+	EBookQuery *query = evo2_ebook_query(env);
+	scanned = evo2_ebook_run_view(&stream, query, slow_sync ? env->contact_view_fields : stream.fields, G_CALLBACK(evo2_ebook_scan_contacts_added), error);
+	e_book_query_unref(query);
+	g_list_free(stream.fields);
+	if (!scanned) {
+		evo2_ebook_uid_index_drop(env);
+		goto error_free_pending;
+	}
+
+	for (l = stream.pending; l; l = l->next) {
+		OSyncChange *change = (OSyncChange *)l->data;
+		EContact *contact = NULL;
+
+		evo2_metrics_eds_call();
+		if (!e_book_get_contact(env->addressbook, osync_change_get_uid(change), &contact, &gerror)) {
+			osync_trace(TRACE_INTERNAL, "Unable to fetch contact %s: %s", osync_change_get_uid(change), gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			continue;
+		}
+
+		if (!osync_change_get_hash(change)) {
+			char *hash = evo2_ebook_contact_hash(contact);
+			osync_change_set_hash(change, hash);
+			g_free(hash);
+			osync_change_set_changetype(change, evo2_hashtable_get_changetype(stream.table, change));
+		}
+		if (osync_change_get_changetype(change) != OSYNC_CHANGE_TYPE_UNMODIFIED)
+			evo2_ebook_report_hashed(&stream, change, contact);
+		g_object_unref(contact);
+	}
+	g_list_foreach(stream.pending, (GFunc) osync_change_unref, NULL);
+	g_list_free(stream.pending);
+
+	deleted = evo2_hashtable_get_deleted(stream.table);
+	for (d = deleted; d; d = d->next) {
+		OSyncChange *change = osync_change_new(error);
+		if (!change) {
+			osync_list_free(deleted);
+			goto error;
+		}
+		osync_change_set_uid(change, (const char *) d->data);
+		osync_change_set_changetype(change, OSYNC_CHANGE_TYPE_DELETED);
+		evo2_report_hashed_change(ctx, stream.table, change, env->contact_format, NULL, 0);
+		osync_change_unref(change);
+	}
+	osync_list_free(deleted);
+
+	osync_trace(TRACE_EXIT, "%s: %u changed", __func__, stream.reported);
+	return TRUE;
+
+ error_free_pending:
+	g_list_foreach(stream.pending, (GFunc) osync_change_unref, NULL);
+	g_list_free(stream.pending);
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+/* Records a successful commit in the hashtable. The backend assigns the
+ * new REV, so the real hash is looked up in sync_done. */
+static void evo2_ebook_hash_committed(OSyncEvoEnv *env, OSyncChange *change)
+{
+	if (!env->contact_hashed && !env->contact_tracked)
+		return;
+
+	osync_change_set_hash(change, "");
+	evo2_hashtable_update_change(osync_objtype_sink_get_hashtable(env->contact_sink), change);
+	if (env->contact_hashed && osync_change_get_changetype(change) != OSYNC_CHANGE_TYPE_DELETED)
+		g_hash_table_replace(env->contact_committed, g_strdup(osync_change_get_uid(change)), NULL);
+}
+
+static osync_bool evo2_ebook_hash_refresh(OSyncEvoEnv *env, OSyncError **error)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(env->contact_sink);
+	GHashTableIter iter;
+	gpointer uid;
+	GError *gerror = NULL;
+
+	g_hash_table_iter_init(&iter, env->contact_committed);
+	while (g_hash_table_iter_next(&iter, &uid, NULL)) {
+		EContact *contact = NULL;
+		evo2_metrics_eds_call();
+		if (!e_book_get_contact(env->addressbook, (const char *)uid, &contact, &gerror)) {
+			osync_trace(TRACE_INTERNAL, "Unable to refresh hash of %s: %s", (const char *)uid, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			continue;
+		}
+
+		OSyncChange *change = osync_change_new(error);
+		if (!change) {
+			g_object_unref(contact);
+			return FALSE;
+		}
+		char *hash = evo2_ebook_contact_hash(contact);
+		osync_change_set_uid(change, (const char *)uid);
+		osync_change_set_hash(change, hash);
+		osync_change_set_changetype(change, OSYNC_CHANGE_TYPE_MODIFIED);
+		evo2_hashtable_update_change(table, change);
+		osync_change_unref(change);
+		g_free(hash);
+		g_object_unref(contact);
+	}
+	g_hash_table_remove_all(env->contact_committed);
+	return TRUE;
+}
+
+static void evo2_ebook_free_changes(GList *changes)
+{
+	GList *l = NULL;
+
+	for (l = changes; l; l = l->next) {
+		EBookChange *ebc = (EBookChange *)l->data;
+		g_object_unref(ebc->contact);
+		g_free(ebc);
+	}
+	evo2_metrics_mem_release(EVO2_MEM_CHANGE, g_list_length(changes), 0);
+	g_list_free(changes);
+}
+
 static void evo2_ebook_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *userdata)
 {
 	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %s, %p)", __func__, sink, info, ctx, slow_sync ? "TRUE" : "FALSE", userdata);
@@ -260,20 +1254,31 @@ static void evo2_ebook_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info
 	
 	GList *changes = NULL;
 	EBookChange *ebc = NULL;
-	EVCard vcard;
 	GList *l = NULL;
 	char *data = NULL;
 	char *uid = NULL;
-	int datasize = 0;
+	unsigned int datasize = 0;
 	GError *gerror = NULL;
+	GHashTable *matched = NULL;
+	OSyncChangeType type;
 	
-	if (slow_sync == FALSE) {
+	if (env->contact_hashed) {
+		if (!evo2_ebook_get_hashed_changes(env, sink, ctx, slow_sync, &error))
+			goto error;
+	} else if (slow_sync == FALSE) {
 		osync_trace(TRACE_INTERNAL, "No slow_sync for contact");
+		evo2_metrics_eds_call();
 		if (!e_book_get_changes(env->addressbook, env->change_id, &changes, &gerror)) {
 			osync_error_set(&error, OSYNC_ERROR_GENERIC, "Failed to alloc new default addressbook: %s", gerror ? gerror->message : "None");
 			goto error;
 		}
 		osync_trace(TRACE_INTERNAL, "Found %i changes for change-ID %s", g_list_length(changes), env->change_id);
+		env->contact_checkpoint = FALSE;
+		evo2_metrics_mem_acquire(EVO2_MEM_CHANGE, g_list_length(changes), 0);
+		if (env->contact_filter && !(matched = evo2_ebook_filter_changes(env, changes, &error))) {
+			evo2_ebook_free_changes(changes);
+			goto error;
+		}
 		
 		for (l = changes; l; l = l->next) {
 			ebc = (EBookChange *)l->data;
@@ -281,40 +1286,59 @@ static void evo2_ebook_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info
 			e_contact_set(ebc->contact, E_CONTACT_UID, NULL);
 			switch (ebc->change_type) {
 				case E_BOOK_CHANGE_CARD_ADDED:
-					vcard = ebc->contact->parent;
-					data = e_vcard_to_string(&vcard, EVC_FORMAT_VCARD_30);
-					datasize = strlen(data) + 1;
-					evo2_report_change(ctx, env->contact_format, data, datasize, uid, OSYNC_CHANGE_TYPE_ADDED);
+					type = OSYNC_CHANGE_TYPE_ADDED;
 					break;
 				case E_BOOK_CHANGE_CARD_MODIFIED:
-					vcard = ebc->contact->parent;
-					data = e_vcard_to_string(&vcard, EVC_FORMAT_VCARD_30);
-					datasize = strlen(data) + 1;
-					evo2_report_change(ctx, env->contact_format, data, datasize, uid, OSYNC_CHANGE_TYPE_MODIFIED);
+					type = OSYNC_CHANGE_TYPE_MODIFIED;
 					break;
-				case E_BOOK_CHANGE_CARD_DELETED:
-					evo2_report_change(ctx, env->contact_format, NULL, 0, uid, OSYNC_CHANGE_TYPE_DELETED);
+				default:
+					type = OSYNC_CHANGE_TYPE_DELETED;
 					break;
 			}
+			if (env->contact_tracked) {
+				/* what the change means to the peer */
+				osync_bool has = evo2_ebook_peer_has(env, uid);
+				if (type != OSYNC_CHANGE_TYPE_DELETED && !g_hash_table_lookup_extended(matched, uid, NULL, NULL))
+					type = OSYNC_CHANGE_TYPE_DELETED;
+				if (type == OSYNC_CHANGE_TYPE_DELETED && !has) {
+					g_free(uid);
+					continue;
+				}
+				if (type != OSYNC_CHANGE_TYPE_DELETED)
+					type = has ? OSYNC_CHANGE_TYPE_MODIFIED : OSYNC_CHANGE_TYPE_ADDED;
+				evo2_ebook_peer_track(env, uid, type);
+			}
+			if (type == OSYNC_CHANGE_TYPE_DELETED) {
+				evo2_report_change(ctx, env->contact_format, NULL, 0, uid, type);
+			} else {
+				data = evo2_ebook_serialize(env, ebc->contact, &datasize);
+				evo2_report_change(ctx, env->contact_format, data, datasize, uid, type);
+			}
 			g_free(uid);
 		}
+		if (matched)
+			g_hash_table_destroy(matched);
+		evo2_ebook_free_changes(changes);
 	} else {
 		osync_trace(TRACE_INTERNAL, "slow_sync for contact");
-		EBookQuery *query = e_book_query_any_field_contains("");
-		if (!e_book_get_contacts(env->addressbook, query, &changes, &gerror)) {
-			osync_error_set(&error, OSYNC_ERROR_GENERIC, "Failed to get changes from addressbook: %s", gerror ? gerror->message : "None");
+		OSyncEvoBookStream stream;
+		memset(&stream, 0, sizeof(stream));
+		stream.env = env;
+		stream.ctx = ctx;
+
+		if (env->contact_tracked && !evo2_hashtable_slowsync(osync_objtype_sink_get_hashtable(sink), &error))
 			goto error;
-		}
-		for (l = changes; l; l = l->next) {
-			EContact *contact = E_CONTACT(l->data);
-			vcard = contact->parent;
-			data = e_vcard_to_string(&vcard, EVC_FORMAT_VCARD_30);
-			uid = g_strdup(e_contact_get_const(contact, E_CONTACT_UID));
-			datasize = strlen(data) + 1;
-			evo2_report_change(ctx, env->contact_format, data, datasize, uid, OSYNC_CHANGE_TYPE_ADDED);
-			g_free(uid);
-		}
+		if (env->contact_filter)
+			evo2_ebook_uid_index_drop(env);
+		else
+			evo2_ebook_uid_index_reset(env);
+		EBookQuery *query = evo2_ebook_query(env);
+		osync_bool streamed = evo2_ebook_run_view(&stream, query, env->contact_view_fields, G_CALLBACK(evo2_ebook_stream_contacts_added), &error);
 		e_book_query_unref(query);
+		if (!streamed) {
+			evo2_ebook_uid_index_drop(env);
+			goto error;
+		}
 	}
 	
 	osync_context_report_success(ctx);
@@ -330,6 +1354,284 @@ error:
 	osync_error_unref(&error);
 }
 
+/* Batch commit mode: with ContactBatchSize > 1 the commit function only
+ * queues the change and keeps a reference on its context. Once a batch is
+ * full, and again from committed_all, the queue is flushed: all deletions
+ * go to the backend in a single e_book_remove_contacts() call (one by one
+ * if it fails, so that each context gets its own result), additions and
+ * modifications are issued asynchronously so that the whole batch is in
+ * flight at once. Each context is completed when its result arrives. */
+typedef struct OSyncEvoBookOp {
+	OSyncEvoEnv *env;
+	OSyncContext *ctx;
+	OSyncChange *change;
+	OSyncChangeType type;
+	EContact *contact;
+	gsize footprint;
+	char *inflight_uid;
+} OSyncEvoBookOp;
+
+/* Async commits form a pipeline: up to MaxInFlight requests are
+ * outstanding at a time, and a request for a UID waits until the one
+ * before it for the same UID has completed. flush only issues; the
+ * replies are collected while waiting for a slot and drained by
+ * committed_all and disconnect. */
+static void evo2_ebook_wait(OSyncEvoEnv *env, unsigned int window, const char *uid)
+{
+	while ((window && env->contact_inflight >= window)
+	       || (uid && g_hash_table_lookup(env->contact_inflight_uids, uid)))
+		g_main_context_iteration(g_main_context_get_thread_default(), TRUE);
+}
+
+static void evo2_ebook_drain(OSyncEvoEnv *env)
+{
+	evo2_ebook_wait(env, 1, NULL);
+}
+
+static void evo2_ebook_op_issued(OSyncEvoBookOp *op, const char *uid)
+{
+	OSyncEvoEnv *env = op->env;
+
+	env->contact_inflight++;
+	if (uid) {
+		op->inflight_uid = g_strdup(uid);
+		g_hash_table_insert(env->contact_inflight_uids, op->inflight_uid, op);
+	}
+	evo2_metrics_inflight(env->contact_inflight);
+}
+
+static void evo2_ebook_op_landed(OSyncEvoBookOp *op)
+{
+	OSyncEvoEnv *env = op->env;
+
+	env->contact_inflight--;
+	if (op->inflight_uid) {
+		g_hash_table_remove(env->contact_inflight_uids, op->inflight_uid);
+		g_free(op->inflight_uid);
+		op->inflight_uid = NULL;
+	}
+}
+
+static void evo2_ebook_op_finish(OSyncEvoBookOp *op, OSyncError *error)
+{
+	if (error) {
+		osync_context_report_osyncerror(op->ctx, error);
+	} else {
+		op->env->contact_checkpoint = TRUE;
+		evo2_ebook_hash_committed(op->env, op->change);
+		evo2_ebook_blobs_committed(op->env, op->change, op->contact);
+		osync_context_report_success(op->ctx);
+	}
+
+	osync_context_unref(op->ctx);
+	osync_change_unref(op->change);
+	if (op->contact) {
+		evo2_metrics_mem_release(EVO2_MEM_CONTACT, 1, op->footprint);
+		g_object_unref(op->contact);
+	}
+	g_free(op);
+}
+
+static void evo2_ebook_op_failed(OSyncEvoBookOp *op, const char *what, EBookStatus status)
+{
+	OSyncError *error = NULL;
+
+	osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to %s contact: status %i", what, status);
+	evo2_ebook_op_finish(op, error);
+	osync_error_unref(&error);
+}
+
+static void evo2_ebook_op_added(EBook *book, EBookStatus status, const char *id, gpointer closure)
+{
+	OSyncEvoBookOp *op = (OSyncEvoBookOp *)closure;
+
+	evo2_ebook_op_landed(op);
+	if (status != E_BOOK_ERROR_OK) {
+		evo2_ebook_op_failed(op, "add", status);
+		return;
+	}
+
+	osync_change_set_uid(op->change, id);
+	evo2_uid_index_insert(op->env->contact_uids, id);
+	evo2_ebook_op_finish(op, NULL);
+}
+
+static void evo2_ebook_op_committed(EBook *book, EBookStatus status, gpointer closure)
+{
+	OSyncEvoBookOp *op = (OSyncEvoBookOp *)closure;
+
+	if (status != E_BOOK_ERROR_OK) {
+		/* try to add */
+		osync_trace(TRACE_INTERNAL, "unable to mod contact: status %i", status);
+		evo2_metrics_eds_call();
+		if (!e_book_async_add_contact(book, op->contact, evo2_ebook_op_added, op))
+			return;
+		evo2_ebook_op_landed(op);
+		evo2_ebook_op_failed(op, "modify", status);
+		return;
+	}
+
+	evo2_ebook_op_landed(op);
+	evo2_ebook_op_finish(op, NULL);
+}
+
+/* Deletes the contacts of the collected removals with a single call */
+static void evo2_ebook_remove_batch(OSyncEvoEnv *env, GList **removals, GList **ids)
+{
+	GError *gerror = NULL;
+	OSyncError *error = NULL;
+	OSyncEvoBookOp *op = NULL;
+	const char *uid = NULL;
+	GList *l = NULL;
+
+	for (l = *ids; l; l = l->next)
+		evo2_ebook_wait(env, 0, (const char *) l->data);
+
+	evo2_metrics_eds_call();
+	if (e_book_remove_contacts(env->addressbook, *ids, &gerror)) {
+		for (l = *removals; l; l = l->next) {
+			op = (OSyncEvoBookOp *)l->data;
+			evo2_uid_index_remove(env->contact_uids, osync_change_get_uid(op->change));
+			evo2_ebook_op_finish(op, NULL);
+		}
+		goto out;
+	}
+
+	/* the backend may have removed some of them, so every delete
+	 * gets a result of its own */
+	osync_trace(TRACE_INTERNAL, "Unable to delete %u contacts at once, deleting one by one: %s", g_list_length(*ids), gerror ? gerror->message : "None");
+	g_clear_error(&gerror);
+	for (l = *removals; l; l = l->next) {
+		op = (OSyncEvoBookOp *)l->data;
+		uid = osync_change_get_uid(op->change);
+		evo2_metrics_eds_call();
+		if (!e_book_remove_contact(env->addressbook, uid, &gerror)) {
+			osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to delete contact: %s", gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			evo2_ebook_op_finish(op, error);
+			osync_error_unref(&error);
+			continue;
+		}
+		evo2_uid_index_remove(env->contact_uids, uid);
+		evo2_ebook_op_finish(op, NULL);
+	}
+
+ out:
+	g_list_free(*removals);
+	g_list_free(*ids);
+	*removals = NULL;
+	*ids = NULL;
+}
+
+static void evo2_ebook_flush(OSyncEvoEnv *env)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, env);
+	OSyncEvoBookOp *op = NULL;
+	GList *removals = NULL, *ids = NULL;
+	const char *uid = NULL;
+	unsigned int issued = 0;
+
+	while ((op = g_queue_pop_head(env->contact_queue))) {
+		switch (op->type) {
+			case OSYNC_CHANGE_TYPE_DELETED:
+				removals = g_list_prepend(removals, op);
+				ids = g_list_prepend(ids, (gpointer) osync_change_get_uid(op->change));
+				break;
+			case OSYNC_CHANGE_TYPE_ADDED:
+				evo2_ebook_wait(env, env->contact_max_inflight, NULL);
+				evo2_metrics_eds_call();
+				if (e_book_async_add_contact(env->addressbook, op->contact, evo2_ebook_op_added, op)) {
+					evo2_ebook_op_failed(op, "add", E_BOOK_ERROR_OTHER_ERROR);
+					break;
+				}
+				evo2_ebook_op_issued(op, NULL);
+				issued++;
+				break;
+			case OSYNC_CHANGE_TYPE_MODIFIED:
+				uid = osync_change_get_uid(op->change);
+				/* keep a delete queued before it in front */
+				if (g_list_find_custom(ids, uid, (GCompareFunc) strcmp))
+					evo2_ebook_remove_batch(env, &removals, &ids);
+				evo2_ebook_wait(env, env->contact_max_inflight, uid);
+				if (!evo2_ebook_has_uid(env, uid)) {
+					evo2_metrics_eds_call();
+					if (e_book_async_add_contact(env->addressbook, op->contact, evo2_ebook_op_added, op)) {
+						evo2_ebook_op_failed(op, "add", E_BOOK_ERROR_OTHER_ERROR);
+						break;
+					}
+					evo2_ebook_op_issued(op, uid);
+					issued++;
+					break;
+				}
+				evo2_ebook_project_merge(env, op->contact, uid);
+				evo2_metrics_eds_call();
+				if (e_book_async_commit_contact(env->addressbook, op->contact, evo2_ebook_op_committed, op)) {
+					evo2_ebook_op_failed(op, "modify", E_BOOK_ERROR_OTHER_ERROR);
+					break;
+				}
+				evo2_ebook_op_issued(op, uid);
+				issued++;
+				break;
+			default:
+				evo2_ebook_op_failed(op, "commit", E_BOOK_ERROR_OTHER_ERROR);
+		}
+	}
+
+	if (removals)
+		evo2_ebook_remove_batch(env, &removals, &ids);
+
+	osync_trace(TRACE_EXIT, "%s: %u issued, %u in flight", __func__, issued, env->contact_inflight);
+}
+
+static void evo2_ebook_queue_change(OSyncEvoEnv *env, OSyncContext *ctx, OSyncChange *change)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, env, ctx, change);
+	OSyncEvoBookOp *op = NULL;
+	OSyncError *error = NULL;
+
+	op = osync_try_malloc0(sizeof(OSyncEvoBookOp), &error);
+	if (!op) {
+		osync_context_report_osyncerror(ctx, error);
+		osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+		osync_error_unref(&error);
+		return;
+	}
+	op->env = env;
+	op->ctx = osync_context_ref(ctx);
+	op->change = osync_change_ref(change);
+	op->type = osync_change_get_changetype(change);
+
+	if (op->type == OSYNC_CHANGE_TYPE_ADDED || op->type == OSYNC_CHANGE_TYPE_MODIFIED) {
+		op->contact = evo2_ebook_parse(env, change);
+		if (op->type == OSYNC_CHANGE_TYPE_ADDED)
+			e_contact_set(op->contact, E_CONTACT_UID, NULL);
+		else
+			e_contact_set(op->contact, E_CONTACT_UID, (gpointer) osync_change_get_uid(change));
+		if (op->type == OSYNC_CHANGE_TYPE_MODIFIED)
+			evo2_ebook_blobs_restore(env, op->contact, osync_change_get_uid(change));
+		op->footprint = evo2_ebook_footprint(op->contact);
+		evo2_metrics_mem_acquire(EVO2_MEM_CONTACT, 1, op->footprint);
+	}
+
+	g_queue_push_tail(env->contact_queue, op);
+	if (g_queue_get_length(env->contact_queue) >= env->contact_batch_size)
+		evo2_ebook_flush(env);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+}
+
+static void evo2_ebook_committed_all(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, sink, info, ctx, userdata);
+	OSyncEvoEnv *env = (OSyncEvoEnv *)userdata;
+
+	evo2_ebook_flush(env);
+	evo2_ebook_drain(env);
+	osync_context_report_success(ctx);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+}
+
 static void evo2_ebook_modify(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change, void *userdata)
 {
 	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p, %p)", __func__, sink, info, ctx, change, userdata);
@@ -339,58 +1641,72 @@ static void evo2_ebook_modify(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
 	EContact *contact = NULL;
 	GError *gerror = NULL;
 	OSyncError *error = NULL;
-	OSyncData *odata = NULL;
-	char *plain = NULL;
+
+	if (env->contact_batch_size > 1) {
+		evo2_ebook_queue_change(env, ctx, change);
+		osync_trace(TRACE_EXIT, "%s: queued", __func__);
+		return;
+	}
+
 	switch (osync_change_get_changetype(change)) {
 		case OSYNC_CHANGE_TYPE_DELETED:
+			evo2_metrics_eds_call();
 			if (!e_book_remove_contact(env->addressbook, uid, &gerror)) {
 				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to delete contact: %s", gerror ? gerror->message : "None");
 				goto error;
 			}
+			evo2_uid_index_remove(env->contact_uids, uid);
 			break;
 		case OSYNC_CHANGE_TYPE_ADDED:
-			odata = osync_change_get_data(change);
-			osync_data_get_data(odata, &plain, NULL);
-			contact = e_contact_new_from_vcard(plain);
+			contact = evo2_ebook_parse(env, change);
 			e_contact_set(contact, E_CONTACT_UID, NULL);
+			evo2_metrics_eds_call();
 			if (e_book_add_contact(env->addressbook, contact, &gerror)) {
 				uid = e_contact_get_const(contact, E_CONTACT_UID);
 				osync_change_set_uid(change, uid);
+				evo2_uid_index_insert(env->contact_uids, uid);
 			} else {
 				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to add contact: %s", gerror ? gerror->message : "None");
 				goto error;
 			}
 			break;
 		case OSYNC_CHANGE_TYPE_MODIFIED:
-			odata = osync_change_get_data(change);
-			osync_data_get_data(odata, &plain, NULL);
-			
-			contact = e_contact_new_from_vcard(plain);
-			e_contact_set(contact, E_CONTACT_UID, g_strdup(uid));
+			contact = evo2_ebook_parse(env, change);
+			e_contact_set(contact, E_CONTACT_UID, (gpointer) uid);
+			evo2_ebook_blobs_restore(env, contact, uid);
 			
-			osync_trace(TRACE_INTERNAL, "ABout to modify vcard:\n%s", e_vcard_to_string(&(contact->parent), EVC_FORMAT_VCARD_30));
-			
-			if (e_book_commit_contact(env->addressbook, contact, &gerror)) {
-				uid = e_contact_get_const (contact, E_CONTACT_UID);
-				if (uid)
-					osync_change_set_uid(change, uid);
-			} else {
-				/* try to add */
+			if (evo2_ebook_has_uid(env, uid)) {
+				evo2_ebook_project_merge(env, contact, uid);
+				evo2_metrics_eds_call();
+				if (e_book_commit_contact(env->addressbook, contact, &gerror)) {
+					uid = e_contact_get_const (contact, E_CONTACT_UID);
+					if (uid)
+						osync_change_set_uid(change, uid);
+					break;
+				}
 				osync_trace(TRACE_INTERNAL, "unable to mod contact: %s", gerror ? gerror->message : "None");
-				
 				g_clear_error(&gerror);
-				if (e_book_add_contact(env->addressbook, contact, &gerror)) {
-					uid = e_contact_get_const(contact, E_CONTACT_UID);
-					osync_change_set_uid(change, uid);
-				} else {
-					osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to modify contact: %s", gerror ? gerror->message : "None");
-					goto error;
-				}
+			}
+
+			/* not in the book, add it */
+			evo2_metrics_eds_call();
+			if (e_book_add_contact(env->addressbook, contact, &gerror)) {
+				uid = e_contact_get_const(contact, E_CONTACT_UID);
+				osync_change_set_uid(change, uid);
+				evo2_uid_index_insert(env->contact_uids, uid);
+			} else {
+				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to modify contact: %s", gerror ? gerror->message : "None");
+				goto error;
 			}
 			break;
 		default:
 			printf("Error\n");
 	}
+	env->contact_checkpoint = TRUE;
+	evo2_ebook_hash_committed(env, change);
+	evo2_ebook_blobs_committed(env, change, contact);
+	if (contact)
+		g_object_unref(contact);
 	
 	osync_context_report_success(ctx);
 	
@@ -398,6 +1714,8 @@ static void evo2_ebook_modify(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
 	return;
 
 error:
+	if (contact)
+		g_object_unref(contact);
 	if (gerror)
 		g_clear_error(&gerror);
 	osync_context_report_osyncerror(ctx, error);
@@ -429,6 +1747,30 @@ osync_bool evo2_ebook_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, OSyncE
 
 	osync_objtype_sink_enable_state_db(sink, TRUE);
 
+	if (!strcmp(evo2_config_get_string(info, "ChangeDetection", "backend"), "hashtable")) {
+		osync_objtype_sink_enable_hashtable(sink, TRUE);
+		env->contact_hashed = TRUE;
+		env->contact_committed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	env->contact_batch_size = evo2_config_get_uint(info, "ContactBatchSize", EVO2_DEFAULT_COMMIT_BATCH_SIZE);
+	if (env->contact_batch_size > 1) {
+		env->contact_queue = g_queue_new();
+		env->contact_max_inflight = evo2_config_get_uint(info, "MaxInFlight", EVO2_DEFAULT_MAX_INFLIGHT);
+		env->contact_inflight_uids = g_hash_table_new(g_str_hash, g_str_equal);
+		osync_objtype_sink_set_committed_all_func(sink, evo2_ebook_committed_all);
+	}
+
+	env->contact_filter_expr = evo2_config_get_string(info, "ContactFilter", NULL);
+	if (env->contact_filter_expr && *env->contact_filter_expr && !env->contact_hashed) {
+		osync_objtype_sink_enable_hashtable(sink, TRUE);
+		env->contact_tracked = TRUE;
+	}
+	env->contact_blob_dedup = evo2_config_get_uint(info, "ContactBlobDedup", 0);
+	env->contact_fields = evo2_config_get_string(info, "ContactFields", NULL);
+	if (env->contact_fields && *env->contact_fields)
+		env->contact_field_names = g_strsplit_set(env->contact_fields, ", ", -1);
+
 	OSyncPluginConfig *config = osync_plugin_info_get_config(info);
 	OSyncPluginResource *resource = osync_plugin_config_find_active_resource(config, "contact");
 	env->addressbook_path = osync_plugin_resource_get_url(resource);
@@ -441,7 +1783,9 @@ osync_bool evo2_ebook_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, OSyncE
 	OSyncList *r;
 	for(r = objformatsinks;r;r = r->next) {
 		OSyncObjFormatSink *objformatsink = r->data;
-		if(!strcmp("vcard30", osync_objformat_sink_get_objformat(objformatsink))) { hasObjFormat = TRUE; break;}
+		const char *objformat = osync_objformat_sink_get_objformat(objformatsink);
+		if(!strcmp("evo2-contact", objformat)) { hasObjFormat = TRUE; env->contact_native = TRUE; break;}
+		if(!strcmp("vcard30", objformat)) { hasObjFormat = TRUE; }
 	}
 	osync_list_free(objformatsinks);
         if (!hasObjFormat) {
@@ -450,12 +1794,26 @@ osync_bool evo2_ebook_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, OSyncE
 	}
 
 	OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-	env->contact_format = osync_format_env_find_objformat(formatenv, "vcard30");
+	env->contact_format = osync_format_env_find_objformat(formatenv, env->contact_native ? "evo2-contact" : "vcard30");
 	assert(env->contact_format);
 
 	env->contact_sink = osync_objtype_sink_ref(sink);
 
 	osync_objtype_sink_set_userdata(sink, env);
+
+	OSyncEvoMetrics *metrics = evo2_sink_metrics_new(env, "contact", env, error);
+	if (!metrics)
+		goto error;
+	metrics->connect = evo2_ebook_connect;
+	metrics->disconnect = evo2_ebook_disconnect;
+	metrics->get_changes = evo2_ebook_get_changes;
+	metrics->commit = evo2_ebook_modify;
+	metrics->committed_all = env->contact_queue ? evo2_ebook_committed_all : NULL;
+	metrics->sync_done = evo2_ebook_sync_done;
+
+	if (env->parallel && !(env->contact_worker = evo2_worker_new("contact", metrics, error)))
+		goto error;
+	evo2_metrics_attach(metrics, sink, env->contact_worker);
 	osync_trace(TRACE_EXIT, "%s", __func__);
 	return TRUE;
 
@@ -18,6 +18,7 @@
  * 
  */
  
+#include <stdlib.h>
 #include <string.h>
 #include <glib.h>
 
@@ -29,41 +30,67 @@
 
 #include "evolution2_capabilities.h"
 #include "evolution2_ecal.h"
+#include "evolution2_record.h"
 
-ECal *evo2_ecal_open_cal(const char *path, ECalSourceType source_type, OSyncError **error)
+static void evo2_ecal_flush(OSyncEvoCalendar *evo_cal);
+static void evo2_ecal_commit_orphans(OSyncEvoCalendar *evo_cal);
+static osync_bool evo2_ecal_window_store(OSyncEvoCalendar *evo_cal, OSyncObjTypeSink *sink, OSyncError **error);
+static osync_bool evo2_ecal_has_uid(OSyncEvoCalendar *evo_cal, const char *uid);
+
+/* Creates the ECal of a configured source or URI without opening it */
+static ECal *evo2_ecal_new_cal(OSyncEvoEnv *env, const char *path, ECalSourceType source_type, OSyncError **error)
 {
 	ECal *calendar = NULL;
 	GError *gerror = NULL;
         ESourceList *sources = NULL;
         ESource *source = NULL;
 
+        if (!env->cal_sources[source_type]) {
+                if (!e_cal_get_sources(&sources,source_type, &gerror)) {
+                        osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to get sources for calendar: %s", gerror ? gerror->message : "None");
+                        g_clear_error(&gerror);
+                        return NULL;
+                }
+                env->cal_sources[source_type] = evo2_source_index_new(sources);
+        }
+
+        if ((source = evo2_source_index_lookup(env->cal_sources[source_type], path))) {
+                calendar = e_cal_new(source, source_type);
+                g_object_unref(source);
+        } else if (strstr(path, "://")) {
+                /* not a configured source, e.g. a file:// calendar */
+                calendar = e_cal_new_from_uri(path, source_type);
+        } else {
+                osync_error_set(error, OSYNC_ERROR_GENERIC, "Error finding source \"%s\"", path);
+                return NULL;
+        }
+        if (!calendar)
+                osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to create new calendar");
+	return calendar;
+}
+
+ECal *evo2_ecal_open_cal(OSyncEvoEnv *env, const char *path, ECalSourceType source_type, OSyncError **error)
+{
+	ECal *calendar = NULL;
+	GError *gerror = NULL;
+
 	if (!path) {
                 osync_error_set(error, OSYNC_ERROR_GENERIC, "No path set");
                 goto error;
         }
 
         if (strcmp(path, "default")) {
-                if (!e_cal_get_sources(&sources,source_type, &gerror)) {
-                        osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to get sources for calendar: %s", gerror ? gerror->message : "None");
-                        goto error;
-                }
-                
-                if (!(source = evo2_find_source(sources, path))) {
-                        osync_error_set(error, OSYNC_ERROR_GENERIC, "Error finding source \"%s\"", path);
-                        goto error;
-                }
- 
-                if (!(calendar = e_cal_new(source, source_type))) {
-                        osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to create new calendar");
+                if (!(calendar = evo2_ecal_new_cal(env, path, source_type, error)))
 			goto error;
-		}
 
+		evo2_metrics_eds_call();
 		if(!e_cal_open(calendar, FALSE, &gerror)) {
                         osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to open calendar: %s", gerror ? gerror->message : "None");
                         goto error_free_event;
                 }
         } else {
                 osync_trace(TRACE_INTERNAL, "Opening default calendar\n");
+                evo2_metrics_eds_call();
                 if (!e_cal_open_default(&calendar, source_type, NULL, NULL, &gerror)) {
                         osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to open default calendar: %s", gerror ? gerror->message : "None");
                         goto error_free_event;
@@ -81,14 +108,364 @@ ECal *evo2_ecal_open_cal(const char *path, ECalSourceType source_type, OSyncErro
 	return NULL;
 }
 
+/* Returns a reference on the cached calendar, opening it on first use */
+static ECal *evo2_ecal_get_cal(OSyncEvoCalendar *evo_cal, OSyncError **error)
+{
+	char *key = evo2_handle_key(evo_cal->objtype, evo_cal->uri);
+	ECal *cal = (ECal *)evo2_handle_lookup(evo_cal->env, key);
+
+	if (!cal && (cal = evo2_ecal_open_cal(evo_cal->env, evo_cal->uri, evo_cal->source_type, error)))
+		evo2_handle_store(evo_cal->env, key, G_OBJECT(cal));
+
+	g_free(key);
+	return cal;
+}
+
+/* A resource Url listing several sources, separated by "|", makes the
+ * sink aggregate them: each source is a member OSyncEvoCalendar with its
+ * own ECal, queue and indexes. The UIDs it reports are qualified with a
+ * prefix derived from its Url, commits are routed back by that prefix and
+ * new entries go to the first source, except for a new detached instance,
+ * which goes to the source holding its series. */
+static void evo2_ecal_change_set_uid(OSyncEvoCalendar *evo_cal, OSyncChange *change, const char *uid)
+{
+	char *qualified = NULL;
+
+	if (!evo_cal->uid_prefix || !uid) {
+		osync_change_set_uid(change, uid);
+		return;
+	}
+	qualified = g_strconcat(evo_cal->uid_prefix, uid, NULL);
+	osync_change_set_uid(change, qualified);
+	g_free(qualified);
+}
+
+/* The UID of change in the member's calendar */
+static const char *evo2_ecal_change_get_uid(OSyncEvoCalendar *evo_cal, OSyncChange *change)
+{
+	const char *uid = osync_change_get_uid(change);
+
+	if (evo_cal->uid_prefix && uid && g_str_has_prefix(uid, evo_cal->uid_prefix))
+		return uid + strlen(evo_cal->uid_prefix);
+	return uid;
+}
+
+static OSyncEvoCalendar *evo2_ecal_route_uid(OSyncEvoCalendar *evo_cal, const char *uid)
+{
+	GList *m;
+
+	for (m = evo_cal->members; uid && m; m = m->next) {
+		OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+		if (member->uid_prefix && g_str_has_prefix(uid, member->uid_prefix))
+			return member;
+	}
+	return NULL;
+}
+
+/* The source holding the series of a new detached instance, if any.
+ * vcal is the parsed entry of the change. */
+static OSyncEvoCalendar *evo2_ecal_route_instance(OSyncEvoCalendar *evo_cal, icalcomponent *vcal)
+{
+	OSyncEvoCalendar *member = NULL;
+	icalcomponent *icomp = NULL;
+	const char *series = NULL;
+	GList *m;
+
+	if (!vcal)
+		return NULL;
+
+	icomp = icalcomponent_get_first_component(vcal, evo_cal->ical_component);
+	if (icomp && !icaltime_is_null_time(icalcomponent_get_recurrenceid(icomp))
+	    && (series = icalcomponent_get_uid(icomp))) {
+		/* entries carry the UID of their source, unqualified */
+		for (m = evo_cal->members; m && !member; m = m->next) {
+			if (evo2_ecal_has_uid((OSyncEvoCalendar *)m->data, series))
+				member = (OSyncEvoCalendar *)m->data;
+		}
+	}
+	return member;
+}
+
+/* vcal is the parsed entry of an added change, see evo2_ecal_modify() */
+static OSyncEvoCalendar *evo2_ecal_route(OSyncEvoCalendar *evo_cal, OSyncChange *change, icalcomponent *vcal)
+{
+	OSyncEvoCalendar *member = NULL;
+
+	if (!evo_cal->members->next)
+		return (OSyncEvoCalendar *)evo_cal->members->data;
+
+	if (osync_change_get_changetype(change) != OSYNC_CHANGE_TYPE_ADDED)
+		member = evo2_ecal_route_uid(evo_cal, osync_change_get_uid(change));
+	else
+		member = evo2_ecal_route_instance(evo_cal, vcal);
+	return member ? member : (OSyncEvoCalendar *)evo_cal->members->data;
+}
+
+/* Detached instances of a recurring series (components carrying a
+ * RECURRENCE-ID) are changes of their own: their UID towards OpenSync is
+ * the series UID, EVO2_INSTANCE_SEPARATOR and the RECURRENCE-ID, and they
+ * are committed with CALOBJ_MOD_THIS, so editing one occurrence neither
+ * rewrites the series in the backend nor reports it again. */
+static char *evo2_ecal_component_uid(icalcomponent *icomp)
+{
+	struct icaltimetype rid = icalcomponent_get_recurrenceid(icomp);
+	char *ridstr = NULL, *uid = NULL;
+
+	if (icaltime_is_null_time(rid))
+		return g_strdup(icalcomponent_get_uid(icomp));
+
+	ridstr = icaltime_as_ical_string_r(rid);
+	uid = g_strconcat(icalcomponent_get_uid(icomp), EVO2_INSTANCE_SEPARATOR, ridstr, NULL);
+	free(ridstr);
+	return uid;
+}
+
+/* Returns the series UID of uid, setting *rid to the RECURRENCE-ID of an
+ * instance or NULL. Free both with g_free(). */
+static char *evo2_ecal_split_uid(const char *uid, char **rid)
+{
+	const char *sep = strrchr(uid, EVO2_INSTANCE_SEPARATOR[0]);
+
+	*rid = NULL;
+	if (!sep || icaltime_is_null_time(icaltime_from_string(sep + 1)))
+		return g_strdup(uid);
+
+	*rid = g_strdup(sep + 1);
+	return g_strndup(uid, sep - uid);
+}
+
+typedef struct OSyncEvoCalOpen {
+	OSyncEvoCalendar *member;
+	ECal *cal;
+	ECalendarStatus status;
+	unsigned int *pending;
+} OSyncEvoCalOpen;
+
+static void evo2_ecal_opened(ECal *cal, ECalendarStatus status, gpointer userdata)
+{
+	OSyncEvoCalOpen *opening = (OSyncEvoCalOpen *)userdata;
+
+	opening->status = status;
+	(*opening->pending)--;
+}
+
+/* Opens all sources of the sink. Sources missing from the handle cache
+ * are opened with e_cal_open_async() at the same time, so their backends
+ * load in parallel rather than one after the other. */
+static osync_bool evo2_ecal_open_members(OSyncEvoCalendar *evo_cal, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __func__, evo_cal, error);
+	OSyncEvoCalOpen *opening = NULL;
+	GList *m = NULL, *opens = NULL, *o = NULL;
+	unsigned int pending = 0;
+	char *key = NULL;
+
+	for (m = evo_cal->members; m && !osync_error_is_set(error); m = m->next) {
+		OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+
+		key = evo2_handle_key(member->objtype, member->uri);
+		member->calendar = (ECal *)evo2_handle_lookup(evo_cal->env, key);
+		g_free(key);
+		if (member->calendar)
+			continue;
+		if (!strcmp(member->uri, "default")) {
+			member->calendar = evo2_ecal_get_cal(member, error);
+			continue;
+		}
+
+		ECal *cal = evo2_ecal_new_cal(evo_cal->env, member->uri, member->source_type, error);
+		if (!cal)
+			break;
+		opening = g_new0(OSyncEvoCalOpen, 1);
+		opening->member = member;
+		opening->cal = cal;
+		opening->pending = &pending;
+		opens = g_list_prepend(opens, opening);
+
+		g_signal_connect(cal, "cal_opened", G_CALLBACK(evo2_ecal_opened), opening);
+		evo2_metrics_eds_call();
+		e_cal_open_async(cal, FALSE);
+		pending++;
+	}
+
+	osync_trace(TRACE_INTERNAL, "Waiting for %u %s sources to open", pending, evo_cal->objtype);
+	while (pending)
+		g_main_context_iteration(g_main_context_get_thread_default(), TRUE);
+
+	for (o = opens; o; o = o->next) {
+		opening = (OSyncEvoCalOpen *)o->data;
+		g_signal_handlers_disconnect_matched(opening->cal, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, opening);
+		if (opening->status != E_CALENDAR_STATUS_OK) {
+			if (!osync_error_is_set(error))
+				osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to open calendar \"%s\": status %i", opening->member->uri, opening->status);
+			g_object_unref(opening->cal);
+		} else {
+			key = evo2_handle_key(opening->member->objtype, opening->member->uri);
+			evo2_handle_store(evo_cal->env, key, G_OBJECT(opening->cal));
+			g_free(key);
+			opening->member->calendar = opening->cal;
+		}
+		g_free(opening);
+	}
+	g_list_free(opens);
+
+	if (osync_error_is_set(error))
+		goto error;
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+static void evo2_ecal_close_members(OSyncEvoCalendar *evo_cal)
+{
+	GList *m;
+
+	for (m = evo_cal->members; m; m = m->next) {
+		OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+		if (member->calendar) {
+			g_object_unref(member->calendar);
+			member->calendar = NULL;
+		}
+	}
+}
+
+/* Hashtable change detection (ChangeDetection=hashtable): the sink's
+ * OpenSync hashtable keeps LAST-MODIFIED and SEQUENCE of every UID, or a
+ * checksum of the component if it has no LAST-MODIFIED. get_changes
+ * compares each component it reads against it and only converts and
+ * reports the ones that differ; UIDs not seen are reported deleted. */
+static char *evo2_ecal_component_hash(icalcomponent *icomp)
+{
+	icalproperty *prop = icalcomponent_get_first_property(icomp, ICAL_LASTMODIFIED_PROPERTY);
+	char *ical = NULL, *hash = NULL;
+
+	if (prop)
+		return g_strdup_printf("%ld-%i", (long) icaltime_as_timet(icalproperty_get_lastmodified(prop)), icalcomponent_get_sequence(icomp));
+
+	ical = icalcomponent_as_ical_string_r(icomp);
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, ical, -1);
+	free(ical);
+	return hash;
+}
+
+/* Records a successful commit in the hashtable. The backend may stamp a
+ * new LAST-MODIFIED, so the real hash is looked up in sync_done. */
+static void evo2_ecal_hash_committed(OSyncEvoCalendar *evo_cal, OSyncChange *change)
+{
+	if (!evo_cal->hashed)
+		return;
+
+	osync_change_set_hash(change, "");
+	evo2_hashtable_update_change(osync_objtype_sink_get_hashtable(evo_cal->sink), change);
+	if (osync_change_get_changetype(change) != OSYNC_CHANGE_TYPE_DELETED)
+		g_hash_table_replace(evo_cal->committed, g_strdup(evo2_ecal_change_get_uid(evo_cal, change)), NULL);
+}
+
+static osync_bool evo2_ecal_hash_refresh(OSyncEvoCalendar *evo_cal, OSyncError **error)
+{
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(evo_cal->sink);
+	GHashTableIter iter;
+	gpointer uid;
+	GError *gerror = NULL;
+
+	g_hash_table_iter_init(&iter, evo_cal->committed);
+	while (g_hash_table_iter_next(&iter, &uid, NULL)) {
+		icalcomponent *icomp = NULL;
+		char *rid = NULL, *series = evo2_ecal_split_uid((const char *)uid, &rid);
+		evo2_metrics_eds_call();
+		osync_bool found = e_cal_get_object(evo_cal->calendar, series, rid, &icomp, &gerror);
+		g_free(series);
+		g_free(rid);
+		if (!found) {
+			osync_trace(TRACE_INTERNAL, "Unable to refresh hash of %s: %s", (const char *)uid, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			continue;
+		}
+
+		OSyncChange *change = osync_change_new(error);
+		if (!change) {
+			icalcomponent_free(icomp);
+			return FALSE;
+		}
+		char *hash = evo2_ecal_component_hash(icomp);
+		evo2_ecal_change_set_uid(evo_cal, change, (const char *)uid);
+		osync_change_set_hash(change, hash);
+		osync_change_set_changetype(change, OSYNC_CHANGE_TYPE_MODIFIED);
+		evo2_hashtable_update_change(table, change);
+		osync_change_unref(change);
+		g_free(hash);
+		icalcomponent_free(icomp);
+	}
+	g_hash_table_remove_all(evo_cal->committed);
+	return TRUE;
+}
+
+static gint evo2_ecal_compare_uri(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* The anchor of a sink lists its sources, sorted, so that reordering the
+ * Url does not change it */
+static char *evo2_ecal_anchor(OSyncEvoCalendar *evo_cal)
+{
+	GPtrArray *uris = g_ptr_array_new();
+	char *anchor = NULL;
+	GList *m;
+
+	for (m = evo_cal->members; m; m = m->next)
+		g_ptr_array_add(uris, ((OSyncEvoCalendar *)m->data)->uri);
+	g_ptr_array_sort(uris, evo2_ecal_compare_uri);
+	g_ptr_array_add(uris, NULL);
+	anchor = g_strjoinv(EVO2_SOURCE_SEPARATOR, (gchar **)uris->pdata);
+	g_ptr_array_free(uris, TRUE);
+	return anchor;
+}
+
+/* Compares the stored anchor member by member. A source added to the Url
+ * needs no slow sync, its entries come in as additions. A source that was
+ * dropped does, and so does going from one source to several or back,
+ * since only several sources qualify their UIDs. */
+static osync_bool evo2_ecal_anchor_match(OSyncEvoCalendar *evo_cal, OSyncSinkStateDB *state_db, osync_bool *match, OSyncError **error)
+{
+	char *stored = evo2_state_get(state_db, evo_cal->uri_key, error);
+	gchar **uris = NULL;
+	GList *m;
+	int i;
+
+	*match = FALSE;
+	if (!stored)
+		return !osync_error_is_set(error);
+
+	uris = g_strsplit(stored, EVO2_SOURCE_SEPARATOR, 0);
+	osync_free(stored);
+
+	*match = (g_strv_length(uris) > 1) == (evo_cal->members->next != NULL);
+	for (i = 0; uris[i] && *match; i++) {
+		*match = FALSE;
+		for (m = evo_cal->members; m && !*match; m = m->next)
+			*match = !strcmp(uris[i], ((OSyncEvoCalendar *)m->data)->uri);
+	}
+	g_strfreev(uris);
+	return TRUE;
+}
+
 static void evo2_ecal_connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
 {
         OSyncError *error = NULL;
+	GList *m = NULL;
        
         osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, sink, info, ctx, userdata);
  	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
 
-	if (!(evo_cal->calendar = evo2_ecal_open_cal(evo_cal->uri, evo_cal->source_type, &error))) {
+	if (evo_cal->members->data != evo_cal) {
+		if (!evo2_ecal_open_members(evo_cal, &error))
+			goto error_free_cal;
+	} else if (!(evo_cal->calendar = evo2_ecal_get_cal(evo_cal, &error))) {
 		goto error;
 	}
 
@@ -98,7 +475,7 @@ static void evo2_ecal_connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
 		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Anchor missing for objtype \"%s\"", osync_objtype_sink_get_name(sink));
 		goto error_free_cal;
 	}
-	if (!osync_sink_state_equal(state_db, evo_cal->uri_key, evo_cal->uri, &state_match, &error)) {
+	if (!evo2_ecal_anchor_match(evo_cal, state_db, &state_match, &error)) {
 		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Anchor comparison failed for objtype \"%s\"", osync_objtype_sink_get_name(sink));
 		goto error_free_cal;
 	}
@@ -107,254 +484,1653 @@ static void evo2_ecal_connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSy
 		osync_context_report_slowsync(ctx);
 	}
 
+	/* cleared again if get_changes reads the change database */
+	for (m = evo_cal->members; m; m = m->next)
+		((OSyncEvoCalendar *)m->data)->checkpoint = TRUE;
+        osync_context_report_success(ctx);
+
+        osync_trace(TRACE_EXIT, "%s", __func__);
+        return;
+
+ error_free_cal:
+	evo2_ecal_close_members(evo_cal);
+error:
+	osync_context_report_osyncerror(ctx, error);
+        osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+        osync_error_unref(&error);
+}
+
+static void evo2_ecal_disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+        osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, sink, info, ctx, userdata);
+
+	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+	GList *m;
+
+	for (m = evo_cal->members; m; m = m->next) {
+		OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+		/* complete anything committed_all did not get to flush */
+		if (member->queue && !g_queue_is_empty(member->queue))
+			evo2_ecal_flush(member);
+		evo2_ecal_commit_orphans(member);
+		evo2_uid_index_free(member->uids);
+		member->uids = NULL;
+	}
+	evo2_ecal_close_members(evo_cal);
+
+        osync_context_report_success(ctx);
+
+        osync_trace(TRACE_EXIT, "%s", __func__);
+}
+
+static void evo2_ecal_sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+        osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, userdata, info, ctx);
+
+	OSyncError *error = NULL;
+	GError *gerror = NULL;
+	GList *m = NULL;
+	char *anchor = NULL;
+	osync_bool stored;
+
+	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+
+	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
+	if (!state_db) {
+		osync_error_set(&error, OSYNC_ERROR_GENERIC, "State database missing for objtype \"%s\"", osync_objtype_sink_get_name(sink));
+		goto error;
+	}
+	anchor = evo2_ecal_anchor(evo_cal);
+	stored = evo2_state_set(state_db, evo_cal->uri_key, anchor, &error);
+	g_free(anchor);
+	if (!stored)
+		goto error;
+	if (!evo2_ecal_window_store(evo_cal, sink, &error))
+		goto error;
+
+	for (m = evo_cal->members; m; m = m->next) {
+		OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+
+		if (member->hashed) {
+			/* no backend change marker to move on */
+			if (!evo2_ecal_hash_refresh(member, &error))
+				goto error;
+			continue;
+		}
+
+		/* see evo2_ebook_sync_done() */
+		if (!member->checkpoint) {
+			osync_trace(TRACE_INTERNAL, "%s change marker of %s is up to date", member->objtype, member->uri);
+			continue;
+		}
+
+		GList *changes = NULL;
+		evo2_metrics_eds_call();
+		if (!e_cal_get_changes(member->calendar, member->change_id, &changes, &gerror)) {
+			osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to update %s ECal time of last sync: %s", member->objtype, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			goto error;
+		}
+		e_cal_free_change_list(changes);
+	}
+
+        osync_context_report_success(ctx);
+        
+        osync_trace(TRACE_EXIT, "%s", __func__);
+	return;
+
+ error:
+	osync_context_report_osyncerror(ctx, error);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+	osync_error_unref(&error);
+}
+
+void evo2_ecal_report_change(OSyncEvoCalendar *evo_cal, OSyncContext *ctx, char *data, unsigned int size, const char *uid, OSyncChangeType changetype)
+{
+        OSyncError *error = NULL;
+
+        OSyncChange *change = osync_change_new(&error);
+        if (!change) {
+                osync_context_report_osyncwarning(ctx, error);
+                osync_error_unref(&error);
+                return;
+        }
+
+        evo2_ecal_change_set_uid(evo_cal, change, uid);
+        osync_change_set_changetype(change, changetype);
+
+        OSyncData *odata = osync_data_new(data, size, evo_cal->format, &error);
+        if (!odata) {
+                osync_change_unref(change);
+                osync_context_report_osyncwarning(ctx, error);
+                osync_error_unref(&error);
+                return;
+        }
+
+        osync_change_set_data(change, odata);
+        osync_data_unref(odata);
+
+        osync_context_report_change(ctx, change);
+	evo2_metrics_reported(size);
+
+        osync_change_unref(change);
+}
+
+
+/* With the native evo2-event/todo/note formats a component is reported
+ * as a record of its properties (see evolution2_record.h), preceded by
+ * the VTIMEZONEs its TZIDs refer to, and rebuilt as icalcomponent on
+ * commit without going through iCalendar text. */
+static void evo2_ecal_record_append_component(GString *record, icalcomponent *comp)
+{
+	GString *params = g_string_new(NULL);
+	icalproperty *prop = NULL;
+	icalparameter *param = NULL;
+	icalcomponent *sub = NULL;
+	const char *name = icalcomponent_kind_to_string(icalcomponent_isa(comp));
+
+	evo2_record_append(record, "BEGIN", NULL, name);
+	for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY); prop;
+	     prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+		icalvalue *value = icalproperty_get_value(prop);
+		char *data = NULL, *ical = NULL;
+
+		g_string_truncate(params, 0);
+		for (param = icalproperty_get_first_parameter(prop, ICAL_ANY_PARAMETER); param;
+		     param = icalproperty_get_next_parameter(prop, ICAL_ANY_PARAMETER)) {
+			if (params->len)
+				g_string_append_c(params, ';');
+			ical = icalparameter_as_ical_string_r(param);
+			g_string_append(params, ical);
+			free(ical);
+		}
+
+		if (value && icalvalue_isa(value) == ICAL_TEXT_VALUE) {
+			data = g_strdup(icalvalue_get_text(value));
+		} else {
+			ical = icalproperty_get_value_as_string_r(prop);
+			data = g_strdup(ical ? ical : "");
+			free(ical);
+			g_strdelimit(data, ";", EVO2_RECORD_LIST_SEPARATOR);
+		}
+		ical = icalproperty_get_property_name_r(prop);
+		evo2_record_append(record, ical, params->str, data);
+		free(ical);
+		g_free(data);
+	}
+	g_string_free(params, TRUE);
+
+	for (sub = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT); sub;
+	     sub = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT))
+		evo2_ecal_record_append_component(record, sub);
+	evo2_record_append(record, "END", NULL, name);
+}
+
+static void evo2_ecal_collect_tzids(icalcomponent *comp, GHashTable *tzids)
+{
+	icalproperty *prop = NULL;
+	icalparameter *param = NULL;
+
+	for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY); prop;
+	     prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+		if ((param = icalproperty_get_first_parameter(prop, ICAL_TZID_PARAMETER)))
+			g_hash_table_insert(tzids, (gpointer) icalparameter_get_tzid(param), NULL);
+	}
+}
+
+static char *evo2_ecal_component_to_record(OSyncEvoCalendar *evo_cal, icalcomponent *icomp, unsigned int *size)
+{
+	GString *record = g_string_new(NULL);
+	GHashTable *tzids = g_hash_table_new(g_str_hash, g_str_equal);
+	GHashTableIter iter;
+	gpointer tzid;
+
+	evo2_ecal_collect_tzids(icomp, tzids);
+	g_hash_table_iter_init(&iter, tzids);
+	while (g_hash_table_iter_next(&iter, &tzid, NULL)) {
+		icaltimezone *zone = NULL;
+		GError *gerror = NULL;
+		if (!e_cal_get_timezone(evo_cal->calendar, (const char *) tzid, &zone, &gerror) || !zone) {
+			osync_trace(TRACE_INTERNAL, "Unable to get timezone %s: %s", (const char *) tzid, gerror ? gerror->message : "None");
+			if (gerror)
+				g_clear_error(&gerror);
+			continue;
+		}
+		evo2_ecal_record_append_component(record, icaltimezone_get_component(zone));
+	}
+	g_hash_table_destroy(tzids);
+
+	evo2_ecal_record_append_component(record, icomp);
+
+	*size = record->len;
+	return g_string_free(record, FALSE);
+}
+
+static icalproperty *evo2_ecal_property_from_record(OSyncEvoRecordAttr *attr)
+{
+	icalproperty_kind kind = icalproperty_string_to_kind(attr->name);
+	icalparameter *param = NULL;
+	icalvalue_kind vkind;
+	icalvalue *value = NULL;
+	char **list, **item;
+
+	if (kind == ICAL_NO_PROPERTY)
+		return NULL;
+
+	icalproperty *prop = icalproperty_new(kind);
+	if (kind == ICAL_X_PROPERTY)
+		icalproperty_set_x_name(prop, attr->name);
+
+	list = evo2_record_split_params(attr->params);
+	for (item = list; *item; item++) {
+		if ((param = icalparameter_new_from_string(*item)))
+			icalproperty_add_parameter(prop, param);
+	}
+	g_strfreev(list);
+
+	if ((param = icalproperty_get_first_parameter(prop, ICAL_VALUE_PARAMETER)))
+		vkind = icalparameter_value_to_value_kind(icalparameter_get_value(param));
+	else
+		vkind = icalproperty_kind_to_value_kind(kind);
+
+	if (vkind == ICAL_TEXT_VALUE || vkind == ICAL_X_VALUE || vkind == ICAL_NO_VALUE) {
+		value = icalvalue_new_text(attr->value);
+	} else {
+		char *data = g_strdup(attr->value);
+		evo2_record_delimit_value(data, ';');
+		value = icalvalue_new_from_string(vkind, data);
+		g_free(data);
+	}
+	if (!value) {
+		osync_trace(TRACE_INTERNAL, "Unable to parse %s value \"%s\"", attr->name, attr->value);
+		icalproperty_free(prop);
+		return NULL;
+	}
+	icalproperty_set_value(prop, value);
+	return prop;
+}
+
+/* Returns a VCALENDAR holding the component of the record and its
+ * timezones. TZIDs the record has no VTIMEZONE for are resolved against
+ * the builtin timezones. */
+static icalcomponent *evo2_ecal_component_from_record(const char *data, unsigned int size)
+{
+	icalcomponent *vcal = icalcomponent_new(ICAL_VCALENDAR_COMPONENT);
+	GSList *stack = g_slist_prepend(NULL, vcal);
+	OSyncEvoRecordAttr attr;
+	unsigned int offset = 0;
+
+	icalcomponent_add_property(vcal, icalproperty_new_version("2.0"));
+	while (evo2_record_next(data, size, &offset, &attr)) {
+		if (!g_ascii_strcasecmp(attr.name, "BEGIN")) {
+			icalcomponent_kind kind = icalcomponent_string_to_kind(attr.value);
+			icalcomponent *comp = icalcomponent_new(kind == ICAL_NO_COMPONENT ? ICAL_X_COMPONENT : kind);
+			icalcomponent_add_component((icalcomponent *) stack->data, comp);
+			stack = g_slist_prepend(stack, comp);
+		} else if (!g_ascii_strcasecmp(attr.name, "END")) {
+			if (stack->next)
+				stack = g_slist_delete_link(stack, stack);
+		} else {
+			icalproperty *prop = evo2_ecal_property_from_record(&attr);
+			if (prop)
+				icalcomponent_add_property((icalcomponent *) stack->data, prop);
+		}
+	}
+	g_slist_free(stack);
+
+	icalcomponent *comp = NULL;
+	for (comp = icalcomponent_get_first_component(vcal, ICAL_ANY_COMPONENT); comp;
+	     comp = icalcomponent_get_next_component(vcal, ICAL_ANY_COMPONENT)) {
+		if (icalcomponent_isa(comp) != ICAL_VTIMEZONE_COMPONENT)
+			break;
+	}
+	if (comp) {
+		GHashTable *tzids = g_hash_table_new(g_str_hash, g_str_equal);
+		GHashTableIter iter;
+		gpointer tzid;
+		GSList *missing = NULL, *m = NULL;
+
+		evo2_ecal_collect_tzids(comp, tzids);
+		g_hash_table_iter_init(&iter, tzids);
+		while (g_hash_table_iter_next(&iter, &tzid, NULL)) {
+			icaltimezone *zone = NULL;
+			if (icalcomponent_get_timezone(vcal, (const char *) tzid))
+				continue;
+			if ((zone = icaltimezone_get_builtin_timezone_from_tzid((const char *) tzid)) ||
+			    (zone = icaltimezone_get_builtin_timezone((const char *) tzid)))
+				missing = g_slist_prepend(missing, icalcomponent_new_clone(icaltimezone_get_component(zone)));
+		}
+		g_hash_table_destroy(tzids);
+
+		/* not added while iterating, the TZID strings belong to comp */
+		for (m = missing; m; m = m->next)
+			icalcomponent_add_component(vcal, (icalcomponent *) m->data);
+		g_slist_free(missing);
+	}
+
+	return vcal;
+}
+
+/* Serializes a component in the format the sink reports */
+static char *evo2_ecal_serialize(OSyncEvoCalendar *evo_cal, icalcomponent *icomp, unsigned int *size)
+{
+	char *data = NULL;
+
+	if (evo_cal->native)
+		return evo2_ecal_component_to_record(evo_cal, icomp, size);
+
+	if ((data = e_cal_get_component_as_string(evo_cal->calendar, icomp)))
+		*size = strlen(data) + 1;
+	return data;
+}
+
+/* Returns the VCALENDAR of a change's data, NULL if it can't be parsed */
+static icalcomponent *evo2_ecal_parse(OSyncEvoCalendar *evo_cal, OSyncChange *change)
+{
+	OSyncData *odata = osync_change_get_data(change);
+	char *plain = NULL;
+	unsigned int size = 0;
+
+	osync_data_get_data(odata, &plain, &size);
+	if (evo_cal->native)
+		return evo2_ecal_component_from_record(plain, size);
+	return icalcomponent_new_from_string(plain);
+}
+
+/* Slow sync reads the calendar through an ECalView. The view callbacks
+ * only queue copies of the delivered components; converting them needs
+ * further calls on the ECal (timezone lookups), which must not be issued
+ * from within a view signal. Whenever batch_size components are pending,
+ * they are converted, reported and freed, so memory stays bounded by the
+ * batch size no matter how large the calendar is. */
+typedef struct OSyncEvoCalStream {
+	OSyncEvoCalendar *evo_cal;
+	ECalView *view;
+	OSyncContext *ctx;
+	OSyncHashTable *table;
+	GQueue *pending;
+	unsigned int chunk;
+	ECalendarStatus status;
+	osync_bool done;
+	unsigned int reported;
+} OSyncEvoCalStream;
+
+/* Rough heap footprint of a component, for the memory accounting */
+#define EVO2_ICAL_COMPONENT_BYTES	256
+#define EVO2_ICAL_PROPERTY_BYTES	192
+
+static gsize evo2_ecal_footprint(icalcomponent *comp)
+{
+	gsize bytes = EVO2_ICAL_COMPONENT_BYTES;
+	icalcomponent *sub = NULL;
+
+	bytes += icalcomponent_count_properties(comp, ICAL_ANY_PROPERTY) * EVO2_ICAL_PROPERTY_BYTES;
+	for (sub = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT); sub;
+	     sub = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT))
+		bytes += evo2_ecal_footprint(sub);
+	return bytes;
+}
+
+static void evo2_ecal_stream_free_component(icalcomponent *icomp)
+{
+	evo2_metrics_mem_release(EVO2_MEM_ICALCOMPONENT, 1, evo2_ecal_footprint(icomp));
+	icalcomponent_free(icomp);
+}
+
+static void evo2_ecal_stream_objects_added(ECalView *view, GList *objects, gpointer userdata)
+{
+	OSyncEvoCalStream *stream = (OSyncEvoCalStream *)userdata;
+	icalcomponent *icomp = NULL;
+	GList *l;
+
+	for (l = objects; l; l = l->next) {
+		icomp = icalcomponent_new_clone((icalcomponent *)l->data);
+		evo2_metrics_mem_acquire(EVO2_MEM_ICALCOMPONENT, 1, evo2_ecal_footprint(icomp));
+		g_queue_push_tail(stream->pending, icomp);
+	}
+}
+
+/* With a MemoryBudget, every time the pending components exceed it the
+ * chunk size is halved for the rest of the stream, down to single
+ * components. */
+static void evo2_ecal_stream_fit_budget(OSyncEvoCalStream *stream)
+{
+	gsize budget = stream->evo_cal->env->memory_budget;
+
+	if (!budget || stream->chunk <= 1 || evo2_metrics_mem_live_bytes() <= budget)
+		return;
+
+	stream->chunk /= 2;
+	osync_trace(TRACE_INTERNAL, "Memory budget of %lu bytes exceeded, %s chunks reduced to %u", (unsigned long) budget, stream->evo_cal->objtype, stream->chunk);
+}
+
+static void evo2_ecal_stream_view_done(ECalView *view, ECalendarStatus status, gpointer userdata)
+{
+	OSyncEvoCalStream *stream = (OSyncEvoCalStream *)userdata;
+
+	stream->status = status;
+	stream->done = TRUE;
+}
+
+/* With a hashtable, decides whether icomp has to be reported. If so, the
+ * returned change carries its UID, hash and change type. */
+static osync_bool evo2_ecal_stream_changed(OSyncEvoCalStream *stream, icalcomponent *icomp, OSyncChange **change)
+{
+	OSyncError *error = NULL;
+	char *hash = NULL, *uid = NULL;
+
+	if (!(*change = osync_change_new(&error))) {
+		osync_context_report_osyncwarning(stream->ctx, error);
+		osync_error_unref(&error);
+		return FALSE;
+	}
+
+	hash = evo2_ecal_component_hash(icomp);
+	uid = evo2_ecal_component_uid(icomp);
+	evo2_ecal_change_set_uid(stream->evo_cal, *change, uid);
+	osync_change_set_hash(*change, hash);
+	g_free(hash);
+	g_free(uid);
+
+	osync_change_set_changetype(*change, evo2_hashtable_get_changetype(stream->table, *change));
+	if (osync_change_get_changetype(*change) == OSYNC_CHANGE_TYPE_UNMODIFIED) {
+		osync_change_unref(*change);
+		*change = NULL;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void evo2_ecal_stream_flush(OSyncEvoCalStream *stream)
+{
+	OSyncEvoCalendar *evo_cal = stream->evo_cal;
+	icalcomponent *icomp = NULL;
+	OSyncChange *change = NULL;
+	unsigned int count = 0;
+
+	while (count < stream->chunk && (icomp = g_queue_pop_head(stream->pending))) {
+		count++;
+		if (stream->table && !evo2_ecal_stream_changed(stream, icomp, &change)) {
+			evo2_ecal_stream_free_component(icomp);
+			continue;
+		}
+
+		unsigned int size = 0;
+		char *data = evo2_ecal_serialize(evo_cal, icomp, &size);
+		if (!data) {
+			osync_trace(TRACE_INTERNAL, "Unable to convert %s %s", evo_cal->objtype, __NULLSTR(icalcomponent_get_uid(icomp)));
+		} else if (change) {
+			evo2_report_hashed_change(stream->ctx, stream->table, change, evo_cal->format, data, size);
+		} else {
+			char *uid = evo2_ecal_component_uid(icomp);
+			evo2_ecal_report_change(evo_cal, stream->ctx, data, size, uid, OSYNC_CHANGE_TYPE_ADDED);
+			g_free(uid);
+		}
+		if (change) {
+			osync_change_unref(change);
+			change = NULL;
+		}
+		evo2_ecal_stream_free_component(icomp);
+	}
+	stream->reported += count;
+	osync_trace(TRACE_INTERNAL, "Reported batch of %u %s entries (%u so far)", count, evo_cal->objtype, stream->reported);
+}
+
+/* Streams the objects matching sexp from every source of the sink. The
+ * views of all sources run at the same time; whatever any of them has
+ * delivered is reported in chunks as the main context is iterated. */
+static osync_bool evo2_ecal_stream_objects(OSyncEvoCalendar *evo_cal, OSyncContext *ctx, OSyncHashTable *table, const char *sexp, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %s, %p)", __func__, evo_cal, ctx, table, sexp, error);
+	GError *gerror = NULL;
+	OSyncEvoCalStream *streams = NULL, *stream = NULL;
+	unsigned int count = g_list_length(evo_cal->members), running = 0, reported = 0, i;
+	GList *m = NULL;
+
+	streams = g_new0(OSyncEvoCalStream, count);
+	for (m = evo_cal->members, i = 0; m; m = m->next, i++) {
+		stream = &streams[i];
+		stream->evo_cal = (OSyncEvoCalendar *)m->data;
+		stream->ctx = ctx;
+		stream->table = table;
+		stream->chunk = stream->evo_cal->batch_size;
+
+		evo2_metrics_eds_call();
+		if (!e_cal_get_query(stream->evo_cal->calendar, sexp, &stream->view, &gerror)) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to get %s view: %s", stream->evo_cal->objtype, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			goto error_free_streams;
+		}
+		stream->pending = g_queue_new();
+		g_signal_connect(stream->view, "objects_added", G_CALLBACK(evo2_ecal_stream_objects_added), stream);
+		g_signal_connect(stream->view, "view_done", G_CALLBACK(evo2_ecal_stream_view_done), stream);
+	}
+
+	for (i = 0; i < count; i++)
+		e_cal_view_start(streams[i].view);
+
+	running = count;
+	while (running) {
+		g_main_context_iteration(g_main_context_get_thread_default(), TRUE);
+		running = 0;
+		for (i = 0; i < count; i++) {
+			stream = &streams[i];
+			evo2_ecal_stream_fit_budget(stream);
+			while (g_queue_get_length(stream->pending) >= stream->chunk)
+				evo2_ecal_stream_flush(stream);
+			if (!stream->done)
+				running++;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		stream = &streams[i];
+		while (!g_queue_is_empty(stream->pending))
+			evo2_ecal_stream_flush(stream);
+		if (stream->status != E_CALENDAR_STATUS_OK && !osync_error_is_set(error))
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "%s view of %s finished with status %i after %u entries", stream->evo_cal->objtype, stream->evo_cal->uri, stream->status, stream->reported);
+		reported += stream->reported;
+	}
+	if (osync_error_is_set(error))
+		goto error_free_streams;
+
+	for (i = 0; i < count; i++) {
+		g_signal_handlers_disconnect_matched(streams[i].view, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, &streams[i]);
+		g_object_unref(streams[i].view);
+		g_queue_free(streams[i].pending);
+	}
+	g_free(streams);
+
+	osync_trace(TRACE_EXIT, "%s: %u entries", __func__, reported);
+	return TRUE;
+
+ error_free_streams:
+	for (i = 0; i < count; i++) {
+		stream = &streams[i];
+		if (stream->view) {
+			g_signal_handlers_disconnect_matched(stream->view, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, stream);
+			g_object_unref(stream->view);
+		}
+		if (stream->pending) {
+			while (!g_queue_is_empty(stream->pending))
+				evo2_ecal_stream_free_component(g_queue_pop_head(stream->pending));
+			g_queue_free(stream->pending);
+		}
+	}
+	g_free(streams);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+/* UID index of the calendar, loaded by the first commit of a connection
+ * that needs it and kept up to date by the commits after it. */
+static void evo2_ecal_index_objects_added(ECalView *view, GList *objects, gpointer userdata)
+{
+	OSyncEvoCalStream *stream = (OSyncEvoCalStream *)userdata;
+	GList *l;
+
+	for (l = objects; l; l = l->next) {
+		evo2_uid_index_insert(stream->evo_cal->uids, icalcomponent_get_uid((icalcomponent *)l->data));
+		stream->reported++;
+	}
+}
+
+static osync_bool evo2_ecal_uid_index_load(OSyncEvoCalendar *evo_cal, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p)", __func__, evo_cal, error);
+	ECalView *view = NULL;
+	GError *gerror = NULL;
+	OSyncEvoCalStream stream;
+
+	memset(&stream, 0, sizeof(stream));
+	stream.evo_cal = evo_cal;
+
+	evo2_metrics_eds_call();
+	if (!e_cal_get_query(evo_cal->calendar, "#t", &view, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to get %s view: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		goto error;
+	}
+
+	evo_cal->uids = evo2_uid_index_new();
+	g_signal_connect(view, "objects_added", G_CALLBACK(evo2_ecal_index_objects_added), &stream);
+	g_signal_connect(view, "view_done", G_CALLBACK(evo2_ecal_stream_view_done), &stream);
+
+	e_cal_view_start(view);
+	while (!stream.done)
+		g_main_context_iteration(g_main_context_get_thread_default(), TRUE);
+
+	g_signal_handlers_disconnect_matched(view, G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, &stream);
+	g_object_unref(view);
+
+	if (stream.status != E_CALENDAR_STATUS_OK) {
+		evo2_uid_index_free(evo_cal->uids);
+		evo_cal->uids = NULL;
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "%s view finished with status %i after %u entries", evo_cal->objtype, stream.status, stream.reported);
+		goto error;
+	}
+
+	osync_trace(TRACE_EXIT, "%s: %u entries", __func__, stream.reported);
+	return TRUE;
+
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+/* FALSE only if the calendar is known not to have uid. If the index
+ * cannot be loaded, the caller tries modify first as before. */
+static osync_bool evo2_ecal_has_uid(OSyncEvoCalendar *evo_cal, const char *uid)
+{
+	OSyncError *error = NULL;
+
+	if (!evo_cal->uids && !evo2_ecal_uid_index_load(evo_cal, &error)) {
+		osync_error_unref(&error);
+		return TRUE;
+	}
+	return evo2_uid_index_contains(evo_cal->uids, uid);
+}
+
+static osync_bool evo2_ecal_get_hashed_changes(OSyncEvoCalendar *evo_cal, OSyncObjTypeSink *sink, OSyncContext *ctx, osync_bool slow_sync, const char *sexp, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %i, %s, %p)", __func__, evo_cal, sink, ctx, slow_sync, sexp, error);
+	OSyncHashTable *table = osync_objtype_sink_get_hashtable(sink);
+	OSyncList *deleted = NULL, *d = NULL;
+
+	if (slow_sync && !evo2_hashtable_slowsync(table, error))
+		goto error;
+
+	if (!evo2_ecal_stream_objects(evo_cal, ctx, table, sexp, error))
+		goto error;
+
+	deleted = evo2_hashtable_get_deleted(table);
+	for (d = deleted; d; d = d->next) {
+		OSyncChange *change = osync_change_new(error);
+		if (!change) {
+			osync_list_free(deleted);
+			goto error;
+		}
+		osync_change_set_uid(change, (const char *) d->data);
+		osync_change_set_changetype(change, OSYNC_CHANGE_TYPE_DELETED);
+		evo2_report_hashed_change(ctx, table, change, evo_cal->format, NULL, 0);
+		osync_change_unref(change);
+	}
+	osync_list_free(deleted);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+/* Time window (EventWindowPastDays/EventWindowFutureDays and the Todo
+ * equivalents): only entries with an occurrence between now - past and
+ * now + future days are synced. The window is pushed into the view query
+ * of slow syncs and hashtable scans; e_cal_get_changes() results are
+ * checked against it. The window of the last sync is kept in the state
+ * database, and when it moved, entries that left it are reported deleted
+ * and entries it reached are reported added. */
+#define EVO2_WINDOW_OPEN_START	((time_t) 0)
+#define EVO2_WINDOW_OPEN_END	((time_t) G_MAXINT32)
+
+static osync_bool evo2_ecal_windowed(OSyncEvoCalendar *evo_cal)
+{
+	return evo_cal->window_start != EVO2_WINDOW_OPEN_START || evo_cal->window_end != EVO2_WINDOW_OPEN_END;
+}
+
+static char *evo2_ecal_window_key(OSyncEvoCalendar *evo_cal)
+{
+	return g_strdup_printf("window_%s", evo_cal->objtype);
+}
+
+static char *evo2_ecal_window_sexp(time_t start, time_t end)
+{
+	icaltimezone *utc = icaltimezone_get_utc_timezone();
+	char *from = icaltime_as_ical_string_r(icaltime_from_timet_with_zone(start, FALSE, utc));
+	char *to = icaltime_as_ical_string_r(icaltime_from_timet_with_zone(end, FALSE, utc));
+	char *sexp = g_strdup_printf("(and (has-start?) (occur-in-time-range? (make-time \"%s\") (make-time \"%s\")))", from, to);
+
+	free(from);
+	free(to);
+	return sexp;
+}
+
+/* Moves the window of the sink and its sources to now and returns the
+ * query for their views */
+static char *evo2_ecal_window_begin(OSyncEvoCalendar *evo_cal)
+{
+	time_t now = time(NULL);
+	GList *m;
+
+	evo_cal->window_start = evo_cal->window_past ? now - (time_t) evo_cal->window_past * 86400 : EVO2_WINDOW_OPEN_START;
+	evo_cal->window_end = evo_cal->window_future ? now + (time_t) evo_cal->window_future * 86400 : EVO2_WINDOW_OPEN_END;
+	for (m = evo_cal->members; m; m = m->next) {
+		((OSyncEvoCalendar *)m->data)->window_start = evo_cal->window_start;
+		((OSyncEvoCalendar *)m->data)->window_end = evo_cal->window_end;
+	}
+
+	if (!evo2_ecal_windowed(evo_cal))
+		return g_strdup("(has-start?)");
+	return evo2_ecal_window_sexp(evo_cal->window_start, evo_cal->window_end);
+}
+
+/* The window of the last sync, open if none was stored */
+static osync_bool evo2_ecal_window_last(OSyncEvoCalendar *evo_cal, OSyncObjTypeSink *sink, time_t *start, time_t *end, OSyncError **error)
+{
+	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
+	char *key = evo2_ecal_window_key(evo_cal);
+	char *value = evo2_state_get(state_db, key, error);
+	long from = 0, to = 0;
+
+	g_free(key);
+	*start = EVO2_WINDOW_OPEN_START;
+	*end = EVO2_WINDOW_OPEN_END;
+	if (!value)
+		return !osync_error_is_set(error);
+
+	if (sscanf(value, "%ld:%ld", &from, &to) == 2) {
+		*start = (time_t) from;
+		*end = (time_t) to;
+	}
+	osync_free(value);
+	return TRUE;
+}
+
+static osync_bool evo2_ecal_window_store(OSyncEvoCalendar *evo_cal, OSyncObjTypeSink *sink, OSyncError **error)
+{
+	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
+	char *key = evo2_ecal_window_key(evo_cal);
+	char *value = g_strdup_printf("%ld:%ld", (long) evo_cal->window_start, (long) evo_cal->window_end);
+	osync_bool stored = evo2_state_set(state_db, key, value, error);
+
+	g_free(key);
+	g_free(value);
+	return stored;
+}
+
+static gboolean evo2_ecal_window_instance(ECalComponent *comp, time_t start, time_t end, gpointer userdata)
+{
+	*(gboolean *)userdata = TRUE;
+	/* one occurrence is enough */
+	return FALSE;
+}
+
+static osync_bool evo2_ecal_occurs(OSyncEvoCalendar *evo_cal, icalcomponent *icomp, time_t start, time_t end)
+{
+	gboolean found = FALSE;
+
+	if (start == EVO2_WINDOW_OPEN_START && end == EVO2_WINDOW_OPEN_END)
+		return TRUE;
+	e_cal_generate_instances_for_object(evo_cal->calendar, icomp, start, end, evo2_ecal_window_instance, &found);
+	return found;
+}
+
+/* Reports the entries of one source that are only in one of the old and
+ * the current window. Only the spans between the two window edges have to
+ * be looked at. UIDs in reported were already covered by the change
+ * database. */
+static osync_bool evo2_ecal_window_moved(OSyncEvoCalendar *evo_cal, OSyncContext *ctx, time_t old_start, time_t old_end, GHashTable *reported, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %ld, %ld, %p, %p)", __func__, evo_cal, ctx, (long) old_start, (long) old_end, reported, error);
+	time_t spans[2][2] = {
+		{ MIN(old_start, evo_cal->window_start), MAX(old_start, evo_cal->window_start) },
+		{ MIN(old_end, evo_cal->window_end), MAX(old_end, evo_cal->window_end) }
+	};
+	unsigned int i, left = 0, entered = 0;
+	GError *gerror = NULL;
+	GList *objects = NULL, *o = NULL;
+
+	for (i = 0; i < 2; i++) {
+		if (spans[i][0] >= spans[i][1])
+			continue;
+
+		char *sexp = evo2_ecal_window_sexp(spans[i][0], spans[i][1]);
+		evo2_metrics_eds_call();
+		osync_bool listed = e_cal_get_object_list(evo_cal->calendar, sexp, &objects, &gerror);
+		g_free(sexp);
+		if (!listed) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to list %s entries crossing the time window: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			goto error;
+		}
+
+		for (o = objects; o; o = o->next) {
+			icalcomponent *icomp = (icalcomponent *)o->data;
+			char *uid = evo2_ecal_component_uid(icomp);
+			osync_bool was_in = FALSE, is_in = FALSE;
+
+			if (g_hash_table_lookup_extended(reported, uid, NULL, NULL)) {
+				g_free(uid);
+				continue;
+			}
+			g_hash_table_insert(reported, uid, NULL);
+
+			was_in = evo2_ecal_occurs(evo_cal, icomp, old_start, old_end);
+			is_in = evo2_ecal_occurs(evo_cal, icomp, evo_cal->window_start, evo_cal->window_end);
+			if (was_in && !is_in) {
+				evo2_ecal_report_change(evo_cal, ctx, NULL, 0, uid, OSYNC_CHANGE_TYPE_DELETED);
+				left++;
+			} else if (!was_in && is_in) {
+				unsigned int size = 0;
+				char *data = evo2_ecal_serialize(evo_cal, icomp, &size);
+				evo2_ecal_report_change(evo_cal, ctx, data, size, uid, OSYNC_CHANGE_TYPE_ADDED);
+				entered++;
+			}
+		}
+		e_cal_free_object_list(objects);
+		objects = NULL;
+	}
+
+	osync_trace(TRACE_EXIT, "%s: %u left, %u entered", __func__, left, entered);
+	return TRUE;
+
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+/* Reports what the change database of one source holds for change_id */
+static osync_bool evo2_ecal_report_backend_changes(OSyncEvoCalendar *evo_cal, OSyncContext *ctx, GHashTable *reported, OSyncError **error)
+{
+        GList *changes = NULL;
+        ECalChange *ecc = NULL;
+        GList *l = NULL;
+        char *data = NULL;
+        char *uid = NULL;
+        unsigned int datasize = 0;
+        GError *gerror = NULL;
+
+        evo2_metrics_eds_call();
+        if (!e_cal_get_changes(evo_cal->calendar, evo_cal->change_id, &changes, &gerror)) {
+                osync_error_set(error, OSYNC_ERROR_GENERIC, "Failed to open changed %s entries: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+                g_clear_error(&gerror);
+                return FALSE;
+        }
+        osync_trace(TRACE_INTERNAL, "Found %i changes for change-ID %s in %s", g_list_length(changes), evo_cal->change_id, evo_cal->uri);
+	evo_cal->checkpoint = FALSE;
+	evo2_metrics_mem_acquire(EVO2_MEM_CHANGE, g_list_length(changes), 0);
+
+        for (l = changes; l; l = l->next) {
+                ecc = (ECalChange *)l->data;
+		uid = evo2_ecal_component_uid(e_cal_component_get_icalcomponent(ecc->comp));
+		e_cal_component_commit_sequence (ecc->comp);
+		e_cal_component_strip_errors(ecc->comp);
+		if (reported) {
+			g_hash_table_insert(reported, g_strdup(uid), NULL);
+			if (ecc->type != E_CAL_CHANGE_DELETED
+			    && !evo2_ecal_occurs(evo_cal, e_cal_component_get_icalcomponent(ecc->comp), evo_cal->window_start, evo_cal->window_end)) {
+				/* outside the window: gone as far as the other side is concerned */
+				if (ecc->type == E_CAL_CHANGE_MODIFIED)
+					evo2_ecal_report_change(evo_cal, ctx, NULL, 0, uid, OSYNC_CHANGE_TYPE_DELETED);
+				g_free(uid);
+				continue;
+			}
+		}
+		switch (ecc->type) {
+			case E_CAL_CHANGE_ADDED:
+				data = evo2_ecal_serialize(evo_cal, e_cal_component_get_icalcomponent(ecc->comp), &datasize);
+				evo2_ecal_report_change(evo_cal, ctx, data, datasize, uid, OSYNC_CHANGE_TYPE_ADDED);
+				break;
+			case E_CAL_CHANGE_MODIFIED:
+				data = evo2_ecal_serialize(evo_cal, e_cal_component_get_icalcomponent(ecc->comp), &datasize);
+				evo2_ecal_report_change(evo_cal, ctx, data, datasize, uid, OSYNC_CHANGE_TYPE_MODIFIED);
+				break;
+			case E_CAL_CHANGE_DELETED:
+				evo2_ecal_report_change(evo_cal, ctx, NULL, 0, uid, OSYNC_CHANGE_TYPE_DELETED);
+				break;
+		}
+		g_free(uid);
+        }
+	evo2_metrics_mem_release(EVO2_MEM_CHANGE, g_list_length(changes), 0);
+	e_cal_free_change_list(changes);
+	return TRUE;
+}
+
+static void evo2_ecal_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *userdata)
+{
+        osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %s, %p)", __func__, sink, info, ctx, slow_sync ? "TRUE" : "FALSE", userdata);
+        OSyncError *error = NULL;
+	GHashTable *reported = NULL;
+	time_t old_start, old_end;
+	GList *m = NULL;
+
+	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+	char *sexp = evo2_ecal_window_begin(evo_cal);
+
+	if (evo_cal->hashed) {
+		if (!evo2_ecal_get_hashed_changes(evo_cal, sink, ctx, slow_sync, sexp, &error))
+			goto error;
+	} else if (slow_sync == FALSE) {
+                osync_trace(TRACE_INTERNAL, "No slow_sync for %s", evo_cal->objtype);
+		if (!evo2_ecal_window_last(evo_cal, sink, &old_start, &old_end, &error))
+			goto error;
+		if (evo2_ecal_windowed(evo_cal) || old_start != evo_cal->window_start || old_end != evo_cal->window_end)
+			reported = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+		for (m = evo_cal->members; m; m = m->next) {
+			OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+			if (!evo2_ecal_report_backend_changes(member, ctx, reported, &error))
+				goto error;
+			if (reported && (old_start != member->window_start || old_end != member->window_end)
+			    && !evo2_ecal_window_moved(member, ctx, old_start, old_end, reported, &error))
+				goto error;
+			if (reported)
+				g_hash_table_remove_all(reported);
+		}
+        } else {
+                osync_trace(TRACE_INTERNAL, "slow_sync for %s", evo_cal->objtype);
+		if (!evo2_ecal_stream_objects(evo_cal, ctx, NULL, sexp, &error))
+			goto error;
+	}
+
+	if (reported)
+		g_hash_table_destroy(reported);
+	g_free(sexp);
         osync_context_report_success(ctx);
 
         osync_trace(TRACE_EXIT, "%s", __func__);
         return;
 
- error_free_cal:
-	g_object_unref(evo_cal->calendar);
-	evo_cal->calendar = NULL;
 error:
-	osync_context_report_osyncerror(ctx, error);
+	if (reported)
+		g_hash_table_destroy(reported);
+	g_free(sexp);
+        osync_context_report_osyncerror(ctx, error);
         osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
         osync_error_unref(&error);
 }
 
-static void evo2_ecal_disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+/* Parse context of the commit path. Every iCalendar tree parsed for a
+ * commit (and the batch VCALENDAR built from them) is owned by the
+ * context of its batch, or of the single commit, and all of them are
+ * released in one go once EDS is done with them. libical offers no
+ * allocator hooks, so this cannot be a real arena; instead, parsing keeps
+ * only the target component and the VTIMEZONEs it references in a small
+ * VCALENDAR and frees the rest of the parsed tree right away. The
+ * counters are reported as ical_trees_* in the sink metrics, allocated
+ * and released have to match after every flush. */
+struct OSyncEvoParseCtx {
+	GPtrArray *trees;
+	unsigned int allocated;
+	unsigned int released;
+};
+
+static OSyncEvoParseCtx *evo2_ecal_parse_ctx_new(void)
 {
-        osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, sink, info, ctx, userdata);
+	OSyncEvoParseCtx *pctx = g_new0(OSyncEvoParseCtx, 1);
+	pctx->trees = g_ptr_array_new();
+	return pctx;
+}
 
-	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+/* Hands tree over to the context */
+static void evo2_ecal_parse_ctx_adopt(OSyncEvoParseCtx *pctx, icalcomponent *tree)
+{
+	g_ptr_array_add(pctx->trees, tree);
+	pctx->allocated++;
+	evo2_metrics_ical_trees(1, 0);
+}
 
-        if (evo_cal->calendar) {
-                g_object_unref(evo_cal->calendar);
-                evo_cal->calendar = NULL;
-        }
+static void evo2_ecal_parse_ctx_free(OSyncEvoParseCtx *pctx)
+{
+	unsigned int i;
 
-        osync_context_report_success(ctx);
+	if (!pctx)
+		return;
 
-        osync_trace(TRACE_EXIT, "%s", __func__);
+	for (i = 0; i < pctx->trees->len; i++)
+		icalcomponent_free(g_ptr_array_index(pctx->trees, i));
+	pctx->released += pctx->trees->len;
+	evo2_metrics_ical_trees(0, pctx->trees->len);
+	osync_trace(TRACE_INTERNAL, "Parse context released %u of %u iCalendar trees", pctx->released, pctx->allocated);
+
+	g_ptr_array_free(pctx->trees, TRUE);
+	g_free(pctx);
 }
 
-static void evo2_ecal_sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+/* Moves tree out of pctx into to */
+static void evo2_ecal_parse_ctx_move(OSyncEvoParseCtx *pctx, OSyncEvoParseCtx *to, icalcomponent *tree)
 {
-        osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, userdata, info, ctx);
+	g_ptr_array_remove(pctx->trees, tree);
+	pctx->allocated--;
+	g_ptr_array_add(to->trees, tree);
+	to->allocated++;
+}
 
-	OSyncError *error = NULL;
-	GError *gerror = NULL;
+/* Moves tree out of pctx into a context of its own */
+static OSyncEvoParseCtx *evo2_ecal_parse_ctx_detach(OSyncEvoParseCtx *pctx, icalcomponent *tree)
+{
+	OSyncEvoParseCtx *own = evo2_ecal_parse_ctx_new();
 
-	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+	evo2_ecal_parse_ctx_move(pctx, own, tree);
+	return own;
+}
 
-	OSyncSinkStateDB *state_db = osync_objtype_sink_get_state_db(sink);
-	if (!state_db) {
-		osync_error_set(&error, OSYNC_ERROR_GENERIC, "State database missing for objtype \"%s\"", osync_objtype_sink_get_name(sink));
-		goto error;
+/* Parses the data of change and returns a VCALENDAR, owned by pctx, that
+ * holds only the sink's component (if there is one) and the timezones
+ * it references. NULL if the data can't be parsed. */
+static icalcomponent *evo2_ecal_parse_ctx_take(OSyncEvoParseCtx *pctx, OSyncEvoCalendar *evo_cal, OSyncChange *change)
+{
+	icalcomponent *parsed = NULL, *entry = NULL, *icomp = NULL, *tz = NULL;
+	GHashTable *tzids = NULL;
+	GSList *timezones = NULL, *t = NULL;
+
+	if (!(parsed = evo2_ecal_parse(evo_cal, change)))
+		return NULL;
+	evo2_metrics_ical_trees(1, 0);
+
+	entry = icalcomponent_new(ICAL_VCALENDAR_COMPONENT);
+	icalcomponent_add_property(entry, icalproperty_new_version("2.0"));
+	evo2_ecal_parse_ctx_adopt(pctx, entry);
+
+	if ((icomp = icalcomponent_get_first_component(parsed, evo_cal->ical_component))) {
+		tzids = g_hash_table_new(g_str_hash, g_str_equal);
+		evo2_ecal_collect_tzids(icomp, tzids);
+		for (tz = icalcomponent_get_first_component(parsed, ICAL_VTIMEZONE_COMPONENT); tz;
+		     tz = icalcomponent_get_next_component(parsed, ICAL_VTIMEZONE_COMPONENT)) {
+			icalproperty *tzid = icalcomponent_get_first_property(tz, ICAL_TZID_PROPERTY);
+			if (tzid && g_hash_table_lookup_extended(tzids, icalproperty_get_tzid(tzid), NULL, NULL))
+				timezones = g_slist_prepend(timezones, tz);
+		}
+		g_hash_table_destroy(tzids);
+
+		for (t = timezones; t; t = t->next) {
+			icalcomponent_remove_component(parsed, (icalcomponent *) t->data);
+			icalcomponent_add_component(entry, (icalcomponent *) t->data);
+		}
+		g_slist_free(timezones);
+
+		icalcomponent_remove_component(parsed, icomp);
+		icalcomponent_add_component(entry, icomp);
 	}
-	if (!osync_sink_state_set(state_db, evo_cal->uri_key, evo_cal->uri, &error))
-		goto error;
 
-        GList *changes = NULL;
-        if (!e_cal_get_changes(evo_cal->calendar, evo_cal->change_id, &changes, &gerror)) {
-		osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to update %s ECal time of last sync: %s", evo_cal->objtype, gerror ? gerror->message : "None");
-		g_clear_error(&gerror);
-		goto error;
+	icalcomponent_free(parsed);
+	evo2_metrics_ical_trees(0, 1);
+	return entry;
+}
+
+/* Batch commit mode: with CalendarCommitBatchSize > 1 added and modified
+ * components are parsed and queued together with a reference on their
+ * context. A full batch, committed_all and disconnect flush the queue:
+ * the queued components and the timezones they need are moved into one
+ * VCALENDAR and imported with a single e_cal_receive_objects() call,
+ * which creates unknown UIDs and replaces existing ones. If the backend
+ * rejects the batch, every component is retried on its own so that each
+ * context gets its own result. */
+typedef struct OSyncEvoCalOp {
+	OSyncEvoCalendar *evo_cal;
+	OSyncContext *ctx;
+	OSyncChange *change;
+	OSyncChangeType type;
+	icalcomponent *vcal;
+	icalcomponent *icomp;
+	/* set for a detached instance */
+	char *series;
+	char *rid;
+	/* owns vcal of a held instance, see evo2_ecal_hold_orphan() */
+	OSyncEvoParseCtx *pctx;
+} OSyncEvoCalOp;
+
+static void evo2_ecal_op_finish(OSyncEvoCalOp *op, OSyncError *error)
+{
+	if (error) {
+		osync_context_report_osyncerror(op->ctx, error);
+	} else {
+		op->evo_cal->checkpoint = TRUE;
+		evo2_ecal_hash_committed(op->evo_cal, op->change);
+		osync_context_report_success(op->ctx);
 	}
 
-	e_cal_free_change_list(changes);
-        osync_context_report_success(ctx);
-        
-        osync_trace(TRACE_EXIT, "%s", __func__);
-	return;
+	osync_context_unref(op->ctx);
+	osync_change_unref(op->change);
+	g_free(op->series);
+	g_free(op->rid);
+	evo2_ecal_parse_ctx_free(op->pctx);
+	g_free(op);
+}
 
- error:
-	osync_context_report_osyncerror(ctx, error);
-	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
-	osync_error_unref(&error);
+/* Finds out whether change, parsed to icomp, is about a detached instance.
+ * Deleted and modified instances are known by their UID; an added
+ * component with a RECURRENCE-ID is an instance if its series is in the
+ * calendar already. Returns the series UID and sets *rid, or NULL. */
+static char *evo2_ecal_change_instance(OSyncEvoCalendar *evo_cal, OSyncChange *change, icalcomponent *icomp, char **rid)
+{
+	char *series = NULL;
+	struct icaltimetype recurid;
+
+	*rid = NULL;
+	if (osync_change_get_changetype(change) != OSYNC_CHANGE_TYPE_ADDED) {
+		series = evo2_ecal_split_uid(evo2_ecal_change_get_uid(evo_cal, change), rid);
+		if (*rid)
+			return series;
+		g_free(series);
+		return NULL;
+	}
+
+	recurid = icalcomponent_get_recurrenceid(icomp);
+	if (icaltime_is_null_time(recurid) || !icalcomponent_get_uid(icomp) || !evo2_ecal_has_uid(evo_cal, icalcomponent_get_uid(icomp)))
+		return NULL;
+
+	char *ridstr = icaltime_as_ical_string_r(recurid);
+	*rid = g_strdup(ridstr);
+	free(ridstr);
+	return g_strdup(icalcomponent_get_uid(icomp));
 }
 
-void evo2_ecal_report_change(OSyncContext *ctx, OSyncObjFormat *format, char *data, unsigned int size, const char *uid, OSyncChangeType changetype)
+/* Commits one occurrence of series with this-instance semantics */
+static osync_bool evo2_ecal_commit_instance(OSyncEvoCalendar *evo_cal, OSyncChange *change, icalcomponent *icomp, const char *series, const char *rid, OSyncError **error)
 {
-        OSyncError *error = NULL;
+	GError *gerror = NULL;
+	char *uid = NULL;
+
+	if (osync_change_get_changetype(change) == OSYNC_CHANGE_TYPE_DELETED) {
+		evo2_metrics_eds_call();
+		if (!e_cal_remove_object_with_mod(evo_cal->calendar, series, rid, CALOBJ_MOD_THIS, &gerror)) {
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to delete %s instance %s: %s", evo_cal->objtype, rid, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+			return FALSE;
+		}
+		return TRUE;
+	}
 
-        OSyncChange *change = osync_change_new(&error);
-        if (!change) {
-                osync_context_report_osyncwarning(ctx, error);
-                osync_error_unref(&error);
-                return;
-        }
+	icalcomponent_set_uid(icomp, series);
+	if (icaltime_is_null_time(icalcomponent_get_recurrenceid(icomp)))
+		icalcomponent_set_recurrenceid(icomp, icaltime_from_string(rid));
 
-        osync_change_set_uid(change, uid);
-        osync_change_set_changetype(change, changetype);
+	evo2_metrics_eds_call();
+	if (!e_cal_modify_object(evo_cal->calendar, icomp, CALOBJ_MOD_THIS, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to modify %s instance %s: %s", evo_cal->objtype, rid, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		return FALSE;
+	}
 
-        OSyncData *odata = osync_data_new(data, size, format, &error);
-        if (!odata) {
-                osync_change_unref(change);
-                osync_context_report_osyncwarning(ctx, error);
-                osync_error_unref(&error);
-                return;
-        }
+	if (osync_change_get_changetype(change) == OSYNC_CHANGE_TYPE_ADDED) {
+		uid = evo2_ecal_component_uid(icomp);
+		evo2_ecal_change_set_uid(evo_cal, change, uid);
+		g_free(uid);
+	}
+	return TRUE;
+}
 
-        osync_change_set_data(change, odata);
-        osync_data_unref(odata);
+/* An added instance whose series is not in the calendar yet is held back
+ * until committed_all, when the masters of the same commit round are in:
+ * then it either joins its series or is created on its own, under the
+ * series#RECURRENCE-ID UID the next scans report it with. A master that
+ * arrives later is put in with CALOBJ_MOD_THIS, keeping the instances. */
+static osync_bool evo2_ecal_is_orphan(OSyncEvoCalendar *evo_cal, icalcomponent *icomp)
+{
+	const char *series = icalcomponent_get_uid(icomp);
 
-        osync_context_report_change(ctx, change);
+	return series && !icaltime_is_null_time(icalcomponent_get_recurrenceid(icomp)) && !evo2_ecal_has_uid(evo_cal, series);
+}
 
-        osync_change_unref(change);
+static void evo2_ecal_hold_orphan(OSyncEvoCalendar *evo_cal, OSyncEvoCalOp *op)
+{
+	osync_trace(TRACE_INTERNAL, "Holding %s instance of %s until its series is in", evo_cal->objtype, icalcomponent_get_uid(op->icomp));
+	evo_cal->orphans = g_list_append(evo_cal->orphans, op);
 }
 
+static osync_bool evo2_ecal_commit_orphan(OSyncEvoCalendar *evo_cal, OSyncEvoCalOp *op, OSyncError **error)
+{
+	char *series = g_strdup(icalcomponent_get_uid(op->icomp));
+	char *rid = NULL, *uid = NULL, *returnuid = NULL;
+	GError *gerror = NULL;
+	osync_bool ret = FALSE;
+
+	if (evo2_ecal_has_uid(evo_cal, series)) {
+		rid = icaltime_as_ical_string_r(icalcomponent_get_recurrenceid(op->icomp));
+		ret = evo2_ecal_commit_instance(evo_cal, op->change, op->icomp, series, rid, error);
+		free(rid);
+		g_free(series);
+		return ret;
+	}
+
+	evo2_metrics_eds_call();
+	if (!e_cal_create_object(evo_cal->calendar, op->icomp, &returnuid, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to create %s instance of %s: %s", evo_cal->objtype, series, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		g_free(series);
+		return FALSE;
+	}
+	uid = evo2_ecal_component_uid(op->icomp);
+	evo2_ecal_change_set_uid(evo_cal, op->change, uid);
+	evo2_uid_index_insert(evo_cal->uids, series);
+	g_free(uid);
+	g_free(returnuid);
+	g_free(series);
+	return TRUE;
+}
 
-static void evo2_ecal_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *userdata)
+static void evo2_ecal_commit_orphans(OSyncEvoCalendar *evo_cal)
 {
-        osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %s, %p)", __func__, sink, info, ctx, slow_sync ? "TRUE" : "FALSE", userdata);
-        OSyncError *error = NULL;
+	OSyncError *error = NULL;
+	GList *l = NULL;
+
+	for (l = evo_cal->orphans; l; l = l->next) {
+		OSyncEvoCalOp *op = (OSyncEvoCalOp *)l->data;
+		if (!evo2_ecal_commit_orphan(evo_cal, op, &error)) {
+			evo2_ecal_op_finish(op, error);
+			osync_error_unref(&error);
+			continue;
+		}
+		evo2_ecal_op_finish(op, NULL);
+	}
+	g_list_free(evo_cal->orphans);
+	evo_cal->orphans = NULL;
+}
 
-        GList *changes = NULL;
-        ECalChange *ecc = NULL;
-        GList *l = NULL;
-        char *data = NULL;
-        const char *uid = NULL;
-        int datasize = 0;
-        GError *gerror = NULL;
+/* Puts the master of a series that so far only has detached instances
+ * in, TRUE if it did. Otherwise the caller creates it. */
+static osync_bool evo2_ecal_attach_master(OSyncEvoCalendar *evo_cal, OSyncChange *change, icalcomponent *icomp)
+{
+	const char *uid = icalcomponent_get_uid(icomp);
+	GError *gerror = NULL;
 
-	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+	if (!uid || !evo2_ecal_has_uid(evo_cal, uid))
+		return FALSE;
 
-        if (slow_sync == FALSE) {
-                osync_trace(TRACE_INTERNAL, "No slow_sync for %s", evo_cal->objtype);
-                if (!e_cal_get_changes(evo_cal->calendar, evo_cal->change_id, &changes, &gerror)) {
-                        osync_error_set(&error, OSYNC_ERROR_GENERIC, "Failed to open changed %s entries: %s", evo_cal->objtype, gerror ? gerror->message : "None");
-                        goto error;
-                }
-                osync_trace(TRACE_INTERNAL, "Found %i changes for change-ID %s", g_list_length(changes), evo_cal->change_id);
-
-                for (l = changes; l; l = l->next) {
-                        ecc = (ECalChange *)l->data;
-			e_cal_component_get_uid(ecc->comp, &uid);
-			e_cal_component_commit_sequence (ecc->comp);
-			e_cal_component_strip_errors(ecc->comp);
-			switch (ecc->type) {
-				case E_CAL_CHANGE_ADDED:
-					data = e_cal_get_component_as_string(evo_cal->calendar, e_cal_component_get_icalcomponent(ecc->comp));
-					datasize = strlen(data) + 1;
-					evo2_ecal_report_change(ctx, evo_cal->format, data, datasize, uid, OSYNC_CHANGE_TYPE_ADDED);
-					break;
-				case E_CAL_CHANGE_MODIFIED:
-					data = e_cal_get_component_as_string(evo_cal->calendar, e_cal_component_get_icalcomponent(ecc->comp));
-					datasize = strlen(data) + 1;
-					evo2_ecal_report_change(ctx, evo_cal->format, data, datasize, uid, OSYNC_CHANGE_TYPE_MODIFIED);
-					break;
-				case E_CAL_CHANGE_DELETED:
-					evo2_ecal_report_change(ctx, evo_cal->format, NULL, 0, uid, OSYNC_CHANGE_TYPE_DELETED);
+	evo2_metrics_eds_call();
+	if (!e_cal_modify_object(evo_cal->calendar, icomp, CALOBJ_MOD_THIS, &gerror)) {
+		osync_trace(TRACE_INTERNAL, "unable to add the master of %s: %s", uid, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		return FALSE;
+	}
+	evo2_ecal_change_set_uid(evo_cal, change, uid);
+	return TRUE;
+}
+
+static osync_bool evo2_ecal_commit_single(OSyncEvoCalendar *evo_cal, OSyncEvoCalOp *op, OSyncError **error)
+{
+	GError *gerror = NULL;
+	char *returnuid = NULL;
+
+	if (op->rid)
+		return evo2_ecal_commit_instance(evo_cal, op->change, op->icomp, op->series, op->rid, error);
+
+	switch (op->type) {
+		case OSYNC_CHANGE_TYPE_DELETED:
+			evo2_metrics_eds_call();
+			if (!e_cal_remove_object(evo_cal->calendar, evo2_ecal_change_get_uid(evo_cal, op->change), &gerror)) {
+				osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to delete %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+				goto error;
+			}
+			evo2_uid_index_remove(evo_cal->uids, evo2_ecal_change_get_uid(evo_cal, op->change));
+			break;
+		case OSYNC_CHANGE_TYPE_MODIFIED:
+			if (evo2_ecal_has_uid(evo_cal, icalcomponent_get_uid(op->icomp))) {
+				evo2_metrics_eds_call();
+				if (e_cal_modify_object(evo_cal->calendar, op->icomp, CALOBJ_MOD_ALL, &gerror))
 					break;
+				osync_trace(TRACE_INTERNAL, "unable to mod %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+				g_clear_error(&gerror);
 			}
-                }
-        } else {
-                osync_trace(TRACE_INTERNAL, "slow_sync for %s", evo_cal->objtype);
-	        if (!e_cal_get_object_list_as_comp (evo_cal->calendar, "(has-start?)", &changes, &gerror)) {
-                        osync_error_set(&error, OSYNC_ERROR_GENERIC, "Failed to get %s changes: %s",  evo_cal->objtype, gerror ? gerror->message : "None");
-                        goto error;
-        	}
-		for (l = changes; l; l = l->next) {
-			ECalComponent *comp = E_CAL_COMPONENT (l->data);
-			data = e_cal_get_component_as_string(evo_cal->calendar, e_cal_component_get_icalcomponent(comp));
-			e_cal_component_get_uid(comp, &uid);
-			datasize = strlen(data) + 1;
-			evo2_ecal_report_change(ctx, evo_cal->format, data, datasize, uid, OSYNC_CHANGE_TYPE_ADDED);
-			g_object_unref (comp);
+			/* fall through, not in the calendar, add it */
+		case OSYNC_CHANGE_TYPE_ADDED:
+			if (op->type == OSYNC_CHANGE_TYPE_ADDED && evo2_ecal_attach_master(evo_cal, op->change, op->icomp))
+				break;
+			evo2_metrics_eds_call();
+			if (!e_cal_create_object(evo_cal->calendar, op->icomp, &returnuid, &gerror)) {
+				osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to create %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+				goto error;
+			}
+			if (op->type == OSYNC_CHANGE_TYPE_ADDED)
+				evo2_ecal_change_set_uid(evo_cal, op->change, returnuid);
+			evo2_uid_index_insert(evo_cal->uids, returnuid);
+			g_free(returnuid);
+			break;
+		default:
+			osync_error_set(error, OSYNC_ERROR_GENERIC, "Unknown change type for %s", evo_cal->objtype);
+			return FALSE;
+	}
+	return TRUE;
+
+ error:
+	if (gerror)
+		g_clear_error(&gerror);
+	return FALSE;
+}
+
+static void evo2_ecal_batch_add(icalcomponent *batch, OSyncEvoCalOp *op)
+{
+	icalcomponent *tz = NULL;
+	GSList *timezones = NULL, *t = NULL;
+
+	for (tz = icalcomponent_get_first_component(op->vcal, ICAL_VTIMEZONE_COMPONENT); tz;
+	     tz = icalcomponent_get_next_component(op->vcal, ICAL_VTIMEZONE_COMPONENT))
+		timezones = g_slist_prepend(timezones, tz);
+
+	for (t = timezones; t; t = t->next) {
+		tz = (icalcomponent *)t->data;
+		icalproperty *tzid = icalcomponent_get_first_property(tz, ICAL_TZID_PROPERTY);
+		if (!tzid || icalcomponent_get_timezone(batch, icalproperty_get_tzid(tzid)))
+			continue;
+		icalcomponent_remove_component(op->vcal, tz);
+		icalcomponent_add_component(batch, tz);
+	}
+	g_slist_free(timezones);
+
+	icalcomponent_remove_component(op->vcal, op->icomp);
+	icalcomponent_add_component(batch, op->icomp);
+}
+
+/* Commits ops one by one and finishes them */
+static void evo2_ecal_commit_each(OSyncEvoCalendar *evo_cal, GList *ops)
+{
+	OSyncEvoCalOp *op = NULL;
+	OSyncError *error = NULL;
+	GList *l = NULL;
+
+	for (l = ops; l; l = l->next) {
+		op = (OSyncEvoCalOp *)l->data;
+		if (!evo2_ecal_commit_single(evo_cal, op, &error)) {
+			evo2_ecal_op_finish(op, error);
+			osync_error_unref(&error);
+			continue;
+		}
+		evo2_ecal_op_finish(op, NULL);
+	}
+}
+
+static void evo2_ecal_flush(OSyncEvoCalendar *evo_cal)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, evo_cal);
+	OSyncEvoCalOp *op = NULL;
+	OSyncError *error = NULL;
+	GError *gerror = NULL;
+	GList *writes = NULL, *instances = NULL, *l = NULL;
+	icalcomponent *batch = NULL;
+
+	while ((op = g_queue_pop_head(evo_cal->queue))) {
+		/* receive_objects would replace the whole series with an
+		 * instance, or drop the instances of a series it adds the
+		 * master of; those are committed after the batch */
+		if (op->rid || (op->type == OSYNC_CHANGE_TYPE_ADDED && evo2_ecal_has_uid(evo_cal, icalcomponent_get_uid(op->icomp)))) {
+			instances = g_list_prepend(instances, op);
+			continue;
+		}
+		if (op->type != OSYNC_CHANGE_TYPE_DELETED) {
+			writes = g_list_prepend(writes, op);
+			continue;
+		}
+		if (!evo2_ecal_commit_single(evo_cal, op, &error)) {
+			evo2_ecal_op_finish(op, error);
+			osync_error_unref(&error);
+			continue;
 		}
+		evo2_ecal_op_finish(op, NULL);
 	}
 
-        osync_context_report_success(ctx);
+	if (!writes)
+		goto commit_instances;
+	writes = g_list_reverse(writes);
+
+	batch = icalcomponent_new(ICAL_VCALENDAR_COMPONENT);
+	icalcomponent_add_property(batch, icalproperty_new_version("2.0"));
+	icalcomponent_add_property(batch, icalproperty_new_method(ICAL_METHOD_PUBLISH));
+	evo2_ecal_parse_ctx_adopt(evo_cal->parse_ctx, batch);
+	for (l = writes; l; l = l->next)
+		evo2_ecal_batch_add(batch, (OSyncEvoCalOp *)l->data);
+
+	evo2_metrics_eds_call();
+	if (e_cal_receive_objects(evo_cal->calendar, batch, &gerror)) {
+		for (l = writes; l; l = l->next) {
+			op = (OSyncEvoCalOp *)l->data;
+			if (op->type == OSYNC_CHANGE_TYPE_ADDED)
+				evo2_ecal_change_set_uid(evo_cal, op->change, icalcomponent_get_uid(op->icomp));
+			evo2_uid_index_insert(evo_cal->uids, icalcomponent_get_uid(op->icomp));
+			evo2_ecal_op_finish(op, NULL);
+		}
+	} else {
+		osync_trace(TRACE_INTERNAL, "Unable to receive %i %s entries at once, committing one by one: %s", g_list_length(writes), evo_cal->objtype, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		evo2_ecal_commit_each(evo_cal, writes);
+	}
+	g_list_free(writes);
 
-        osync_trace(TRACE_EXIT, "%s", __func__);
-        return;
+ commit_instances:
+	instances = g_list_reverse(instances);
+	evo2_ecal_commit_each(evo_cal, instances);
+	g_list_free(instances);
 
-error:
-        if (gerror)
-                g_clear_error(&gerror);
-        osync_context_report_osyncerror(ctx, error);
-        osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
-        osync_error_unref(&error);
+	evo2_ecal_parse_ctx_free(evo_cal->parse_ctx);
+	evo_cal->parse_ctx = NULL;
+	osync_trace(TRACE_EXIT, "%s", __func__);
+}
+
+/* Queues change for the next flush. If routing already parsed it, pctx
+ * holds the entry vcal (NULL if the data could not be parsed). */
+static void evo2_ecal_queue_change(OSyncEvoCalendar *evo_cal, OSyncContext *ctx, OSyncChange *change, OSyncEvoParseCtx *pctx, icalcomponent *vcal)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, evo_cal, ctx, change);
+	OSyncEvoCalOp *op = NULL;
+	OSyncError *error = NULL;
+
+	op = osync_try_malloc0(sizeof(OSyncEvoCalOp), &error);
+	if (!op)
+		goto error;
+	op->evo_cal = evo_cal;
+	op->ctx = osync_context_ref(ctx);
+	op->change = osync_change_ref(change);
+	op->type = osync_change_get_changetype(change);
+
+	if (op->type == OSYNC_CHANGE_TYPE_ADDED || op->type == OSYNC_CHANGE_TYPE_MODIFIED) {
+		if (!evo_cal->parse_ctx)
+			evo_cal->parse_ctx = evo2_ecal_parse_ctx_new();
+		if (pctx) {
+			if ((op->vcal = vcal))
+				evo2_ecal_parse_ctx_move(pctx, evo_cal->parse_ctx, vcal);
+		} else {
+			op->vcal = evo2_ecal_parse_ctx_take(evo_cal->parse_ctx, evo_cal, change);
+		}
+		if (!op->vcal) {
+			osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to convert %s", evo_cal->objtype);
+			goto error_finish_op;
+		}
+		if (!(op->icomp = icalcomponent_get_first_component(op->vcal, evo_cal->ical_component))) {
+			osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to get %s", evo_cal->objtype);
+			goto error_finish_op;
+		}
+
+		op->series = evo2_ecal_change_instance(evo_cal, change, op->icomp, &op->rid);
+		if (!op->rid && op->type == OSYNC_CHANGE_TYPE_ADDED && evo2_ecal_is_orphan(evo_cal, op->icomp)) {
+			/* outlives the flush of the queue */
+			op->pctx = evo2_ecal_parse_ctx_detach(evo_cal->parse_ctx, op->vcal);
+			evo2_ecal_hold_orphan(evo_cal, op);
+			osync_trace(TRACE_EXIT, "%s: held", __func__);
+			return;
+		}
+		if (op->rid) {
+			/* committed on its own, see evo2_ecal_commit_instance() */
+		} else if (op->type == OSYNC_CHANGE_TYPE_MODIFIED) {
+			icalcomponent_set_uid(op->icomp, evo2_ecal_change_get_uid(evo_cal, change));
+		} else if (!icalcomponent_get_uid(op->icomp)) {
+			/* receive_objects needs the UID up front */
+			char *newuid = e_cal_component_gen_uid();
+			icalcomponent_set_uid(op->icomp, newuid);
+			g_free(newuid);
+		}
+	} else {
+		op->series = evo2_ecal_change_instance(evo_cal, change, NULL, &op->rid);
+	}
+
+	g_queue_push_tail(evo_cal->queue, op);
+	if (g_queue_get_length(evo_cal->queue) >= evo_cal->commit_batch_size)
+		evo2_ecal_flush(evo_cal);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return;
+
+ error_finish_op:
+	evo2_ecal_op_finish(op, error);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+	osync_error_unref(&error);
+	return;
+ error:
+	osync_context_report_osyncerror(ctx, error);
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(&error));
+	osync_error_unref(&error);
+}
+
+static void evo2_ecal_committed_all(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, sink, info, ctx, userdata);
+	OSyncEvoCalendar *evo_cal = (OSyncEvoCalendar *)userdata;
+	GList *m;
+
+	for (m = evo_cal->members; m; m = m->next) {
+		OSyncEvoCalendar *member = (OSyncEvoCalendar *)m->data;
+		if (member->queue)
+			evo2_ecal_flush(member);
+		evo2_ecal_commit_orphans(member);
+	}
+	osync_context_report_success(ctx);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
 }
 
 static void evo2_ecal_modify(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change, void *userdata)
 {
         osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p, %p)", __func__, sink, info, ctx, change, userdata);
 
-        const char *uid = osync_change_get_uid(change);
-	icalcomponent *icomp = NULL;
-	char *returnuid = NULL;
+	OSyncEvoParseCtx *pctx = NULL;
+	OSyncEvoCalOp *op = NULL;
+	icalcomponent *vcal = NULL, *icomp = NULL;
+	char *returnuid = NULL, *series = NULL, *rid = NULL;
         GError *gerror = NULL;
         OSyncError *error = NULL;
-        OSyncData *odata = NULL;
-        char *plain = NULL;
 
 	OSyncEvoCalendar * evo_cal = (OSyncEvoCalendar *)userdata;
+	/* routing an addition between several sources looks at its entry,
+	 * which is parsed once for routing and commit */
+	if (evo_cal->members->next && osync_change_get_changetype(change) == OSYNC_CHANGE_TYPE_ADDED) {
+		pctx = evo2_ecal_parse_ctx_new();
+		vcal = evo2_ecal_parse_ctx_take(pctx, evo_cal, change);
+	}
+	evo_cal = evo2_ecal_route(evo_cal, change, vcal);
+        const char *uid = evo2_ecal_change_get_uid(evo_cal, change);
+
+	if (evo_cal->commit_batch_size > 1) {
+		evo2_ecal_queue_change(evo_cal, ctx, change, pctx, vcal);
+		evo2_ecal_parse_ctx_free(pctx);
+		osync_trace(TRACE_EXIT, "%s: queued", __func__);
+		return;
+	}
 
         switch (osync_change_get_changetype(change)) {
                 case OSYNC_CHANGE_TYPE_DELETED:
+			if ((series = evo2_ecal_change_instance(evo_cal, change, NULL, &rid))) {
+				if (!evo2_ecal_commit_instance(evo_cal, change, NULL, series, rid, &error))
+					goto error;
+				break;
+			}
+                        evo2_metrics_eds_call();
                         if (!e_cal_remove_object(evo_cal->calendar, uid, &gerror)) {
                                 osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to delete %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
                                 goto error;
                         }
+			evo2_uid_index_remove(evo_cal->uids, uid);
                         break;
                 case OSYNC_CHANGE_TYPE_ADDED:
-                        odata = osync_change_get_data(change);
-                        osync_data_get_data(odata, &plain, NULL);
-			icomp = icalcomponent_new_from_string(plain);
-			if (!icomp) {
-				osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "Unable to convert %s", evo_cal->objtype);
+			if (!pctx) {
+				pctx = evo2_ecal_parse_ctx_new();
+				vcal = evo2_ecal_parse_ctx_take(pctx, evo_cal, change);
+			}
+			if (!vcal) {
+				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to convert %s", evo_cal->objtype);
 				goto error;
 			}
 			
-			icomp = icalcomponent_get_first_component (icomp, evo_cal->ical_component);
+			icomp = icalcomponent_get_first_component (vcal, evo_cal->ical_component);
 			if (!icomp) {
 				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to get %s", evo_cal->objtype);
 				goto error;
 			}
 			
+			if ((series = evo2_ecal_change_instance(evo_cal, change, icomp, &rid))) {
+				if (!evo2_ecal_commit_instance(evo_cal, change, icomp, series, rid, &error))
+					goto error;
+				break;
+			}
+			if (evo2_ecal_is_orphan(evo_cal, icomp)) {
+				if (!(op = osync_try_malloc0(sizeof(OSyncEvoCalOp), &error)))
+					goto error;
+				op->evo_cal = evo_cal;
+				op->ctx = osync_context_ref(ctx);
+				op->change = osync_change_ref(change);
+				op->type = OSYNC_CHANGE_TYPE_ADDED;
+				op->vcal = vcal;
+				op->icomp = icomp;
+				op->pctx = pctx;
+				evo2_ecal_hold_orphan(evo_cal, op);
+				osync_trace(TRACE_EXIT, "%s: held", __func__);
+				return;
+			}
+			if (evo2_ecal_attach_master(evo_cal, change, icomp))
+				break;
+			evo2_metrics_eds_call();
 			if (!e_cal_create_object(evo_cal->calendar, icomp, &returnuid, &gerror)) {
 				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to create %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
 				goto error;
 			}
-			osync_change_set_uid(change, returnuid);
+			evo2_ecal_change_set_uid(evo_cal, change, returnuid);
+			evo2_uid_index_insert(evo_cal->uids, returnuid);
+			g_free(returnuid);
                         break;
                 case OSYNC_CHANGE_TYPE_MODIFIED:
-                        odata = osync_change_get_data(change);
-                        osync_data_get_data(odata, &plain, NULL);
-
-			icomp = icalcomponent_new_from_string(plain);
-			if (!icomp) {
+			pctx = evo2_ecal_parse_ctx_new();
+			vcal = evo2_ecal_parse_ctx_take(pctx, evo_cal, change);
+			if (!vcal) {
 				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to convert %s", evo_cal->objtype);
 				goto error;
 			}
 			
-			icomp = icalcomponent_get_first_component (icomp, evo_cal->ical_component);
+			icomp = icalcomponent_get_first_component (vcal, evo_cal->ical_component);
 			if (!icomp) {
 				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to get %s", evo_cal->objtype);
 				goto error;
 			}
 			
+			if ((series = evo2_ecal_change_instance(evo_cal, change, icomp, &rid))) {
+				if (!evo2_ecal_commit_instance(evo_cal, change, icomp, series, rid, &error))
+					goto error;
+				break;
+			}
 			icalcomponent_set_uid (icomp, uid);
-			if (!e_cal_modify_object(evo_cal->calendar, icomp, CALOBJ_MOD_ALL, &gerror)) {
+			if (evo2_ecal_has_uid(evo_cal, uid)) {
+				evo2_metrics_eds_call();
+				if (e_cal_modify_object(evo_cal->calendar, icomp, CALOBJ_MOD_ALL, &gerror))
+					break;
 				osync_trace(TRACE_INTERNAL, "unable to mod %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
 				g_clear_error(&gerror);
-				if (!e_cal_create_object(evo_cal->calendar, icomp, &returnuid, &gerror)) {
-					osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to create %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
-					goto error;
-				}
 			}
+
+			/* not in the calendar, add it */
+			evo2_metrics_eds_call();
+			if (!e_cal_create_object(evo_cal->calendar, icomp, &returnuid, &gerror)) {
+				osync_error_set(&error, OSYNC_ERROR_GENERIC, "Unable to create %s: %s", evo_cal->objtype, gerror ? gerror->message : "None");
+				goto error;
+			}
+			evo2_uid_index_insert(evo_cal->uids, returnuid);
+			g_free(returnuid);
                         break;
                 default:
                         printf("Error\n");
         }
+	evo2_ecal_parse_ctx_free(pctx);
+	g_free(series);
+	g_free(rid);
 
+	evo_cal->checkpoint = TRUE;
+	evo2_ecal_hash_committed(evo_cal, change);
         osync_context_report_success(ctx);
 
         osync_trace(TRACE_EXIT, "%s", __func__);
         return;
 
 error:
+	evo2_ecal_parse_ctx_free(pctx);
+	g_free(series);
+	g_free(rid);
         if (gerror)
                 g_clear_error(&gerror);
         osync_context_report_osyncerror(ctx, error);
@@ -370,18 +2146,22 @@ osync_bool evo2_ecal_discover(OSyncEvoCalendar *evo_cal, OSyncCapabilities *caps
 	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p)", __func__, evo_cal, caps, error);
 
 	if (evo_cal->sink) {
-		if (!(cal = evo2_ecal_open_cal(evo_cal->uri, evo_cal->source_type, error))) {
+		/* new entries go to the first source, it decides what the sink can take */
+		if (!(cal = evo2_ecal_get_cal((OSyncEvoCalendar *)evo_cal->members->data, error))) {
 			goto error;
 		}
 		if (!e_cal_is_read_only(cal, &read_only, &gerror)) {
 			osync_error_set(error, OSYNC_ERROR_GENERIC, "Could not determine if source was read only: %s", gerror ? gerror->message : "None");
 			goto error_free_cal;
 		}
-		g_object_unref(cal);
 
 		osync_objtype_sink_set_write(evo_cal->sink, !read_only);
 		osync_trace(TRACE_INTERNAL, "Set sink write status to %s", read_only ? "FALSE" : "TRUE");
 
+		if (!evo2_capbilities_translate_ecal(caps, cal, evo_cal->objtype, evo_cal->ical_component, evo_cal->probe_caps && !read_only, error))
+			goto error_free_cal;
+		g_object_unref(cal);
+
 	}
 	osync_trace(TRACE_EXIT, "%s", __func__);
 	return TRUE;
@@ -395,6 +2175,60 @@ osync_bool evo2_ecal_discover(OSyncEvoCalendar *evo_cal, OSyncCapabilities *caps
         return FALSE;
 }
 
+/* Splits a Url listing several sources into members sharing the sink.
+ * A member's UID prefix is derived from its Url, so it stays the same
+ * when the list is reordered or extended. */
+static osync_bool evo2_ecal_add_members(OSyncEvoCalendar *cal, OSyncError **error)
+{
+	unsigned int i;
+
+	cal->uris = g_strsplit(cal->uri, EVO2_SOURCE_SEPARATOR, 0);
+	if (g_strv_length(cal->uris) < 2)
+		return TRUE;
+
+	g_list_free(cal->members);
+	cal->members = NULL;
+	for (i = 0; cal->uris[i]; i++) {
+		g_strstrip(cal->uris[i]);
+		if (!*cal->uris[i])
+			continue;
+
+		OSyncEvoCalendar *member = osync_try_malloc0(sizeof(OSyncEvoCalendar), error);
+		if (!member)
+			return FALSE;
+		member->env = cal->env;
+		member->uri = cal->uris[i];
+		member->objtype = cal->objtype;
+		member->change_id = cal->change_id;
+		member->source_type = cal->source_type;
+		member->ical_component = cal->ical_component;
+		member->hashed = cal->hashed;
+		if (member->hashed)
+			member->committed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		member->probe_caps = cal->probe_caps;
+		member->batch_size = cal->batch_size;
+		member->commit_batch_size = cal->commit_batch_size;
+		if (cal->queue)
+			member->queue = g_queue_new();
+		member->sink = osync_objtype_sink_ref(cal->sink);
+		member->format = cal->format;
+		osync_objformat_ref(member->format);
+		member->native = cal->native;
+
+		char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, member->uri, -1);
+		member->uid_prefix = g_strdup_printf("%.8s/", hash);
+		g_free(hash);
+
+		cal->members = g_list_append(cal->members, member);
+		osync_trace(TRACE_INTERNAL, "%s source %s, UID prefix %s", cal->objtype, member->uri, member->uid_prefix);
+	}
+	if (!cal->members) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "%s url lists no source", cal->objtype);
+		return FALSE;
+	}
+	return TRUE;
+}
+
 osync_bool evo2_ecal_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, const char *objtype, const char *required_format, OSyncError **error)
 {
 	char *uri_key;
@@ -424,8 +2258,33 @@ osync_bool evo2_ecal_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, const c
 	if (!cal) {
 		return FALSE;
 	}
+	cal->env = env;
+	cal->members = g_list_append(NULL, cal);
 	cal->objtype = objtype;
 	cal->change_id = env->change_id;
+	cal->batch_size = evo2_config_get_uint(info, "CalendarBatchSize", EVO2_DEFAULT_BATCH_SIZE);
+	if (!cal->batch_size)
+		cal->batch_size = EVO2_DEFAULT_BATCH_SIZE;
+	if (!strcmp(evo2_config_get_string(info, "ChangeDetection", "backend"), "hashtable")) {
+		osync_objtype_sink_enable_hashtable(sink, TRUE);
+		cal->hashed = TRUE;
+		cal->committed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+	cal->probe_caps = evo2_config_get_uint(info, "CalendarCapabilityProbe", 0) ? TRUE : FALSE;
+	cal->commit_batch_size = evo2_config_get_uint(info, "CalendarCommitBatchSize", EVO2_DEFAULT_COMMIT_BATCH_SIZE);
+	if (!strcmp(objtype, "event")) {
+		cal->window_past = evo2_config_get_uint(info, "EventWindowPastDays", 0);
+		cal->window_future = evo2_config_get_uint(info, "EventWindowFutureDays", 0);
+	} else if (!strcmp(objtype, "todo")) {
+		cal->window_past = evo2_config_get_uint(info, "TodoWindowPastDays", 0);
+		cal->window_future = evo2_config_get_uint(info, "TodoWindowFutureDays", 0);
+	}
+	cal->window_start = EVO2_WINDOW_OPEN_START;
+	cal->window_end = EVO2_WINDOW_OPEN_END;
+	if (cal->commit_batch_size > 1)
+		cal->queue = g_queue_new();
+	/* commits the held instances, see evo2_ecal_hold_orphan() */
+	osync_objtype_sink_set_committed_all_func(sink, evo2_ecal_committed_all);
 
 	OSyncPluginConfig *config = osync_plugin_info_get_config(info);
         OSyncPluginResource *resource = osync_plugin_config_find_active_resource(config, objtype);
@@ -445,18 +2304,23 @@ osync_bool evo2_ecal_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, const c
         OSyncList *objformatsinks = osync_plugin_resource_get_objformat_sinks(resource);
         osync_bool hasObjFormat = FALSE;
         OSyncList *r;
+	char *native_format = g_strdup_printf("evo2-%s", objtype);
         for(r = objformatsinks;r;r = r->next) {
                 OSyncObjFormatSink *objformatsink = r->data;
-                if(!strcmp(required_format, osync_objformat_sink_get_objformat(objformatsink))) { hasObjFormat = TRUE; break;}
+                const char *objformat = osync_objformat_sink_get_objformat(objformatsink);
+                if(!strcmp(native_format, objformat)) { hasObjFormat = TRUE; cal->native = TRUE; break;}
+                if(!strcmp(required_format, objformat)) { hasObjFormat = TRUE; }
         }
 	osync_list_free(objformatsinks);
         if (!hasObjFormat) {
                 osync_error_set(error, OSYNC_ERROR_GENERIC, "Format %s not set.", required_format);
+                g_free(native_format);
                 return FALSE;
         }
 
         OSyncFormatEnv *formatenv = osync_plugin_info_get_format_env(info);
-        cal->format = osync_format_env_find_objformat(formatenv, required_format);
+        cal->format = osync_format_env_find_objformat(formatenv, cal->native ? native_format : required_format);
+        g_free(native_format);
         assert(cal->format);
 	osync_objformat_ref(cal->format);
 	
@@ -477,6 +2341,23 @@ osync_bool evo2_ecal_initialize(OSyncEvoEnv *env, OSyncPluginInfo *info, const c
 
         osync_objtype_sink_set_userdata(cal->sink, cal);
 
+	if (!evo2_ecal_add_members(cal, error))
+		return FALSE;
+
+	OSyncEvoMetrics *metrics = evo2_sink_metrics_new(env, objtype, cal, error);
+	if (!metrics)
+		return FALSE;
+	metrics->connect = evo2_ecal_connect;
+	metrics->disconnect = evo2_ecal_disconnect;
+	metrics->get_changes = evo2_ecal_get_changes;
+	metrics->commit = evo2_ecal_modify;
+	metrics->committed_all = evo2_ecal_committed_all;
+	metrics->sync_done = evo2_ecal_sync_done;
+
+	if (env->parallel && !(cal->worker = evo2_worker_new(objtype, metrics, error)))
+		return FALSE;
+	evo2_metrics_attach(metrics, cal->sink, cal->worker);
+
 	env->calendars = g_list_append(env->calendars, cal);
 	return TRUE;
 }
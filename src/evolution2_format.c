@@ -18,134 +18,1346 @@
  * 
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <glib.h>
  
 #include <opensync/opensync.h>
 #include <opensync/opensync-capabilities.h>
 #include <opensync/opensync-format.h>
+#include <opensync/opensync-xmlformat.h>
 
-#define cast_g_hash_table_insert(hash, a, b) g_hash_table_insert(hash, (gpointer) a, (gpointer) b)
-
-static GHashTable* get_ebook_to_xmlformat_hash()
-{
-	osync_trace(TRACE_ENTRY, "%s", __func__);
-	GHashTable *hash = g_hash_table_new(g_str_hash, g_str_equal);
-
-	cast_g_hash_table_insert(hash, "address", "Address");
-	cast_g_hash_table_insert(hash, "address_label_home", "AddressLabel");
-	cast_g_hash_table_insert(hash, "address_label_other", "AddressLabel");
-	cast_g_hash_table_insert(hash, "address_label_work", "AddressLabel");
-	cast_g_hash_table_insert(hash, "anniversary", "Anniversary");
-	cast_g_hash_table_insert(hash, "assistant", "Assistant");
-	cast_g_hash_table_insert(hash, "birth_date", "Birthday");
-	cast_g_hash_table_insert(hash, "blog_url", "BlogUrl");
-	cast_g_hash_table_insert(hash, "caluri", "CalendarUrl");
-	cast_g_hash_table_insert(hash, "categories", "Categories");
-	/* cast_g_hash_table_insert(hash, "", "Class");*/
-	cast_g_hash_table_insert(hash, "email_1", "EMail");
-	cast_g_hash_table_insert(hash, "email_2", "EMail");
-	cast_g_hash_table_insert(hash, "email_3", "EMail");
-	cast_g_hash_table_insert(hash, "email_4", "EMail");
-	cast_g_hash_table_insert(hash, "email", "EMail");
-	cast_g_hash_table_insert(hash, "file_as", "FileAs");
-	cast_g_hash_table_insert(hash, "full_name", "FormattedName");
-	cast_g_hash_table_insert(hash, "fburl", "FreeBusyUrl");
-	/*  cast_g_hash_table_insert(hash, "", "GroupwiseDirectory");*/
-	cast_g_hash_table_insert(hash, "im_aim", "IM-AIM");
-	cast_g_hash_table_insert(hash, "im_gadugadu", "IM-GaduGadu");
-	cast_g_hash_table_insert(hash, "im_icq", "IM-ICQ");
-	cast_g_hash_table_insert(hash, "im_jabber", "IM-Jabber");
-	cast_g_hash_table_insert(hash, "im_msn", "IM-MSN");
-	/* cast_g_hash_table_insert(hash, "", "IM-Yabber");*/
-	cast_g_hash_table_insert(hash, "im_yahoo", "IM-Yahoo");
-	/* cast_g_hash_table_insert(hash, "", "IRC");*/
-	/* cast_g_hash_table_insert(hash, "", "KDE-Extension");*/
-	/* cast_g_hash_table_insert(hash, "", "Key");*/
-	/* cast_g_hash_table_insert(hash, "", "Location");*/
-	cast_g_hash_table_insert(hash, "logo", "Logo");
-	cast_g_hash_table_insert(hash, "manager", "Manager");
-	cast_g_hash_table_insert(hash, "name", "Name");
-	cast_g_hash_table_insert(hash, "nickname", "Nickname");
-	cast_g_hash_table_insert(hash, "note", "Note");
-	cast_g_hash_table_insert(hash, "org", "Organization");
-	cast_g_hash_table_insert(hash, "photo", "Photo");
-	/*cast_g_hash_table_insert(hash, "", "PhotoUrl");*/
-
-	/*To match the vcard translators view that evolution role is really profession */
-	cast_g_hash_table_insert(hash, "role", "Profession");
-	cast_g_hash_table_insert(hash, "Rev", "Revision");
-	/* cast_g_hash_table_insert(hash, "", "Role"); Evolution's role is profession */
-	/* cast_g_hash_table_insert(hash, "", "SMS");*/
-	/* cast_g_hash_table_insert(hash, "", "Sound");*/
-	cast_g_hash_table_insert(hash, "spouse", "Spouse");
-	cast_g_hash_table_insert(hash, "phone", "Telephone");
-	cast_g_hash_table_insert(hash, "title", "Title");
-	cast_g_hash_table_insert(hash, "id", "Uid");
-	cast_g_hash_table_insert(hash, "homepage_url", "Url");
-	/* cast_g_hash_table_insert(hash, "", "UserDefined");*/
-	/* cast_g_hash_table_insert(hash, "", "Version");*/
-	cast_g_hash_table_insert(hash, "video_url", "VideoUrl");
-	cast_g_hash_table_insert(hash, "wants_html", "WantsHtml");
+#include "evolution2_record.h"
 
-	osync_trace(TRACE_EXIT, "%s", __func__);
-	return hash;
+/* Capability name mappings between the fields the EDS backends report
+ * (EBook field names, iCalendar property names for calendars) and the
+ * xmlformat schema. Every mapping is kept twice: sorted by evo2 name and
+ * sorted by xmlformat name (then evo2 name), so both directions are a
+ * bsearch() in immutable tables. Keep both copies sorted in strcmp()
+ * order when adding entries.
+ *
+ * Contact fields without an evo2 counterpart: Class, GroupwiseDirectory,
+ * IM-Yabber, IRC, KDE-Extension, Key, Location, PhotoUrl, Role (Evolution's
+ * "role" is mapped to Profession, like the vcard translators do), SMS,
+ * Sound, UserDefined and Version. */
+typedef struct OSyncEvoCapMap {
+	const char *evo2;
+	const char *xmlformat;
+} OSyncEvoCapMap;
+
+#define EVO2_CAPS_MAX	64
+
+static const OSyncEvoCapMap evo2_contact_caps[] = {
+	{ "Rev",                 "Revision" },
+	{ "address",             "Address" },
+	{ "address_label_home",  "AddressLabel" },
+	{ "address_label_other", "AddressLabel" },
+	{ "address_label_work",  "AddressLabel" },
+	{ "anniversary",         "Anniversary" },
+	{ "assistant",           "Assistant" },
+	{ "birth_date",          "Birthday" },
+	{ "blog_url",            "BlogUrl" },
+	{ "caluri",              "CalendarUrl" },
+	{ "categories",          "Categories" },
+	{ "email",               "EMail" },
+	{ "email_1",             "EMail" },
+	{ "email_2",             "EMail" },
+	{ "email_3",             "EMail" },
+	{ "email_4",             "EMail" },
+	{ "fburl",               "FreeBusyUrl" },
+	{ "file_as",             "FileAs" },
+	{ "full_name",           "FormattedName" },
+	{ "homepage_url",        "Url" },
+	{ "id",                  "Uid" },
+	{ "im_aim",              "IM-AIM" },
+	{ "im_gadugadu",         "IM-GaduGadu" },
+	{ "im_icq",              "IM-ICQ" },
+	{ "im_jabber",           "IM-Jabber" },
+	{ "im_msn",              "IM-MSN" },
+	{ "im_yahoo",            "IM-Yahoo" },
+	{ "logo",                "Logo" },
+	{ "manager",             "Manager" },
+	{ "name",                "Name" },
+	{ "nickname",            "Nickname" },
+	{ "note",                "Note" },
+	{ "org",                 "Organization" },
+	{ "phone",               "Telephone" },
+	{ "photo",               "Photo" },
+	{ "role",                "Profession" },
+	{ "spouse",              "Spouse" },
+	{ "title",               "Title" },
+	{ "video_url",           "VideoUrl" },
+	{ "wants_html",          "WantsHtml" },
+};
+
+static const OSyncEvoCapMap xmlformat_contact_caps[] = {
+	{ "address",             "Address" },
+	{ "address_label_home",  "AddressLabel" },
+	{ "address_label_other", "AddressLabel" },
+	{ "address_label_work",  "AddressLabel" },
+	{ "anniversary",         "Anniversary" },
+	{ "assistant",           "Assistant" },
+	{ "birth_date",          "Birthday" },
+	{ "blog_url",            "BlogUrl" },
+	{ "caluri",              "CalendarUrl" },
+	{ "categories",          "Categories" },
+	{ "email",               "EMail" },
+	{ "email_1",             "EMail" },
+	{ "email_2",             "EMail" },
+	{ "email_3",             "EMail" },
+	{ "email_4",             "EMail" },
+	{ "file_as",             "FileAs" },
+	{ "full_name",           "FormattedName" },
+	{ "fburl",               "FreeBusyUrl" },
+	{ "im_aim",              "IM-AIM" },
+	{ "im_gadugadu",         "IM-GaduGadu" },
+	{ "im_icq",              "IM-ICQ" },
+	{ "im_jabber",           "IM-Jabber" },
+	{ "im_msn",              "IM-MSN" },
+	{ "im_yahoo",            "IM-Yahoo" },
+	{ "logo",                "Logo" },
+	{ "manager",             "Manager" },
+	{ "name",                "Name" },
+	{ "nickname",            "Nickname" },
+	{ "note",                "Note" },
+	{ "org",                 "Organization" },
+	{ "photo",               "Photo" },
+	{ "role",                "Profession" },
+	{ "Rev",                 "Revision" },
+	{ "spouse",              "Spouse" },
+	{ "phone",               "Telephone" },
+	{ "title",               "Title" },
+	{ "id",                  "Uid" },
+	{ "homepage_url",        "Url" },
+	{ "video_url",           "VideoUrl" },
+	{ "wants_html",          "WantsHtml" },
+};
+
+static const OSyncEvoCapMap evo2_event_caps[] = {
+	{ "ATTACH",        "Attach" },
+	{ "ATTENDEE",      "Attendee" },
+	{ "CATEGORIES",    "Categories" },
+	{ "CLASS",         "Class" },
+	{ "COMMENT",       "Comment" },
+	{ "CONTACT",       "Contact" },
+	{ "CREATED",       "Created" },
+	{ "DESCRIPTION",   "Description" },
+	{ "DTEND",         "DateEnd" },
+	{ "DTSTAMP",       "DateCalendarCreated" },
+	{ "DTSTART",       "DateStarted" },
+	{ "DURATION",      "Duration" },
+	{ "EXDATE",        "ExceptionDateTime" },
+	{ "EXRULE",        "ExceptionRule" },
+	{ "GEO",           "Geo" },
+	{ "LAST-MODIFIED", "LastModified" },
+	{ "LOCATION",      "Location" },
+	{ "ORGANIZER",     "Organizer" },
+	{ "PRIORITY",      "Priority" },
+	{ "RDATE",         "RecurrenceDateTime" },
+	{ "RECURRENCE-ID", "RecurrenceId" },
+	{ "RELATED-TO",    "RelatedTo" },
+	{ "RESOURCES",     "Resources" },
+	{ "RRULE",         "RecurrenceRule" },
+	{ "SEQUENCE",      "Sequence" },
+	{ "STATUS",        "Status" },
+	{ "SUMMARY",       "Summary" },
+	{ "TRANSP",        "TimeTransparency" },
+	{ "UID",           "Uid" },
+	{ "URL",           "Url" },
+	{ "VALARM",        "Alarm" },
+};
+
+static const OSyncEvoCapMap xmlformat_event_caps[] = {
+	{ "VALARM",        "Alarm" },
+	{ "ATTACH",        "Attach" },
+	{ "ATTENDEE",      "Attendee" },
+	{ "CATEGORIES",    "Categories" },
+	{ "CLASS",         "Class" },
+	{ "COMMENT",       "Comment" },
+	{ "CONTACT",       "Contact" },
+	{ "CREATED",       "Created" },
+	{ "DTSTAMP",       "DateCalendarCreated" },
+	{ "DTEND",         "DateEnd" },
+	{ "DTSTART",       "DateStarted" },
+	{ "DESCRIPTION",   "Description" },
+	{ "DURATION",      "Duration" },
+	{ "EXDATE",        "ExceptionDateTime" },
+	{ "EXRULE",        "ExceptionRule" },
+	{ "GEO",           "Geo" },
+	{ "LAST-MODIFIED", "LastModified" },
+	{ "LOCATION",      "Location" },
+	{ "ORGANIZER",     "Organizer" },
+	{ "PRIORITY",      "Priority" },
+	{ "RDATE",         "RecurrenceDateTime" },
+	{ "RECURRENCE-ID", "RecurrenceId" },
+	{ "RRULE",         "RecurrenceRule" },
+	{ "RELATED-TO",    "RelatedTo" },
+	{ "RESOURCES",     "Resources" },
+	{ "SEQUENCE",      "Sequence" },
+	{ "STATUS",        "Status" },
+	{ "SUMMARY",       "Summary" },
+	{ "TRANSP",        "TimeTransparency" },
+	{ "UID",           "Uid" },
+	{ "URL",           "Url" },
+};
+
+static const OSyncEvoCapMap evo2_todo_caps[] = {
+	{ "ATTACH",           "Attach" },
+	{ "ATTENDEE",         "Attendee" },
+	{ "CATEGORIES",       "Categories" },
+	{ "CLASS",            "Class" },
+	{ "COMMENT",          "Comment" },
+	{ "COMPLETED",        "Completed" },
+	{ "CONTACT",          "Contact" },
+	{ "CREATED",          "Created" },
+	{ "DESCRIPTION",      "Description" },
+	{ "DTSTAMP",          "DateCalendarCreated" },
+	{ "DTSTART",          "DateStarted" },
+	{ "DUE",              "Due" },
+	{ "DURATION",         "Duration" },
+	{ "EXDATE",           "ExceptionDateTime" },
+	{ "EXRULE",           "ExceptionRule" },
+	{ "GEO",              "Geo" },
+	{ "LAST-MODIFIED",    "LastModified" },
+	{ "LOCATION",         "Location" },
+	{ "ORGANIZER",        "Organizer" },
+	{ "PERCENT-COMPLETE", "PercentComplete" },
+	{ "PRIORITY",         "Priority" },
+	{ "RDATE",            "RecurrenceDateTime" },
+	{ "RECURRENCE-ID",    "RecurrenceId" },
+	{ "RELATED-TO",       "RelatedTo" },
+	{ "RESOURCES",        "Resources" },
+	{ "RRULE",            "RecurrenceRule" },
+	{ "SEQUENCE",         "Sequence" },
+	{ "STATUS",           "Status" },
+	{ "SUMMARY",          "Summary" },
+	{ "UID",              "Uid" },
+	{ "URL",              "Url" },
+	{ "VALARM",           "Alarm" },
+};
+
+static const OSyncEvoCapMap xmlformat_todo_caps[] = {
+	{ "VALARM",           "Alarm" },
+	{ "ATTACH",           "Attach" },
+	{ "ATTENDEE",         "Attendee" },
+	{ "CATEGORIES",       "Categories" },
+	{ "CLASS",            "Class" },
+	{ "COMMENT",          "Comment" },
+	{ "COMPLETED",        "Completed" },
+	{ "CONTACT",          "Contact" },
+	{ "CREATED",          "Created" },
+	{ "DTSTAMP",          "DateCalendarCreated" },
+	{ "DTSTART",          "DateStarted" },
+	{ "DESCRIPTION",      "Description" },
+	{ "DUE",              "Due" },
+	{ "DURATION",         "Duration" },
+	{ "EXDATE",           "ExceptionDateTime" },
+	{ "EXRULE",           "ExceptionRule" },
+	{ "GEO",              "Geo" },
+	{ "LAST-MODIFIED",    "LastModified" },
+	{ "LOCATION",         "Location" },
+	{ "ORGANIZER",        "Organizer" },
+	{ "PERCENT-COMPLETE", "PercentComplete" },
+	{ "PRIORITY",         "Priority" },
+	{ "RDATE",            "RecurrenceDateTime" },
+	{ "RECURRENCE-ID",    "RecurrenceId" },
+	{ "RRULE",            "RecurrenceRule" },
+	{ "RELATED-TO",       "RelatedTo" },
+	{ "RESOURCES",        "Resources" },
+	{ "SEQUENCE",         "Sequence" },
+	{ "STATUS",           "Status" },
+	{ "SUMMARY",          "Summary" },
+	{ "UID",              "Uid" },
+	{ "URL",              "Url" },
+};
+
+static const OSyncEvoCapMap evo2_note_caps[] = {
+	{ "ATTACH",        "Attach" },
+	{ "ATTENDEE",      "Attendee" },
+	{ "CATEGORIES",    "Categories" },
+	{ "CLASS",         "Class" },
+	{ "COMMENT",       "Comment" },
+	{ "CONTACT",       "Contact" },
+	{ "CREATED",       "Created" },
+	{ "DESCRIPTION",   "Description" },
+	{ "DTSTAMP",       "DateCalendarCreated" },
+	{ "DTSTART",       "DateStarted" },
+	{ "EXDATE",        "ExceptionDateTime" },
+	{ "EXRULE",        "ExceptionRule" },
+	{ "LAST-MODIFIED", "LastModified" },
+	{ "ORGANIZER",     "Organizer" },
+	{ "RDATE",         "RecurrenceDateTime" },
+	{ "RECURRENCE-ID", "RecurrenceId" },
+	{ "RELATED-TO",    "RelatedTo" },
+	{ "RRULE",         "RecurrenceRule" },
+	{ "SEQUENCE",      "Sequence" },
+	{ "STATUS",        "Status" },
+	{ "SUMMARY",       "Summary" },
+	{ "UID",           "Uid" },
+	{ "URL",           "Url" },
+};
+
+static const OSyncEvoCapMap xmlformat_note_caps[] = {
+	{ "ATTACH",        "Attach" },
+	{ "ATTENDEE",      "Attendee" },
+	{ "CATEGORIES",    "Categories" },
+	{ "CLASS",         "Class" },
+	{ "COMMENT",       "Comment" },
+	{ "CONTACT",       "Contact" },
+	{ "CREATED",       "Created" },
+	{ "DTSTAMP",       "DateCalendarCreated" },
+	{ "DTSTART",       "DateStarted" },
+	{ "DESCRIPTION",   "Description" },
+	{ "EXDATE",        "ExceptionDateTime" },
+	{ "EXRULE",        "ExceptionRule" },
+	{ "LAST-MODIFIED", "LastModified" },
+	{ "ORGANIZER",     "Organizer" },
+	{ "RDATE",         "RecurrenceDateTime" },
+	{ "RECURRENCE-ID", "RecurrenceId" },
+	{ "RRULE",         "RecurrenceRule" },
+	{ "RELATED-TO",    "RelatedTo" },
+	{ "SEQUENCE",      "Sequence" },
+	{ "STATUS",        "Status" },
+	{ "SUMMARY",       "Summary" },
+	{ "UID",           "Uid" },
+	{ "URL",           "Url" },
+};
+
+typedef struct OSyncEvoCapTables {
+	const char *objtype;
+	const OSyncEvoCapMap *by_evo2;
+	const OSyncEvoCapMap *by_xmlformat;
+	size_t size;
+} OSyncEvoCapTables;
+
+#define EVO2_CAP_TABLES(objtype) { #objtype, evo2_##objtype##_caps, xmlformat_##objtype##_caps, G_N_ELEMENTS(evo2_##objtype##_caps) }
+
+static const OSyncEvoCapTables evo2_cap_tables[] = {
+	EVO2_CAP_TABLES(contact),
+	EVO2_CAP_TABLES(event),
+	EVO2_CAP_TABLES(todo),
+	EVO2_CAP_TABLES(note)
+};
+
+static int evo2_cap_cmp_evo2(const void *key, const void *entry)
+{
+	return strcmp((const char *) key, ((const OSyncEvoCapMap *) entry)->evo2);
+}
+
+static int evo2_cap_cmp_xmlformat(const void *key, const void *entry)
+{
+	return strcmp((const char *) key, ((const OSyncEvoCapMap *) entry)->xmlformat);
+}
+
+/* Returns the index of the first entry in by_xmlformat carrying name, or
+ * -1. Entries sharing an xmlformat name are adjacent. */
+static int evo2_cap_find_xmlformat(const OSyncEvoCapTables *tables, const char *name)
+{
+	const OSyncEvoCapMap *entry = bsearch(name, tables->by_xmlformat, tables->size, sizeof(OSyncEvoCapMap), evo2_cap_cmp_xmlformat);
+	if (!entry)
+		return -1;
+
+	while (entry > tables->by_xmlformat && !strcmp((entry - 1)->xmlformat, name))
+		entry--;
+	return entry - tables->by_xmlformat;
 }
 
+static osync_bool evo2_cap_add(OSyncCapabilitiesObjType *capsobjtype, const char *name, OSyncError **error)
+{
+	OSyncCapability *newcap = osync_capabilities_add_new_capability(capsobjtype, error);
+	if (!newcap)
+		return FALSE;
+
+	osync_capability_set_name(newcap, name);
+	return TRUE;
+}
 
-osync_bool caps_conv_generic(OSyncCapabilities *oldcaps, OSyncCapabilities *newcaps, const char *objtype, GHashTable *hash, OSyncError **error)
+static osync_bool caps_conv_objtype(OSyncCapabilities *oldcaps, OSyncCapabilities *newcaps, const OSyncEvoCapTables *tables, osync_bool to_xmlformat, OSyncError **error)
 {
+	OSyncCapabilitiesObjType *newcapsobjtype, *capsobjtype = osync_capabilities_get_objtype(oldcaps, tables->objtype);
+	OSyncList *c, *oldcapslist = NULL;
+	/* indexed by by_xmlformat position, so every name is added once */
+	osync_bool added[EVO2_CAPS_MAX];
+
+	if (!capsobjtype)
+		return TRUE;
 
-	OSyncCapabilitiesObjType *newcapsobjtype, *capsobjtype = osync_capabilities_get_objtype(oldcaps, objtype);
-	OSyncList *c, *oldcapslist = osync_capabilities_objtype_get_caps(capsobjtype);
+	osync_assert(tables->size <= EVO2_CAPS_MAX);
+	memset(added, 0, sizeof(added));
 
-	newcapsobjtype = osync_capabilities_add_new_objtype(newcaps, objtype, error);
+	newcapsobjtype = osync_capabilities_add_new_objtype(newcaps, tables->objtype, error);
 	if (!newcapsobjtype)
-		goto error;
+		return FALSE;
 
+	oldcapslist = osync_capabilities_objtype_get_caps(capsobjtype);
 	for (c = oldcapslist; c; c = c->next) {
-		OSyncCapability *oldcap = (OSyncCapability *) c->data;
-		const char *name = osync_capability_get_name(oldcap);
-		const char *new_name = g_hash_table_lookup(hash, name);
-		if (!new_name) {
-			osync_trace(TRACE_INTERNAL, "Couldn't find counter-part for capability \"%s\"", __NULLSTR(name));
-			continue;
-		}
+		const char *name = osync_capability_get_name((OSyncCapability *) c->data);
+		int i;
 
-		OSyncCapability *newcap = osync_capabilities_add_new_capability(newcapsobjtype, error);
-		if (!newcap)
-			goto error;
+		if (to_xmlformat) {
+			const OSyncEvoCapMap *entry = name ? bsearch(name, tables->by_evo2, tables->size, sizeof(OSyncEvoCapMap), evo2_cap_cmp_evo2) : NULL;
+			if (!entry) {
+				osync_trace(TRACE_INTERNAL, "Couldn't find counter-part for capability \"%s\"", __NULLSTR(name));
+				continue;
+			}
 
-		osync_capability_set_name(newcap, new_name);
+			i = evo2_cap_find_xmlformat(tables, entry->xmlformat);
+			if (added[i])
+				continue;
+			added[i] = TRUE;
+			if (!evo2_cap_add(newcapsobjtype, entry->xmlformat, error))
+				goto error;
+		} else {
+			if (!name || (i = evo2_cap_find_xmlformat(tables, name)) < 0) {
+				osync_trace(TRACE_INTERNAL, "Couldn't find counter-part for capability \"%s\"", __NULLSTR(name));
+				continue;
+			}
+
+			/* one xmlformat field may stand for several evo2 fields */
+			for (; i < (int) tables->size && !strcmp(tables->by_xmlformat[i].xmlformat, name); i++) {
+				if (added[i])
+					continue;
+				added[i] = TRUE;
+				if (!evo2_cap_add(newcapsobjtype, tables->by_xmlformat[i].evo2, error))
+					goto error;
+			}
+		}
 	}
+	osync_list_free(oldcapslist);
 
+	return TRUE;
+error:
+	osync_list_free(oldcapslist);
+	return FALSE;
+}
+
+static osync_bool caps_conv(OSyncCapabilities *oldcaps, OSyncCapabilities **newcaps, const char *format, osync_bool to_xmlformat, OSyncError **error)
+{
+	unsigned int i;
+
+	*newcaps = osync_capabilities_new(format, error);
+	if (!*newcaps)
+		goto error;
+
+	for (i = 0; i < G_N_ELEMENTS(evo2_cap_tables); i++) {
+		if (!caps_conv_objtype(oldcaps, *newcaps, &evo2_cap_tables[i], to_xmlformat, error))
+			goto error_free_caps;
+	}
 
 	return TRUE;
+
+error_free_caps:
+	osync_capabilities_unref(*newcaps);
+	*newcaps = NULL;
 error:
 	return FALSE;
 }
 
 osync_bool caps_conv_evo2_to_xmlformat(OSyncCapabilities *oldcaps, OSyncCapabilities **newcaps, const char *config, void *userdata, OSyncError **error)
 {
+	return caps_conv(oldcaps, newcaps, "xmlformat", TRUE, error);
+}
 
-	GHashTable *ebook_hash = get_ebook_to_xmlformat_hash();
+osync_bool caps_conv_xmlformat_to_evo2(OSyncCapabilities *oldcaps, OSyncCapabilities **newcaps, const char *config, void *userdata, OSyncError **error)
+{
+	return caps_conv(oldcaps, newcaps, "evo2-caps", FALSE, error);
+}
 
+/* Native contact format: an "evo2-contact" record holds the attributes of
+ * an EContact as the sink read them from EDS (see evolution2_record.h), so
+ * contacts are converted to and from xmlformat-contact directly instead
+ * of being printed to and parsed from vCard text on both sides.
+ *
+ * Sorted by vCard attribute name. Every value component is stored under
+ * the key of its position; with repeat set, all remaining components use
+ * the last key (Category, Unit). */
+typedef struct OSyncEvoContactField {
+	const char *attr;
+	const char *field;
+	osync_bool repeat;
+	const char *keys[8];
+} OSyncEvoContactField;
 
-	*newcaps = osync_capabilities_new("xmlformat" ,error);
-	if (!*newcaps)
+static const OSyncEvoContactField evo2_contact_fields[] = {
+	{ "ADR",                     "Address",       FALSE, { "PostalBox", "ExtendedAddress", "Street", "Locality", "Region", "PostalCode", "Country", NULL } },
+	{ "BDAY",                    "Birthday",      FALSE, { "Content", NULL } },
+	{ "CALURI",                  "CalendarUrl",   FALSE, { "Content", NULL } },
+	{ "CATEGORIES",              "Categories",    TRUE,  { "Category", NULL } },
+	{ "EMAIL",                   "EMail",         FALSE, { "Content", NULL } },
+	{ "FBURL",                   "FreeBusyUrl",   FALSE, { "Content", NULL } },
+	{ "FN",                      "FormattedName", FALSE, { "Content", NULL } },
+	{ "LABEL",                   "AddressLabel",  FALSE, { "Content", NULL } },
+	{ "LOGO",                    "Logo",          FALSE, { "Content", NULL } },
+	{ "N",                       "Name",          FALSE, { "LastName", "FirstName", "Additional", "Prefix", "Suffix", NULL } },
+	{ "NICKNAME",                "Nickname",      FALSE, { "Content", NULL } },
+	{ "NOTE",                    "Note",          FALSE, { "Content", NULL } },
+	{ "ORG",                     "Organization",  TRUE,  { "Name", "Department", "Unit", NULL } },
+	{ "PHOTO",                   "Photo",         FALSE, { "Content", NULL } },
+	{ "REV",                     "Revision",      FALSE, { "Content", NULL } },
+	{ "ROLE",                    "Profession",    FALSE, { "Content", NULL } },
+	{ "TEL",                     "Telephone",     FALSE, { "Content", NULL } },
+	{ "TITLE",                   "Title",         FALSE, { "Content", NULL } },
+	{ "UID",                     "Uid",           FALSE, { "Content", NULL } },
+	{ "URL",                     "Url",           FALSE, { "Content", NULL } },
+	{ "X-AIM",                   "IM-AIM",        FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-ANNIVERSARY", "Anniversary",   FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-ASSISTANT",   "Assistant",     FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-BLOG-URL",    "BlogUrl",       FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-FILE-AS",     "FileAs",        FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-MANAGER",     "Manager",       FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-SPOUSE",      "Spouse",        FALSE, { "Content", NULL } },
+	{ "X-EVOLUTION-VIDEO-URL",   "VideoUrl",      FALSE, { "Content", NULL } },
+	{ "X-GADUGADU",              "IM-GaduGadu",   FALSE, { "Content", NULL } },
+	{ "X-ICQ",                   "IM-ICQ",        FALSE, { "Content", NULL } },
+	{ "X-JABBER",                "IM-Jabber",     FALSE, { "Content", NULL } },
+	{ "X-MOZILLA-HTML",          "WantsHtml",     FALSE, { "Content", NULL } },
+	{ "X-MSN",                   "IM-MSN",        FALSE, { "Content", NULL } },
+	{ "X-YAHOO",                 "IM-Yahoo",      FALSE, { "Content", NULL } }
+};
+
+/* vCard TYPE parameter values and the xmlformat attributes they become.
+ * An attribute takes the first matching value, so the more specific ones
+ * come first: TYPE=CELL,VOICE is Cellular. */
+static const struct {
+	const char *type;
+	const char *attr;
+	const char *value;
+} evo2_contact_types[] = {
+	{ "HOME",  "Location",  "Home" },
+	{ "WORK",  "Location",  "Work" },
+	{ "CELL",  "Type",      "Cellular" },
+	{ "FAX",   "Type",      "Fax" },
+	{ "PAGER", "Type",      "Pager" },
+	{ "CAR",   "Type",      "Car" },
+	{ "ISDN",  "Type",      "ISDN" },
+	{ "VIDEO", "Type",      "Video" },
+	{ "MSG",   "Type",      "Message" },
+	{ "VOICE", "Type",      "Voice" },
+	{ "PREF",  "Preferred", "true" }
+};
+
+static int evo2_contact_field_cmp(const void *key, const void *entry)
+{
+	return g_ascii_strcasecmp((const char *) key, ((const OSyncEvoContactField *) entry)->attr);
+}
+
+static const OSyncEvoContactField *evo2_contact_field_by_attr(const char *attr)
+{
+	return bsearch(attr, evo2_contact_fields, G_N_ELEMENTS(evo2_contact_fields), sizeof(OSyncEvoContactField), evo2_contact_field_cmp);
+}
+
+static const OSyncEvoContactField *evo2_contact_field_by_xmlfield(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(evo2_contact_fields); i++) {
+		if (!strcmp(evo2_contact_fields[i].field, name))
+			return &evo2_contact_fields[i];
+	}
+	return NULL;
+}
+
+static osync_bool evo2_contact_is_binary(const OSyncEvoContactField *map)
+{
+	return !strcmp(map->attr, "PHOTO") || !strcmp(map->attr, "LOGO");
+}
+
+static osync_bool evo2_contact_set_keys(OSyncXMLField *xmlfield, const OSyncEvoContactField *map, const char *value, OSyncError **error)
+{
+	unsigned int nkeys = 0, i = 0;
+	const char *start = value, *end = NULL;
+
+	while (map->keys[nkeys])
+		nkeys++;
+
+	do {
+		const char *key = i < nkeys ? map->keys[i] : (map->repeat ? map->keys[nkeys - 1] : NULL);
+		end = strchr(start, EVO2_RECORD_LIST_SEPARATOR);
+		if (!key)
+			break;
+
+		if (end != start && *start) {
+			char *component = end ? g_strndup(start, end - start) : g_strdup(start);
+			osync_bool ret = (i >= nkeys - 1 && map->repeat) ?
+				osync_xmlfield_add_key_value(xmlfield, key, component, error) :
+				osync_xmlfield_set_key_value(xmlfield, key, component, error);
+			g_free(component);
+			if (!ret)
+				return FALSE;
+		}
+		start = end + 1;
+		i++;
+	} while (end);
+
+	return TRUE;
+}
+
+static osync_bool evo2_contact_set_attrs(OSyncXMLField *xmlfield, const OSyncEvoContactField *map, const char *params, OSyncError **error)
+{
+	unsigned int i;
+
+	if (evo2_contact_is_binary(map)) {
+		if (evo2_record_has_param(params, "ENCODING", "b") || evo2_record_has_param(params, "ENCODING", "BASE64"))
+			osync_xmlfield_set_attr(xmlfield, "Encoding", "B");
+		/* the image type is passed on as is */
+		char **param, **list = evo2_record_split_params(params);
+		for (param = list; *param; param++) {
+			if (!g_ascii_strncasecmp(*param, "TYPE=", strlen("TYPE="))) {
+				char *value = g_strndup(*param + strlen("TYPE="), strcspn(*param + strlen("TYPE="), ","));
+				osync_xmlfield_set_attr(xmlfield, "Type", value);
+				g_free(value);
+			}
+		}
+		g_strfreev(list);
+		return TRUE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(evo2_contact_types); i++) {
+		if (osync_xmlfield_get_attr(xmlfield, evo2_contact_types[i].attr))
+			continue;
+		if (evo2_record_has_param(params, "TYPE", evo2_contact_types[i].type))
+			osync_xmlfield_set_attr(xmlfield, evo2_contact_types[i].attr, evo2_contact_types[i].value);
+	}
+	return TRUE;
+}
+
+static osync_bool conv_evo2_contact_to_xmlformat(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %u, %p, %p, %p, %s, %p, %p)", __func__, input, inpsize, output, outpsize, free_input, config, userdata, error);
+	OSyncEvoRecordAttr attr;
+	unsigned int offset = 0;
+
+	OSyncXMLFormat *xmlformat = osync_xmlformat_new("contact", error);
+	if (!xmlformat)
 		goto error;
 
-	if (!caps_conv_generic(oldcaps, *newcaps, "contact", ebook_hash, error))
+	while (evo2_record_next(input, inpsize, &offset, &attr)) {
+		/* xmlformat has no groups */
+		const OSyncEvoContactField *map = evo2_contact_field_by_attr(evo2_record_name_ungrouped(attr.name));
+		if (!map) {
+			osync_trace(TRACE_INTERNAL, "No xmlformat field for %s", attr.name);
+			continue;
+		}
+
+		OSyncXMLField *xmlfield = osync_xmlfield_new(xmlformat, map->field, error);
+		if (!xmlfield)
+			goto error_free_xmlformat;
+		if (!evo2_contact_set_keys(xmlfield, map, attr.value, error) ||
+		    !evo2_contact_set_attrs(xmlfield, map, attr.params, error))
+			goto error_free_xmlformat;
+	}
+
+	if (!osync_xmlformat_sort(xmlformat, error))
+		goto error_free_xmlformat;
+
+	*free_input = TRUE;
+	*output = (char *) xmlformat;
+	*outpsize = osync_xmlformat_size();
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+
+ error_free_xmlformat:
+	osync_xmlformat_unref(xmlformat);
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+static void evo2_contact_append_params(GString *params, OSyncXMLField *xmlfield, const OSyncEvoContactField *map)
+{
+	const char *attr = NULL;
+	unsigned int i;
+
+	if (evo2_contact_is_binary(map)) {
+		if ((attr = osync_xmlfield_get_attr(xmlfield, "Encoding")))
+			g_string_append(params, "ENCODING=b");
+		if ((attr = osync_xmlfield_get_attr(xmlfield, "Type")))
+			g_string_append_printf(params, "%sTYPE=%s", params->len ? ";" : "", attr);
+		return;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(evo2_contact_types); i++) {
+		attr = osync_xmlfield_get_attr(xmlfield, evo2_contact_types[i].attr);
+		if (!attr || g_ascii_strcasecmp(attr, evo2_contact_types[i].value))
+			continue;
+		g_string_append(params, params->len ? "," : "TYPE=");
+		g_string_append(params, evo2_contact_types[i].type);
+	}
+}
+
+static void evo2_contact_append_value(GString *value, OSyncXMLField *xmlfield, const OSyncEvoContactField *map)
+{
+	unsigned int k, n, count = osync_xmlfield_get_key_count(xmlfield);
+
+	for (k = 0; map->keys[k]; k++) {
+		if (map->repeat && !map->keys[k + 1]) {
+			/* all occurrences of the repeated key */
+			osync_bool first = TRUE;
+			for (n = 0; n < count; n++) {
+				if (strcmp(osync_xmlfield_get_nth_key_name(xmlfield, n), map->keys[k]))
+					continue;
+				if (k || !first)
+					g_string_append_c(value, EVO2_RECORD_LIST_SEPARATOR);
+				g_string_append(value, osync_xmlfield_get_nth_key_value(xmlfield, n));
+				first = FALSE;
+			}
+		} else {
+			const char *component = osync_xmlfield_get_key_value(xmlfield, map->keys[k]);
+			if (k)
+				g_string_append_c(value, EVO2_RECORD_LIST_SEPARATOR);
+			g_string_append(value, component ? component : "");
+		}
+	}
+}
+
+static osync_bool conv_xmlformat_to_evo2_contact(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %u, %p, %p, %p, %s, %p, %p)", __func__, input, inpsize, output, outpsize, free_input, config, userdata, error);
+	OSyncXMLFormat *xmlformat = (OSyncXMLFormat *) input;
+	OSyncXMLField *xmlfield = NULL;
+	GString *record = g_string_new(NULL);
+	GString *params = g_string_new(NULL);
+	GString *value = g_string_new(NULL);
+
+	for (xmlfield = osync_xmlformat_get_first_field(xmlformat); xmlfield; xmlfield = osync_xmlfield_get_next(xmlfield)) {
+		const OSyncEvoContactField *map = evo2_contact_field_by_xmlfield(osync_xmlfield_get_name(xmlfield));
+		if (!map) {
+			osync_trace(TRACE_INTERNAL, "No evo2 attribute for %s", osync_xmlfield_get_name(xmlfield));
+			continue;
+		}
+
+		g_string_truncate(params, 0);
+		g_string_truncate(value, 0);
+		evo2_contact_append_params(params, xmlfield, map);
+		evo2_contact_append_value(value, xmlfield, map);
+		evo2_record_append(record, map->attr, params->str, value->str);
+	}
+
+	g_string_free(params, TRUE);
+	g_string_free(value, TRUE);
+
+	*free_input = TRUE;
+	*outpsize = record->len;
+	*output = g_string_free(record, FALSE);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+}
+
+/* Native calendar formats: evo2-event, evo2-todo and evo2-note records
+ * hold the properties of the icalcomponent the sink read from EDS. Nested
+ * components are framed by BEGIN and END attributes carrying the
+ * component name, VTIMEZONEs referenced by the entry come first. Text
+ * values are unescaped, in all other values the ';' separators (RRULE,
+ * GEO) are replaced by EVO2_RECORD_LIST_SEPARATOR.
+ *
+ * Sorted by iCalendar property name. */
+typedef struct OSyncEvoCalField {
+	const char *prop;
+	const char *field;
+	osync_bool repeat;
+	const char *keys[3];
+} OSyncEvoCalField;
+
+static const OSyncEvoCalField evo2_cal_fields[] = {
+	{ "ATTACH",           "Attach",              FALSE, { "Content", NULL } },
+	{ "ATTENDEE",         "Attendee",            FALSE, { "Content", NULL } },
+	{ "CATEGORIES",       "Categories",          TRUE,  { "Category", NULL } },
+	{ "CLASS",            "Class",               FALSE, { "Content", NULL } },
+	{ "COMMENT",          "Comment",             FALSE, { "Content", NULL } },
+	{ "COMPLETED",        "Completed",           FALSE, { "Content", NULL } },
+	{ "CONTACT",          "Contact",             FALSE, { "Content", NULL } },
+	{ "CREATED",          "Created",             FALSE, { "Content", NULL } },
+	{ "DESCRIPTION",      "Description",         FALSE, { "Content", NULL } },
+	{ "DTEND",            "DateEnd",             FALSE, { "Content", NULL } },
+	{ "DTSTAMP",          "DateCalendarCreated", FALSE, { "Content", NULL } },
+	{ "DTSTART",          "DateStarted",         FALSE, { "Content", NULL } },
+	{ "DUE",              "Due",                 FALSE, { "Content", NULL } },
+	{ "DURATION",         "Duration",            FALSE, { "Content", NULL } },
+	{ "EXDATE",           "ExceptionDateTime",   FALSE, { "Content", NULL } },
+	{ "GEO",              "Geo",                 FALSE, { "Latitude", "Longitude", NULL } },
+	{ "LAST-MODIFIED",    "LastModified",        FALSE, { "Content", NULL } },
+	{ "LOCATION",         "Location",            FALSE, { "Content", NULL } },
+	{ "ORGANIZER",        "Organizer",           FALSE, { "Content", NULL } },
+	{ "PERCENT-COMPLETE", "PercentComplete",     FALSE, { "Content", NULL } },
+	{ "PRIORITY",         "Priority",            FALSE, { "Content", NULL } },
+	{ "RDATE",            "RecurrenceDateTime",  FALSE, { "Content", NULL } },
+	{ "RECURRENCE-ID",    "RecurrenceId",        FALSE, { "Content", NULL } },
+	{ "RELATED-TO",       "RelatedTo",           FALSE, { "Content", NULL } },
+	{ "RESOURCES",        "Resources",           TRUE,  { "Resource", NULL } },
+	{ "RRULE",            "RecurrenceRule",      FALSE, { NULL } },
+	{ "SEQUENCE",         "Sequence",            FALSE, { "Content", NULL } },
+	{ "STATUS",           "Status",              FALSE, { "Content", NULL } },
+	{ "SUMMARY",          "Summary",             FALSE, { "Content", NULL } },
+	{ "TRANSP",           "TimeTransparency",    FALSE, { "Content", NULL } },
+	{ "UID",              "Uid",                 FALSE, { "Content", NULL } },
+	{ "URL",              "Url",                 FALSE, { "Content", NULL } }
+};
+
+/* VALARM properties, all keys of the Alarm field */
+static const struct {
+	const char *prop;
+	const char *key;
+} evo2_cal_alarm_keys[] = {
+	{ "ACTION",      "AlarmAction" },
+	{ "ATTACH",      "AlarmAttach" },
+	{ "ATTENDEE",    "AlarmAttendee" },
+	{ "DESCRIPTION", "AlarmDescription" },
+	{ "DURATION",    "AlarmDuration" },
+	{ "REPEAT",      "AlarmRepeat" },
+	{ "SUMMARY",     "AlarmSummary" },
+	{ "TRIGGER",     "AlarmTrigger" }
+};
+
+/* RRULE parts, keys of the RecurrenceRule field */
+static const struct {
+	const char *part;
+	const char *key;
+} evo2_cal_rule_keys[] = {
+	{ "FREQ",       "Frequency" },
+	{ "UNTIL",      "Until" },
+	{ "COUNT",      "Count" },
+	{ "INTERVAL",   "Interval" },
+	{ "BYSECOND",   "BySecond" },
+	{ "BYMINUTE",   "ByMinute" },
+	{ "BYHOUR",     "ByHour" },
+	{ "BYDAY",      "ByDay" },
+	{ "BYMONTHDAY", "ByMonthDay" },
+	{ "BYYEARDAY",  "ByYearDay" },
+	{ "BYWEEKNO",   "ByWeekNo" },
+	{ "BYMONTH",    "ByMonth" },
+	{ "BYSETPOS",   "BySetPos" },
+	{ "WKST",       "WeekStart" }
+};
+
+/* iCalendar parameters and the xmlformat attributes they become */
+static const struct {
+	const char *param;
+	const char *attr;
+} evo2_cal_params[] = {
+	{ "ALTREP",         "AlternativeTextRep" },
+	{ "CN",             "CommonName" },
+	{ "CUTYPE",         "UserType" },
+	{ "DELEGATED-FROM", "DelegatedFrom" },
+	{ "DELEGATED-TO",   "DelegatedTo" },
+	{ "DIR",            "Directory" },
+	{ "ENCODING",       "Encoding" },
+	{ "FMTTYPE",        "FormatType" },
+	{ "LANGUAGE",       "Language" },
+	{ "MEMBER",         "Member" },
+	{ "PARTSTAT",       "PartStat" },
+	{ "RANGE",          "Range" },
+	{ "RELATED",        "Related" },
+	{ "RELTYPE",        "RelationType" },
+	{ "ROLE",           "Role" },
+	{ "RSVP",           "Rsvp" },
+	{ "SENT-BY",        "SentBy" },
+	{ "TZID",           "TimezoneID" },
+	{ "VALUE",          "Value" }
+};
+
+static int evo2_cal_field_cmp(const void *key, const void *entry)
+{
+	return g_ascii_strcasecmp((const char *) key, ((const OSyncEvoCalField *) entry)->prop);
+}
+
+static const OSyncEvoCalField *evo2_cal_field_by_prop(const char *prop)
+{
+	return bsearch(prop, evo2_cal_fields, G_N_ELEMENTS(evo2_cal_fields), sizeof(OSyncEvoCalField), evo2_cal_field_cmp);
+}
+
+static const OSyncEvoCalField *evo2_cal_field_by_xmlfield(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(evo2_cal_fields); i++) {
+		if (!strcmp(evo2_cal_fields[i].field, name))
+			return &evo2_cal_fields[i];
+	}
+	return NULL;
+}
+
+static const char *evo2_cal_component_name(const char *objtype)
+{
+	if (!strcmp(objtype, "todo"))
+		return "VTODO";
+	if (!strcmp(objtype, "note"))
+		return "VJOURNAL";
+	return "VEVENT";
+}
+
+static void evo2_cal_set_attrs(OSyncXMLField *xmlfield, const char *params)
+{
+	char **list = evo2_record_split_params(params), **item;
+	unsigned int i;
+
+	for (item = list; *item; item++) {
+		char *eq = strchr(*item, '=');
+		char *value = NULL;
+		if (!eq)
+			continue;
+		*eq = '\0';
+		for (i = 0; i < G_N_ELEMENTS(evo2_cal_params); i++) {
+			if (g_ascii_strcasecmp(*item, evo2_cal_params[i].param))
+				continue;
+			value = eq + 1;
+			if (*value == '"' && strlen(value) > 1 && value[strlen(value) - 1] == '"') {
+				value[strlen(value) - 1] = '\0';
+				value++;
+			}
+			osync_xmlfield_set_attr(xmlfield, evo2_cal_params[i].attr, value);
+			break;
+		}
+	}
+	g_strfreev(list);
+}
+
+static osync_bool evo2_cal_set_rule(OSyncXMLField *xmlfield, const char *value, OSyncError **error)
+{
+	char **parts = evo2_record_split_value(value), **part;
+	unsigned int i;
+
+	for (part = parts; *part; part++) {
+		char *eq = strchr(*part, '=');
+		if (!eq)
+			continue;
+		*eq = '\0';
+		for (i = 0; i < G_N_ELEMENTS(evo2_cal_rule_keys); i++) {
+			if (g_ascii_strcasecmp(*part, evo2_cal_rule_keys[i].part))
+				continue;
+			if (!osync_xmlfield_set_key_value(xmlfield, evo2_cal_rule_keys[i].key, eq + 1, error)) {
+				g_strfreev(parts);
+				return FALSE;
+			}
+			break;
+		}
+	}
+	g_strfreev(parts);
+	return TRUE;
+}
+
+static osync_bool evo2_cal_set_keys(OSyncXMLField *xmlfield, const OSyncEvoCalField *map, const char *value, OSyncError **error)
+{
+	char **components = NULL;
+	unsigned int nkeys = 0, i;
+	osync_bool ret = TRUE;
+
+	if (!map->keys[0])
+		return evo2_cal_set_rule(xmlfield, value, error);
+
+	while (map->keys[nkeys])
+		nkeys++;
+
+	components = evo2_record_split_value(value);
+	for (i = 0; ret && components[i]; i++) {
+		if (!*components[i])
+			continue;
+		if (i < nkeys && !map->repeat)
+			ret = osync_xmlfield_set_key_value(xmlfield, map->keys[i], components[i], error);
+		else if (map->repeat)
+			ret = osync_xmlfield_add_key_value(xmlfield, map->keys[MIN(i, nkeys - 1)], components[i], error);
+	}
+	g_strfreev(components);
+	return ret;
+}
+
+static osync_bool conv_evo2_cal_to_xmlformat(const char *objtype, char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%s, %p, %u, %p, %p, %p, %p)", __func__, objtype, input, inpsize, output, outpsize, free_input, error);
+	OSyncEvoRecordAttr attr;
+	OSyncXMLField *alarm = NULL;
+	unsigned int offset = 0, skip = 0, i;
+
+	OSyncXMLFormat *xmlformat = osync_xmlformat_new(objtype, error);
+	if (!xmlformat)
+		goto error;
+
+	while (evo2_record_next(input, inpsize, &offset, &attr)) {
+		/* timezones are referenced by TimezoneID only */
+		if (!g_ascii_strcasecmp(attr.name, "BEGIN") && (skip || !g_ascii_strcasecmp(attr.value, "VTIMEZONE"))) {
+			skip++;
+			continue;
+		}
+		if (skip) {
+			if (!g_ascii_strcasecmp(attr.name, "END"))
+				skip--;
+			continue;
+		}
+
+		if (!g_ascii_strcasecmp(attr.name, "BEGIN")) {
+			if (!g_ascii_strcasecmp(attr.value, "VALARM") && !(alarm = osync_xmlfield_new(xmlformat, "Alarm", error)))
+				goto error_free_xmlformat;
+			continue;
+		}
+		if (!g_ascii_strcasecmp(attr.name, "END")) {
+			alarm = NULL;
+			continue;
+		}
+
+		if (alarm) {
+			for (i = 0; i < G_N_ELEMENTS(evo2_cal_alarm_keys); i++) {
+				if (g_ascii_strcasecmp(attr.name, evo2_cal_alarm_keys[i].prop))
+					continue;
+				if (!osync_xmlfield_set_key_value(alarm, evo2_cal_alarm_keys[i].key, attr.value, error))
+					goto error_free_xmlformat;
+				if (!g_ascii_strcasecmp(attr.name, "TRIGGER"))
+					evo2_cal_set_attrs(alarm, attr.params);
+				break;
+			}
+			continue;
+		}
+
+		const OSyncEvoCalField *map = evo2_cal_field_by_prop(attr.name);
+		if (!map) {
+			osync_trace(TRACE_INTERNAL, "No xmlformat field for %s", attr.name);
+			continue;
+		}
+
+		OSyncXMLField *xmlfield = osync_xmlfield_new(xmlformat, map->field, error);
+		if (!xmlfield)
+			goto error_free_xmlformat;
+		if (!evo2_cal_set_keys(xmlfield, map, attr.value, error))
+			goto error_free_xmlformat;
+		evo2_cal_set_attrs(xmlfield, attr.params);
+	}
+
+	if (!osync_xmlformat_sort(xmlformat, error))
+		goto error_free_xmlformat;
+
+	*free_input = TRUE;
+	*output = (char *) xmlformat;
+	*outpsize = osync_xmlformat_size();
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+
+ error_free_xmlformat:
+	osync_xmlformat_unref(xmlformat);
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return FALSE;
+}
+
+static void evo2_cal_append_params(GString *params, OSyncXMLField *xmlfield)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(evo2_cal_params); i++) {
+		const char *attr = osync_xmlfield_get_attr(xmlfield, evo2_cal_params[i].attr);
+		if (!attr)
+			continue;
+		if (params->len)
+			g_string_append_c(params, ';');
+		if (strpbrk(attr, ",;:"))
+			g_string_append_printf(params, "%s=\"%s\"", evo2_cal_params[i].param, attr);
+		else
+			g_string_append_printf(params, "%s=%s", evo2_cal_params[i].param, attr);
+	}
+}
+
+static void evo2_cal_append_value(GString *value, OSyncXMLField *xmlfield, const OSyncEvoCalField *map)
+{
+	unsigned int k, n, count = osync_xmlfield_get_key_count(xmlfield);
+
+	if (!map->keys[0]) {
+		for (k = 0; k < G_N_ELEMENTS(evo2_cal_rule_keys); k++) {
+			const char *part = osync_xmlfield_get_key_value(xmlfield, evo2_cal_rule_keys[k].key);
+			if (!part)
+				continue;
+			if (value->len)
+				g_string_append_c(value, EVO2_RECORD_LIST_SEPARATOR);
+			g_string_append_printf(value, "%s=%s", evo2_cal_rule_keys[k].part, part);
+		}
+		return;
+	}
+
+	if (map->repeat) {
+		for (n = 0; n < count; n++) {
+			if (n)
+				g_string_append_c(value, EVO2_RECORD_LIST_SEPARATOR);
+			g_string_append(value, osync_xmlfield_get_nth_key_value(xmlfield, n));
+		}
+		return;
+	}
+
+	for (k = 0; map->keys[k]; k++) {
+		const char *component = osync_xmlfield_get_key_value(xmlfield, map->keys[k]);
+		if (k)
+			g_string_append_c(value, EVO2_RECORD_LIST_SEPARATOR);
+		g_string_append(value, component ? component : "");
+	}
+}
+
+static void evo2_cal_append_alarm(GString *record, OSyncXMLField *xmlfield)
+{
+	GString *params = g_string_new(NULL);
+	unsigned int i;
+
+	evo2_record_append(record, "BEGIN", NULL, "VALARM");
+	for (i = 0; i < G_N_ELEMENTS(evo2_cal_alarm_keys); i++) {
+		const char *value = osync_xmlfield_get_key_value(xmlfield, evo2_cal_alarm_keys[i].key);
+		if (!value)
+			continue;
+		g_string_truncate(params, 0);
+		/* VALUE and RELATED describe the trigger */
+		if (!strcmp(evo2_cal_alarm_keys[i].prop, "TRIGGER"))
+			evo2_cal_append_params(params, xmlfield);
+		evo2_record_append(record, evo2_cal_alarm_keys[i].prop, params->str, value);
+	}
+	evo2_record_append(record, "END", NULL, "VALARM");
+	g_string_free(params, TRUE);
+}
+
+static osync_bool conv_xmlformat_to_evo2_cal(const char *objtype, char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%s, %p, %u, %p, %p, %p, %p)", __func__, objtype, input, inpsize, output, outpsize, free_input, error);
+	OSyncXMLFormat *xmlformat = (OSyncXMLFormat *) input;
+	OSyncXMLField *xmlfield = NULL;
+	GString *record = g_string_new(NULL);
+	GString *params = g_string_new(NULL);
+	GString *value = g_string_new(NULL);
+	const char *component = evo2_cal_component_name(objtype);
+
+	evo2_record_append(record, "BEGIN", NULL, component);
+	for (xmlfield = osync_xmlformat_get_first_field(xmlformat); xmlfield; xmlfield = osync_xmlfield_get_next(xmlfield)) {
+		if (!strcmp(osync_xmlfield_get_name(xmlfield), "Alarm")) {
+			evo2_cal_append_alarm(record, xmlfield);
+			continue;
+		}
+
+		const OSyncEvoCalField *map = evo2_cal_field_by_xmlfield(osync_xmlfield_get_name(xmlfield));
+		if (!map) {
+			osync_trace(TRACE_INTERNAL, "No evo2 property for %s", osync_xmlfield_get_name(xmlfield));
+			continue;
+		}
+
+		g_string_truncate(params, 0);
+		g_string_truncate(value, 0);
+		evo2_cal_append_params(params, xmlfield);
+		evo2_cal_append_value(value, xmlfield, map);
+		evo2_record_append(record, map->prop, params->str, value->str);
+	}
+	evo2_record_append(record, "END", NULL, component);
+
+	g_string_free(params, TRUE);
+	g_string_free(value, TRUE);
+
+	*free_input = TRUE;
+	*outpsize = record->len;
+	*output = g_string_free(record, FALSE);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+}
+
+static osync_bool conv_evo2_event_to_xmlformat(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	return conv_evo2_cal_to_xmlformat("event", input, inpsize, output, outpsize, free_input, error);
+}
+
+static osync_bool conv_xmlformat_to_evo2_event(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	return conv_xmlformat_to_evo2_cal("event", input, inpsize, output, outpsize, free_input, error);
+}
+
+static osync_bool conv_evo2_todo_to_xmlformat(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	return conv_evo2_cal_to_xmlformat("todo", input, inpsize, output, outpsize, free_input, error);
+}
+
+static osync_bool conv_xmlformat_to_evo2_todo(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	return conv_xmlformat_to_evo2_cal("todo", input, inpsize, output, outpsize, free_input, error);
+}
+
+static osync_bool conv_evo2_note_to_xmlformat(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	return conv_evo2_cal_to_xmlformat("note", input, inpsize, output, outpsize, free_input, error);
+}
+
+static osync_bool conv_xmlformat_to_evo2_note(char *input, unsigned int inpsize, char **output, unsigned int *outpsize, osync_bool *free_input, const char *config, void *userdata, OSyncError **error)
+{
+	return conv_xmlformat_to_evo2_cal("note", input, inpsize, output, outpsize, free_input, error);
+}
+
+static int evo2_record_attr_sort(gconstpointer a, gconstpointer b)
+{
+	return evo2_record_attr_compare((const OSyncEvoRecordAttr *) a, (const OSyncEvoRecordAttr *) b);
+}
+
+static osync_bool evo2_record_name_in(const char *name, const char * const *names)
+{
+	for (; *names; names++) {
+		if (!g_ascii_strcasecmp(name, *names))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Collects the attributes of a record that matter for comparison, i.e.
+ * all but the ignored ones and embedded timezones, in a canonical order. */
+static GArray *evo2_record_compare_attrs(const char *data, unsigned int size, const char * const *ignore)
+{
+	GArray *attrs = g_array_new(FALSE, FALSE, sizeof(OSyncEvoRecordAttr));
+	OSyncEvoRecordAttr attr;
+	unsigned int offset = 0, skip = 0;
+
+	while (evo2_record_next(data, size, &offset, &attr)) {
+		if (!g_ascii_strcasecmp(attr.name, "BEGIN") && (skip || !g_ascii_strcasecmp(attr.value, "VTIMEZONE"))) {
+			skip++;
+			continue;
+		}
+		if (skip) {
+			if (!g_ascii_strcasecmp(attr.name, "END"))
+				skip--;
+			continue;
+		}
+		if (evo2_record_name_in(attr.name, ignore))
+			continue;
+		g_array_append_val(attrs, attr);
+	}
+	g_array_sort(attrs, evo2_record_attr_sort);
+	return attrs;
+}
+
+static const char *evo2_record_find_value(GArray *attrs, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < attrs->len; i++) {
+		OSyncEvoRecordAttr *attr = &g_array_index(attrs, OSyncEvoRecordAttr, i);
+		if (!g_ascii_strcasecmp(attr->name, name))
+			return attr->value;
+	}
+	return NULL;
+}
+
+/* SAME if all but the ignored attributes match, SIMILAR if at least the
+ * key attributes do. */
+static OSyncConvCmpResult evo2_record_compare(const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize, const char * const *ignore, const char * const *keys)
+{
+	GArray *left = evo2_record_compare_attrs(leftdata, leftsize, ignore);
+	GArray *right = evo2_record_compare_attrs(rightdata, rightsize, ignore);
+	OSyncConvCmpResult result = OSYNC_CONV_DATA_SAME;
+	unsigned int i;
+
+	if (left->len != right->len)
+		result = OSYNC_CONV_DATA_MISMATCH;
+	for (i = 0; result == OSYNC_CONV_DATA_SAME && i < left->len; i++) {
+		if (evo2_record_attr_compare(&g_array_index(left, OSyncEvoRecordAttr, i), &g_array_index(right, OSyncEvoRecordAttr, i)))
+			result = OSYNC_CONV_DATA_MISMATCH;
+	}
+
+	if (result == OSYNC_CONV_DATA_MISMATCH) {
+		result = OSYNC_CONV_DATA_SIMILAR;
+		for (; *keys && result == OSYNC_CONV_DATA_SIMILAR; keys++) {
+			const char *lvalue = evo2_record_find_value(left, *keys);
+			const char *rvalue = evo2_record_find_value(right, *keys);
+			if (!lvalue || !rvalue || strcmp(lvalue, rvalue))
+				result = OSYNC_CONV_DATA_MISMATCH;
+		}
+	}
+
+	g_array_free(left, TRUE);
+	g_array_free(right, TRUE);
+	return result;
+}
+
+static const char * const evo2_contact_ignore[] = { "UID", "REV", "VERSION", NULL };
+static const char * const evo2_contact_keys[] = { "N", NULL };
+static const char * const evo2_cal_ignore[] = { "UID", "DTSTAMP", "CREATED", "LAST-MODIFIED", "SEQUENCE", NULL };
+static const char * const evo2_cal_keys[] = { "SUMMARY", "DTSTART", NULL };
+
+static OSyncConvCmpResult compare_evo2_contact(const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize, void *user_data, OSyncError **error)
+{
+	return evo2_record_compare(leftdata, leftsize, rightdata, rightsize, evo2_contact_ignore, evo2_contact_keys);
+}
+
+static OSyncConvCmpResult compare_evo2_cal(const char *leftdata, unsigned int leftsize, const char *rightdata, unsigned int rightsize, void *user_data, OSyncError **error)
+{
+	return evo2_record_compare(leftdata, leftsize, rightdata, rightsize, evo2_cal_ignore, evo2_cal_keys);
+}
+
+static char *print_evo2_record(const char *data, unsigned int size, void *user_data)
+{
+	GString *out = g_string_new(NULL);
+	OSyncEvoRecordAttr attr;
+	unsigned int offset = 0;
+
+	while (evo2_record_next(data, size, &offset, &attr)) {
+		char *value = g_strdup(attr.value);
+		evo2_record_delimit_value(value, ';');
+		g_string_append_printf(out, "%s%s%s:%s\n", attr.name, *attr.params ? ";" : "", attr.params, value);
+		g_free(value);
+	}
+	return g_string_free(out, FALSE);
+}
+
+static void destroy_evo2_record(char *data, unsigned int size, void *user_data)
+{
+	g_free(data);
+}
+
+static osync_bool register_objformat(OSyncFormatEnv *env, const char *name, const char *objtype, OSyncFormatCompareFunc cmp_func, OSyncError **error)
+{
+	OSyncObjFormat *format = osync_objformat_new(name, objtype, error);
+	if (!format)
+		return FALSE;
+
+	osync_objformat_set_compare_func(format, cmp_func);
+	osync_objformat_set_destroy_func(format, destroy_evo2_record);
+	osync_objformat_set_print_func(format, print_evo2_record);
+
+	if (!osync_format_env_register_objformat(env, format, error)) {
+		osync_objformat_unref(format);
+		return FALSE;
+	}
+	osync_objformat_unref(format);
+	return TRUE;
+}
+
+osync_bool get_format_info(OSyncFormatEnv *env)
+{
+	OSyncError *error = NULL;
+
+	if (!register_objformat(env, "evo2-contact", "contact", compare_evo2_contact, &error) ||
+	    !register_objformat(env, "evo2-event", "event", compare_evo2_cal, &error) ||
+	    !register_objformat(env, "evo2-todo", "todo", compare_evo2_cal, &error) ||
+	    !register_objformat(env, "evo2-note", "note", compare_evo2_cal, &error))
 		goto error;
 
 	return TRUE;
 
 error:
+	osync_trace(TRACE_ERROR, "%s", osync_error_print(&error));
+	osync_error_unref(&error);
 	return FALSE;
 }
 
+static osync_bool register_converter(OSyncFormatEnv *env, const char *source, const char *target, OSyncFormatConvertFunc func, OSyncError **error)
+{
+	OSyncObjFormat *sourceformat = osync_format_env_find_objformat(env, source);
+	OSyncObjFormat *targetformat = osync_format_env_find_objformat(env, target);
+	OSyncFormatConverter *converter = NULL;
+
+	if (!sourceformat || !targetformat) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to find %s or %s format", source, target);
+		return FALSE;
+	}
+
+	converter = osync_converter_new(OSYNC_CONVERTER_CONV, sourceformat, targetformat, func, error);
+	if (!converter)
+		return FALSE;
+
+	osync_format_env_register_converter(env, converter, error);
+	osync_converter_unref(converter);
+	return TRUE;
+}
+
 osync_bool get_conversion_info(OSyncFormatEnv *env)
 {
-	OSyncError *error;
+	OSyncError *error = NULL;
 	/** Register Caps Converter */
 	OSyncCapsConverter *caps_converter = osync_caps_converter_new("evo2-caps", "xmlformat", caps_conv_evo2_to_xmlformat, &error);
 	if (!caps_converter)
@@ -154,6 +1366,28 @@ osync_bool get_conversion_info(OSyncFormatEnv *env)
 	osync_format_env_register_caps_converter(env, caps_converter, &error);
 	osync_caps_converter_unref(caps_converter);
 
+	caps_converter = osync_caps_converter_new("xmlformat", "evo2-caps", caps_conv_xmlformat_to_evo2, &error);
+	if (!caps_converter)
+		goto error;
+
+	osync_format_env_register_caps_converter(env, caps_converter, &error);
+	osync_caps_converter_unref(caps_converter);
+
+	/** Register evo2-contact <-> xmlformat-contact */
+	if (!register_converter(env, "evo2-contact", "xmlformat-contact", conv_evo2_contact_to_xmlformat, &error))
+		goto error;
+	if (!register_converter(env, "xmlformat-contact", "evo2-contact", conv_xmlformat_to_evo2_contact, &error))
+		goto error;
+
+	/** Register evo2-event/todo/note <-> xmlformat-event/todo/note */
+	if (!register_converter(env, "evo2-event", "xmlformat-event", conv_evo2_event_to_xmlformat, &error) ||
+	    !register_converter(env, "xmlformat-event", "evo2-event", conv_xmlformat_to_evo2_event, &error) ||
+	    !register_converter(env, "evo2-todo", "xmlformat-todo", conv_evo2_todo_to_xmlformat, &error) ||
+	    !register_converter(env, "xmlformat-todo", "evo2-todo", conv_xmlformat_to_evo2_todo, &error) ||
+	    !register_converter(env, "evo2-note", "xmlformat-note", conv_evo2_note_to_xmlformat, &error) ||
+	    !register_converter(env, "xmlformat-note", "evo2-note", conv_xmlformat_to_evo2_note, &error))
+		goto error;
+
 	return TRUE;
 
 error:
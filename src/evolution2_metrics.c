@@ -0,0 +1,367 @@
+/*
+ * evolution2_sync - A plugin for the opensync framework
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ * 
+ */
+
+#include <stdio.h>
+#include <glib.h>
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
+#include <opensync/opensync-plugin.h>
+
+#include "evolution2_metrics.h"
+
+static const char *evo2_phase_names[EVO2_PHASE_LAST] = {
+	"connect",
+	"get_changes",
+	"commit_added",
+	"commit_modified",
+	"commit_deleted",
+	"committed_all",
+	"sync_done",
+	"disconnect"
+};
+
+static const char *evo2_mem_class_names[EVO2_MEM_LAST] = {
+	"contact",
+	"icalcomponent",
+	"change"
+};
+
+/* Sinks of different objtypes may run in parallel worker threads and the
+ * document can be written from any of them. */
+G_LOCK_DEFINE_STATIC(metrics);
+static GStaticPrivate evo2_metrics_current = G_STATIC_PRIVATE_INIT;
+
+static guint64 evo2_metrics_now(void)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+	return (guint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
+static OSyncEvoMetrics *evo2_metrics_enter(void *userdata, guint64 *start)
+{
+	OSyncEvoMetrics *metrics = (OSyncEvoMetrics *)userdata;
+
+	g_static_private_set(&evo2_metrics_current, metrics, NULL);
+	*start = evo2_metrics_now();
+	return metrics;
+}
+
+static void evo2_metrics_leave(OSyncEvoMetrics *metrics, OSyncEvoPhase phase, guint64 start)
+{
+	guint64 now = evo2_metrics_now();
+	guint64 elapsed = now > start ? now - start : 0;
+	OSyncEvoPhaseStats *stats = &metrics->phases[phase];
+	unsigned int bucket = 0;
+
+	while (bucket < EVO2_METRICS_BUCKETS - 1 && (elapsed >> (bucket + 1)))
+		bucket++;
+
+	G_LOCK(metrics);
+	stats->calls++;
+	stats->total_us += elapsed;
+	if (elapsed > stats->max_us)
+		stats->max_us = elapsed;
+	stats->buckets[bucket]++;
+	G_UNLOCK(metrics);
+
+	g_static_private_set(&evo2_metrics_current, NULL, NULL);
+}
+
+static void evo2_metrics_connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	guint64 start;
+	OSyncEvoMetrics *metrics = evo2_metrics_enter(userdata, &start);
+
+	metrics->connect(sink, info, ctx, metrics->userdata);
+	evo2_metrics_leave(metrics, EVO2_PHASE_CONNECT, start);
+}
+
+static void evo2_metrics_disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	guint64 start;
+	OSyncEvoMetrics *metrics = evo2_metrics_enter(userdata, &start);
+
+	metrics->disconnect(sink, info, ctx, metrics->userdata);
+	evo2_metrics_leave(metrics, EVO2_PHASE_DISCONNECT, start);
+}
+
+static void evo2_metrics_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *userdata)
+{
+	guint64 start;
+	OSyncEvoMetrics *metrics = evo2_metrics_enter(userdata, &start);
+
+	metrics->get_changes(sink, info, ctx, slow_sync, metrics->userdata);
+	evo2_metrics_leave(metrics, EVO2_PHASE_GET_CHANGES, start);
+}
+
+static void evo2_metrics_commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change, void *userdata)
+{
+	guint64 start;
+	OSyncEvoPhase phase;
+
+	switch (osync_change_get_changetype(change)) {
+		case OSYNC_CHANGE_TYPE_ADDED:
+			phase = EVO2_PHASE_COMMIT_ADDED;
+			break;
+		case OSYNC_CHANGE_TYPE_DELETED:
+			phase = EVO2_PHASE_COMMIT_DELETED;
+			break;
+		default:
+			phase = EVO2_PHASE_COMMIT_MODIFIED;
+			break;
+	}
+
+	OSyncEvoMetrics *metrics = evo2_metrics_enter(userdata, &start);
+	metrics->commit(sink, info, ctx, change, metrics->userdata);
+	evo2_metrics_leave(metrics, phase, start);
+}
+
+static void evo2_metrics_committed_all(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	guint64 start;
+	OSyncEvoMetrics *metrics = evo2_metrics_enter(userdata, &start);
+
+	metrics->committed_all(sink, info, ctx, metrics->userdata);
+	evo2_metrics_leave(metrics, EVO2_PHASE_COMMITTED_ALL, start);
+}
+
+static void evo2_metrics_sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	guint64 start;
+	OSyncEvoMetrics *metrics = evo2_metrics_enter(userdata, &start);
+
+	OSyncError *error = NULL;
+	gint64 live = 0;
+	unsigned int i;
+
+	G_LOCK(metrics);
+	for (i = 0; i < EVO2_MEM_LAST; i++)
+		live += metrics->mem_objects[i];
+	live += metrics->ical_allocated - metrics->ical_released;
+	G_UNLOCK(metrics);
+
+	if (metrics->check_memory && live) {
+		/* every accounted object of this cycle has to be gone by now */
+		osync_context_report_error(ctx, OSYNC_ERROR_GENERIC, "%s: %" G_GINT64_FORMAT " objects (%" G_GINT64_FORMAT " bytes) still accounted after the sync",
+				metrics->name, live, metrics->mem_bytes);
+		evo2_metrics_leave(metrics, EVO2_PHASE_SYNC_DONE, start);
+		return;
+	}
+
+	metrics->sync_done(sink, info, ctx, metrics->userdata);
+	evo2_metrics_leave(metrics, EVO2_PHASE_SYNC_DONE, start);
+
+	if (metrics->path && metrics->registry && !evo2_metrics_write(*metrics->registry, metrics->path, &error)) {
+		osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+		osync_error_unref(&error);
+	}
+}
+
+OSyncEvoMetrics *evo2_metrics_new(const char *name, void *userdata, OSyncError **error)
+{
+	OSyncEvoMetrics *metrics = osync_try_malloc0(sizeof(OSyncEvoMetrics), error);
+	if (!metrics)
+		return NULL;
+
+	metrics->name = g_strdup(name);
+	metrics->userdata = userdata;
+	metrics->check_memory = g_getenv("EVO2_MEMORY_CHECK") ? TRUE : FALSE;
+	return metrics;
+}
+
+void evo2_metrics_attach(OSyncEvoMetrics *metrics, OSyncObjTypeSink *sink, OSyncEvoWorker *worker)
+{
+	if (worker) {
+		worker->connect = metrics->connect ? evo2_metrics_connect : NULL;
+		worker->disconnect = metrics->disconnect ? evo2_metrics_disconnect : NULL;
+		worker->get_changes = metrics->get_changes ? evo2_metrics_get_changes : NULL;
+		worker->commit = metrics->commit ? evo2_metrics_commit : NULL;
+		worker->committed_all = metrics->committed_all ? evo2_metrics_committed_all : NULL;
+		worker->sync_done = metrics->sync_done ? evo2_metrics_sync_done : NULL;
+		worker->userdata = metrics;
+		evo2_worker_attach(worker, sink);
+		return;
+	}
+
+	if (metrics->connect)
+		osync_objtype_sink_set_connect_func(sink, evo2_metrics_connect);
+	if (metrics->disconnect)
+		osync_objtype_sink_set_disconnect_func(sink, evo2_metrics_disconnect);
+	if (metrics->get_changes)
+		osync_objtype_sink_set_get_changes_func(sink, evo2_metrics_get_changes);
+	if (metrics->commit)
+		osync_objtype_sink_set_commit_func(sink, evo2_metrics_commit);
+	if (metrics->committed_all)
+		osync_objtype_sink_set_committed_all_func(sink, evo2_metrics_committed_all);
+	if (metrics->sync_done)
+		osync_objtype_sink_set_sync_done_func(sink, evo2_metrics_sync_done);
+
+	osync_objtype_sink_set_userdata(sink, metrics);
+}
+
+void evo2_metrics_free(OSyncEvoMetrics *metrics)
+{
+	g_free(metrics->name);
+	osync_free(metrics);
+}
+
+void evo2_metrics_reported(unsigned int size)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	if (!metrics)
+		return;
+
+	G_LOCK(metrics);
+	metrics->items_reported++;
+	metrics->bytes_serialized += size;
+	G_UNLOCK(metrics);
+}
+
+void evo2_metrics_eds_call(void)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	if (!metrics)
+		return;
+
+	G_LOCK(metrics);
+	metrics->eds_calls++;
+	G_UNLOCK(metrics);
+}
+
+void evo2_metrics_inflight(unsigned int inflight)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	if (!metrics)
+		return;
+
+	G_LOCK(metrics);
+	if (inflight > metrics->inflight_peak)
+		metrics->inflight_peak = inflight;
+	G_UNLOCK(metrics);
+}
+
+void evo2_metrics_ical_trees(unsigned int allocated, unsigned int released)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	if (!metrics)
+		return;
+
+	G_LOCK(metrics);
+	metrics->ical_allocated += allocated;
+	metrics->ical_released += released;
+	G_UNLOCK(metrics);
+}
+
+void evo2_metrics_mem_acquire(OSyncEvoMemClass class, unsigned int objects, gsize bytes)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	if (!metrics)
+		return;
+
+	G_LOCK(metrics);
+	metrics->mem_objects[class] += objects;
+	metrics->mem_bytes += bytes;
+	if (metrics->mem_bytes > metrics->mem_peak)
+		metrics->mem_peak = metrics->mem_bytes;
+	G_UNLOCK(metrics);
+}
+
+void evo2_metrics_mem_release(OSyncEvoMemClass class, unsigned int objects, gsize bytes)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	if (!metrics)
+		return;
+
+	G_LOCK(metrics);
+	metrics->mem_objects[class] -= objects;
+	metrics->mem_bytes -= bytes;
+	G_UNLOCK(metrics);
+}
+
+gsize evo2_metrics_mem_live_bytes(void)
+{
+	OSyncEvoMetrics *metrics = g_static_private_get(&evo2_metrics_current);
+	gint64 bytes;
+
+	if (!metrics)
+		return 0;
+
+	G_LOCK(metrics);
+	bytes = metrics->mem_bytes;
+	G_UNLOCK(metrics);
+	return bytes > 0 ? bytes : 0;
+}
+
+static void evo2_metrics_append(GString *json, OSyncEvoMetrics *metrics)
+{
+	unsigned int i, j;
+
+	g_string_append_printf(json, "    {\n      \"name\": \"%s\",\n", metrics->name);
+	g_string_append_printf(json, "      \"items_reported\": %" G_GUINT64_FORMAT ",\n", metrics->items_reported);
+	g_string_append_printf(json, "      \"bytes_serialized\": %" G_GUINT64_FORMAT ",\n", metrics->bytes_serialized);
+	g_string_append_printf(json, "      \"eds_calls\": %" G_GUINT64_FORMAT ",\n", metrics->eds_calls);
+	g_string_append_printf(json, "      \"ical_trees_allocated\": %" G_GUINT64_FORMAT ",\n", metrics->ical_allocated);
+	g_string_append_printf(json, "      \"ical_trees_released\": %" G_GUINT64_FORMAT ",\n", metrics->ical_released);
+	g_string_append_printf(json, "      \"inflight_peak\": %" G_GUINT64_FORMAT ",\n", metrics->inflight_peak);
+	g_string_append(json, "      \"memory\": { ");
+	for (i = 0; i < EVO2_MEM_LAST; i++)
+		g_string_append_printf(json, "\"live_%s\": %" G_GINT64_FORMAT ", ", evo2_mem_class_names[i], metrics->mem_objects[i]);
+	g_string_append_printf(json, "\"live_bytes\": %" G_GINT64_FORMAT ", \"peak_bytes\": %" G_GINT64_FORMAT " },\n", metrics->mem_bytes, metrics->mem_peak);
+	g_string_append(json, "      \"phases\": {\n");
+	for (i = 0; i < EVO2_PHASE_LAST; i++) {
+		OSyncEvoPhaseStats *stats = &metrics->phases[i];
+		g_string_append_printf(json, "        \"%s\": { \"calls\": %" G_GUINT64_FORMAT ", \"total_us\": %" G_GUINT64_FORMAT ", \"max_us\": %" G_GUINT64_FORMAT ", \"histogram_log2_us\": [",
+				evo2_phase_names[i], stats->calls, stats->total_us, stats->max_us);
+		for (j = 0; j < EVO2_METRICS_BUCKETS; j++)
+			g_string_append_printf(json, "%s%" G_GUINT64_FORMAT, j ? ", " : "", stats->buckets[j]);
+		g_string_append_printf(json, "] }%s\n", i + 1 < EVO2_PHASE_LAST ? "," : "");
+	}
+	g_string_append(json, "      }\n    }");
+}
+
+osync_bool evo2_metrics_write(GList *metrics, const char *path, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %s, %p)", __func__, metrics, path, error);
+	GString *json = g_string_new("{\n  \"sinks\": [\n");
+	GError *gerror = NULL;
+	GList *m = NULL;
+
+	G_LOCK(metrics);
+	for (m = metrics; m; m = m->next) {
+		evo2_metrics_append(json, (OSyncEvoMetrics *)m->data);
+		g_string_append(json, m->next ? ",\n" : "\n");
+	}
+	G_UNLOCK(metrics);
+	g_string_append(json, "  ]\n}\n");
+
+	if (!g_file_set_contents(path, json->str, json->len, &gerror)) {
+		osync_error_set(error, OSYNC_ERROR_IO_ERROR, "Unable to write metrics to %s: %s", path, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		g_string_free(json, TRUE);
+		osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+		return FALSE;
+	}
+
+	g_string_free(json, TRUE);
+	osync_trace(TRACE_EXIT, "%s", __func__);
+	return TRUE;
+}
@@ -0,0 +1,140 @@
+/*
+ * evolution2_sync - A plugin for the opensync framework
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ * 
+ */
+
+#ifndef EVO2_METRICS_H
+#define EVO2_METRICS_H
+
+#include <glib.h>
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-plugin.h>
+
+#include "evolution2_worker.h"
+
+typedef enum {
+	EVO2_PHASE_CONNECT,
+	EVO2_PHASE_GET_CHANGES,
+	EVO2_PHASE_COMMIT_ADDED,
+	EVO2_PHASE_COMMIT_MODIFIED,
+	EVO2_PHASE_COMMIT_DELETED,
+	EVO2_PHASE_COMMITTED_ALL,
+	EVO2_PHASE_SYNC_DONE,
+	EVO2_PHASE_DISCONNECT,
+	EVO2_PHASE_LAST
+} OSyncEvoPhase;
+
+/* Classes of objects the sinks hold on their own between EDS and OpenSync */
+typedef enum {
+	EVO2_MEM_CONTACT,
+	EVO2_MEM_ICALCOMPONENT,
+	EVO2_MEM_CHANGE,
+	EVO2_MEM_LAST
+} OSyncEvoMemClass;
+
+/* bucket i counts calls that took [2^i, 2^(i+1)) microseconds */
+#define EVO2_METRICS_BUCKETS	32
+
+typedef struct OSyncEvoPhaseStats {
+	guint64 calls;
+	guint64 total_us;
+	guint64 max_us;
+	guint64 buckets[EVO2_METRICS_BUCKETS];
+} OSyncEvoPhaseStats;
+
+/*! @brief Timing and counters of one objtype sink
+ *
+ * Sits between OpenSync (or the sink's worker) and the real sink
+ * functions and times every call. While a sink function runs, the
+ * metrics are the thread's current ones, so report and EDS call counters
+ * can be bumped from anywhere below it without passing them around.
+ */
+typedef struct OSyncEvoMetrics {
+	char *name;
+	void *userdata;
+	/* if path is set, all metrics in registry are written there after
+	 * every sync_done */
+	GList **registry;
+	const char *path;
+
+	OSyncEvoSinkFn connect;
+	OSyncEvoSinkFn disconnect;
+	OSyncEvoGetChangesFn get_changes;
+	OSyncEvoCommitFn commit;
+	OSyncEvoSinkFn committed_all;
+	OSyncEvoSinkFn sync_done;
+
+	OSyncEvoPhaseStats phases[EVO2_PHASE_LAST];
+	guint64 items_reported;
+	guint64 bytes_serialized;
+	guint64 eds_calls;
+	guint64 ical_allocated;
+	guint64 ical_released;
+	/* most async EDS requests outstanding at once */
+	guint64 inflight_peak;
+
+	/* memory accounting; with check_memory (EVO2_MEMORY_CHECK set in the
+	 * environment) sync_done fails if anything is still accounted */
+	gint64 mem_objects[EVO2_MEM_LAST];
+	gint64 mem_bytes;
+	gint64 mem_peak;
+	osync_bool check_memory;
+} OSyncEvoMetrics;
+
+/*! @brief Creates the metrics of a sink
+ *
+ * @param name Name of the sink in the JSON document, usually the objtype
+ * @param userdata The userdata the sink functions expect
+ * @param error Error information if NULL is returned
+ */
+OSyncEvoMetrics *evo2_metrics_new(const char *name, void *userdata, OSyncError **error);
+
+/*! @brief Routes the sink functions set on the metrics through their timers
+ *
+ * With a worker, the timed calls run on the worker thread. Replaces the
+ * sink's (or the worker's) functions and userdata.
+ */
+void evo2_metrics_attach(OSyncEvoMetrics *metrics, OSyncObjTypeSink *sink, OSyncEvoWorker *worker);
+
+void evo2_metrics_free(OSyncEvoMetrics *metrics);
+
+/*! @brief Counts one reported change of size bytes for the current sink */
+void evo2_metrics_reported(unsigned int size);
+
+/*! @brief Counts one round trip to the EDS backend for the current sink */
+void evo2_metrics_eds_call(void);
+
+/*! @brief Counts iCalendar trees allocated and released by the current sink's commits */
+void evo2_metrics_ical_trees(unsigned int allocated, unsigned int released);
+
+/*! @brief Records that inflight async EDS requests are outstanding for the current sink */
+void evo2_metrics_inflight(unsigned int inflight);
+
+/*! @brief Accounts objects of class taking about bytes for the current sink */
+void evo2_metrics_mem_acquire(OSyncEvoMemClass class, unsigned int objects, gsize bytes);
+
+/*! @brief Releases what evo2_metrics_mem_acquire() accounted */
+void evo2_metrics_mem_release(OSyncEvoMemClass class, unsigned int objects, gsize bytes);
+
+/*! @brief Bytes currently accounted for the current sink */
+gsize evo2_metrics_mem_live_bytes(void);
+
+/*! @brief Writes all metrics as a JSON document to path */
+osync_bool evo2_metrics_write(GList *metrics, const char *path, OSyncError **error);
+
+#endif /* EVO2_METRICS_H */
@@ -0,0 +1,136 @@
+/*
+ * evolution2_sync - A plugin for the opensync framework
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ * 
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include <opensync/opensync.h>
+
+#include "evolution2_record.h"
+
+void evo2_record_append(GString *record, const char *name, const char *params, const char *value)
+{
+	g_string_append_len(record, name, strlen(name) + 1);
+	g_string_append_len(record, params ? params : "", params ? strlen(params) + 1 : 1);
+	g_string_append_len(record, value ? value : "", value ? strlen(value) + 1 : 1);
+}
+
+osync_bool evo2_record_next(const char *data, unsigned int size, unsigned int *offset, OSyncEvoRecordAttr *attr)
+{
+	const char **parts[3];
+	const char *end = NULL;
+	unsigned int i;
+
+	parts[0] = &attr->name;
+	parts[1] = &attr->params;
+	parts[2] = &attr->value;
+
+	for (i = 0; i < 3; i++) {
+		if (!data || *offset >= size)
+			return FALSE;
+		if (!(end = memchr(data + *offset, '\0', size - *offset)))
+			return FALSE;
+		*parts[i] = data + *offset;
+		*offset = end - data + 1;
+	}
+	return TRUE;
+}
+
+char **evo2_record_split_value(const char *value)
+{
+	const char separator[] = { EVO2_RECORD_LIST_SEPARATOR, '\0' };
+
+	return g_strsplit(value, separator, 0);
+}
+
+void evo2_record_delimit_value(char *value, char delimiter)
+{
+	for (; *value; value++) {
+		if (*value == EVO2_RECORD_LIST_SEPARATOR)
+			*value = delimiter;
+	}
+}
+
+const char *evo2_record_name_ungrouped(const char *name)
+{
+	const char *dot = strchr(name, '.');
+
+	return dot ? dot + 1 : name;
+}
+
+char **evo2_record_split_params(const char *params)
+{
+	GPtrArray *items = g_ptr_array_new();
+	const char *start = params, *p = NULL;
+	osync_bool quoted = FALSE;
+
+	for (p = params; p && *p; p++) {
+		if (*p == '"')
+			quoted = !quoted;
+		else if (*p == ';' && !quoted) {
+			if (p > start)
+				g_ptr_array_add(items, g_strndup(start, p - start));
+			start = p + 1;
+		}
+	}
+	if (p && p > start)
+		g_ptr_array_add(items, g_strndup(start, p - start));
+
+	g_ptr_array_add(items, NULL);
+	return (char **) g_ptr_array_free(items, FALSE);
+}
+
+osync_bool evo2_record_has_param(const char *params, const char *name, const char *value)
+{
+	size_t namelen = strlen(name);
+	const char *p = params;
+
+	while (p && *p) {
+		const char *next = strchr(p, ';');
+		const char *eq = strchr(p, '=');
+
+		if (!g_ascii_strncasecmp(p, name, namelen) && (p[namelen] == '=' || p[namelen] == ';' || !p[namelen])) {
+			if (!value)
+				return TRUE;
+			if (eq && (!next || eq < next)) {
+				const char *v = eq + 1;
+				while (v && *v && (!next || v < next)) {
+					const char *comma = strchr(v, ',');
+					size_t len = (comma && (!next || comma < next)) ? (size_t)(comma - v) : (next ? (size_t)(next - v) : strlen(v));
+					if (len == strlen(value) && !g_ascii_strncasecmp(v, value, len))
+						return TRUE;
+					v = (comma && (!next || comma < next)) ? comma + 1 : NULL;
+				}
+			}
+		}
+		p = next ? next + 1 : NULL;
+	}
+	return FALSE;
+}
+
+int evo2_record_attr_compare(const OSyncEvoRecordAttr *a, const OSyncEvoRecordAttr *b)
+{
+	int ret;
+
+	if ((ret = g_ascii_strcasecmp(a->name, b->name)))
+		return ret;
+	if ((ret = strcmp(a->params, b->params)))
+		return ret;
+	return strcmp(a->value, b->value);
+}
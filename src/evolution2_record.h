@@ -0,0 +1,79 @@
+/*
+ * evolution2_sync - A plugin for the opensync framework
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ * 
+ */
+
+#ifndef EVO2_RECORD_H
+#define EVO2_RECORD_H
+
+#include <glib.h>
+
+#include <opensync/opensync.h>
+
+/*! @brief Separates the components of a structured or multi-valued value */
+#define EVO2_RECORD_LIST_SEPARATOR	'\x1f'
+
+/*! @brief One attribute of an evo2 record
+ *
+ * A record (the data of the native evo2-* objformats) is a plain sequence
+ * of attributes, each stored as name, parameters and value, every one
+ * terminated by NUL. A vCard group is kept in front of the name, as in
+ * "item1.EMAIL". Parameters are written as in vCard/iCalendar
+ * (NAME=value,value;NAME=value), value components are separated by
+ * EVO2_RECORD_LIST_SEPARATOR and are not escaped. The pointers of a
+ * parsed attribute point into the record.
+ */
+typedef struct OSyncEvoRecordAttr {
+	const char *name;
+	const char *params;
+	const char *value;
+} OSyncEvoRecordAttr;
+
+/*! @brief Appends an attribute to record; params and value may be NULL */
+void evo2_record_append(GString *record, const char *name, const char *params, const char *value);
+
+/*! @brief Reads the attribute at *offset and advances *offset past it
+ *
+ * Returns FALSE at the end of the record or if the record is truncated.
+ */
+osync_bool evo2_record_next(const char *data, unsigned int size, unsigned int *offset, OSyncEvoRecordAttr *attr);
+
+/*! @brief Splits value into its EVO2_RECORD_LIST_SEPARATOR separated components
+ *
+ * Free the result with g_strfreev().
+ */
+char **evo2_record_split_value(const char *value);
+
+/*! @brief Replaces the EVO2_RECORD_LIST_SEPARATORs in value by delimiter */
+void evo2_record_delimit_value(char *value, char delimiter);
+
+/*! @brief Returns name without its group, if any */
+const char *evo2_record_name_ungrouped(const char *name);
+
+/*! @brief Splits params into NAME=value items, honouring quoted values
+ *
+ * Free the result with g_strfreev().
+ */
+char **evo2_record_split_params(const char *params);
+
+/*! @brief Checks whether params contain name (with value, if not NULL), case insensitive */
+osync_bool evo2_record_has_param(const char *params, const char *name, const char *value);
+
+/*! @brief Orders attributes by name, parameters and value */
+int evo2_record_attr_compare(const OSyncEvoRecordAttr *a, const OSyncEvoRecordAttr *b);
+
+#endif /* EVO2_RECORD_H */
@@ -18,6 +18,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
  *
  */
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef HAVE_EDS_VERSION_H
@@ -27,8 +28,10 @@
 #include <gmodule.h>
 
 #include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
 #include <opensync/opensync-format.h>
 #include <opensync/opensync-capabilities.h>
+#include <opensync/opensync-helper.h>
 #include <opensync/opensync-plugin.h>
 #include <opensync/opensync-version.h>
 
@@ -39,7 +42,21 @@
 void free_osync_evo_calendar(void *data, void* notused)
 {
 	OSyncEvoCalendar *cal = (OSyncEvoCalendar *)data;
+	GList *m;
 
+	for (m = cal->members; m; m = m->next) {
+		if (m->data != cal)
+			free_osync_evo_calendar(m->data, NULL);
+	}
+	g_list_free(cal->members);
+	cal->members = NULL;
+	g_strfreev(cal->uris);
+	g_free(cal->uid_prefix);
+
+	if (cal->worker) {
+		evo2_worker_free(cal->worker);
+		cal->worker = NULL;
+	}
 	if (cal->uri_key) {
 		free(cal->uri_key);
 		cal->uri_key = NULL;
@@ -48,6 +65,14 @@ void free_osync_evo_calendar(void *data, void* notused)
 		g_object_unref(cal->calendar);
 		cal->calendar = NULL;
 	}
+	if (cal->queue) {
+		g_queue_free(cal->queue);
+		cal->queue = NULL;
+	}
+	if (cal->committed) {
+		g_hash_table_destroy(cal->committed);
+		cal->committed = NULL;
+	}
 	if (cal->sink) {
 		osync_objtype_sink_unref(cal->sink);
 		cal->sink = NULL;
@@ -62,48 +87,432 @@ void free_osync_evo_calendar(void *data, void* notused)
 
 static void free_env(OSyncEvoEnv *env)
 {
+	if (env->contact_worker)
+		evo2_worker_free(env->contact_worker);
 	if (env->contact_sink)
 		osync_objtype_sink_unref(env->contact_sink);
 	if (env->pluginInfo)
 		osync_plugin_info_unref(env->pluginInfo);
 	if (env->change_id)
 		g_free(env->change_id);
+	if (env->contact_queue)
+		g_queue_free(env->contact_queue);
+	if (env->contact_inflight_uids)
+		g_hash_table_destroy(env->contact_inflight_uids);
+	if (env->contact_committed)
+		g_hash_table_destroy(env->contact_committed);
+	g_strfreev(env->contact_field_names);
 
 	g_list_foreach(env->calendars, free_osync_evo_calendar, NULL);
 	g_list_free(env->calendars);
 
+	if (env->book_sources)
+		evo2_source_index_free(env->book_sources);
+	int i;
+	for (i = 0; i < E_CAL_SOURCE_TYPE_LAST; i++) {
+		if (env->cal_sources[i])
+			evo2_source_index_free(env->cal_sources[i]);
+	}
+
+	g_list_foreach(env->metrics, (GFunc) evo2_metrics_free, NULL);
+	g_list_free(env->metrics);
+
+	if (env->handles)
+		g_hash_table_destroy(env->handles);
+	if (env->handle_lock)
+		g_mutex_free(env->handle_lock);
+
 	g_free(env);
 }
 
 
 
-ESource *evo2_find_source(ESourceList *list, const char *uri)
-{
-	GSList *g;
-	for (g = e_source_list_peek_groups (list); g; g = g->next) {
-		ESourceGroup *group = E_SOURCE_GROUP (g->data);
-		GSList *s;
-		for (s = e_source_group_peek_sources (group); s; s = s->next) {
-			ESource *source = E_SOURCE (s->data);
+/* Source lookups go through an index built once per ESourceList: every
+ * source is entered by URI, by name and by UID (URIs win over names, names
+ * over UIDs, as the old linear scan compared URI before name). The index
+ * is marked stale when the list emits "changed" and rebuilt on the next
+ * lookup, so lookups neither walk the groups nor allocate. */
+struct OSyncEvoSourceIndex {
+	ESourceList *list;
+	GHashTable *sources;
+	GMutex *lock;
+	gulong changed_id;
+	osync_bool stale;
+};
 
-			// e_source_get_uri() returns an allocated string
-			// that we need to free
-			char *source_uri = e_source_get_uri(source);
-			osync_trace(TRACE_INTERNAL, "Comparing source uri %s and %s", source_uri, uri);
-			int cmp = strcmp(source_uri, uri);
-			g_free(source_uri);
-			if (!cmp)
-				return source;
+static void evo2_source_index_add(GHashTable *sources, const char *key, ESource *source)
+{
+	if (key && !g_hash_table_lookup(sources, key))
+		g_hash_table_insert(sources, g_strdup(key), source);
+}
 
-			// e_source_peek_name() does not seem to require
-			// freeing... *sigh* had to read the source code to
-			// find this out
-			osync_trace(TRACE_INTERNAL, "Comparing source name %s and %s", e_source_peek_name(source), uri);
-			if (!strcmp(e_source_peek_name(source), uri))
-				return source;
+static void evo2_source_index_rebuild(OSyncEvoSourceIndex *index)
+{
+	GSList *g, *s;
+	int pass;
+
+	g_hash_table_remove_all(index->sources);
+	for (pass = 0; pass < 3; pass++) {
+		for (g = e_source_list_peek_groups(index->list); g; g = g->next) {
+			ESourceGroup *group = E_SOURCE_GROUP(g->data);
+			for (s = e_source_group_peek_sources(group); s; s = s->next) {
+				ESource *source = E_SOURCE(s->data);
+				char *uri = NULL;
+				switch (pass) {
+					case 0:
+						uri = e_source_get_uri(source);
+						evo2_source_index_add(index->sources, uri, source);
+						g_free(uri);
+						break;
+					case 1:
+						evo2_source_index_add(index->sources, e_source_peek_name(source), source);
+						break;
+					case 2:
+						evo2_source_index_add(index->sources, e_source_peek_uid(source), source);
+						break;
+				}
+			}
 		}
 	}
-	return NULL;
+	index->stale = FALSE;
+	osync_trace(TRACE_INTERNAL, "Indexed %u source keys", g_hash_table_size(index->sources));
+}
+
+static void evo2_source_index_changed(ESourceList *list, gpointer userdata)
+{
+	OSyncEvoSourceIndex *index = (OSyncEvoSourceIndex *)userdata;
+
+	g_mutex_lock(index->lock);
+	index->stale = TRUE;
+	g_mutex_unlock(index->lock);
+}
+
+OSyncEvoSourceIndex *evo2_source_index_new(ESourceList *list)
+{
+	OSyncEvoSourceIndex *index = g_new0(OSyncEvoSourceIndex, 1);
+
+	index->list = list;
+	index->sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	index->lock = g_mutex_new();
+	index->changed_id = g_signal_connect(list, "changed", G_CALLBACK(evo2_source_index_changed), index);
+	index->stale = TRUE;
+	return index;
+}
+
+ESource *evo2_source_index_lookup(OSyncEvoSourceIndex *index, const char *key)
+{
+	ESource *source = NULL;
+
+	g_mutex_lock(index->lock);
+	if (index->stale)
+		evo2_source_index_rebuild(index);
+	if ((source = g_hash_table_lookup(index->sources, key)))
+		g_object_ref(source);
+	g_mutex_unlock(index->lock);
+
+	return source;
+}
+
+void evo2_source_index_free(OSyncEvoSourceIndex *index)
+{
+	g_signal_handler_disconnect(index->list, index->changed_id);
+	g_hash_table_destroy(index->sources);
+	g_mutex_free(index->lock);
+	g_object_unref(index->list);
+	g_free(index);
+}
+
+/* Opened EBook and ECal handles are cached in the environment and handed
+ * out again by discover and by every connect of a long-running plugin
+ * process, so opening a (possibly remote) source is paid only once. The
+ * key carries the thread-default main context, since EDS delivers the
+ * signals of a handle to the context it was created in; with
+ * ParallelSinks each worker therefore keeps its own handles, and discover
+ * runs on the workers so that it opens them there. Handles are
+ * dropped when their backend dies or they are no longer opened. */
+typedef struct OSyncEvoHandle {
+	GObject *object;
+	gulong died_id;
+	osync_bool dead;
+} OSyncEvoHandle;
+
+static void evo2_handle_free(gpointer data)
+{
+	OSyncEvoHandle *handle = (OSyncEvoHandle *)data;
+
+	g_signal_handler_disconnect(handle->object, handle->died_id);
+	g_object_unref(handle->object);
+	g_free(handle);
+}
+
+static void evo2_handle_backend_died(GObject *object, gpointer userdata)
+{
+	OSyncEvoHandle *handle = (OSyncEvoHandle *)userdata;
+
+	osync_trace(TRACE_INTERNAL, "Backend of cached handle %p died", object);
+	handle->dead = TRUE;
+}
+
+static osync_bool evo2_handle_is_healthy(OSyncEvoHandle *handle)
+{
+	if (handle->dead)
+		return FALSE;
+	if (E_IS_BOOK(handle->object))
+		return e_book_is_opened(E_BOOK(handle->object));
+	if (E_IS_CAL(handle->object))
+		return e_cal_get_load_state(E_CAL(handle->object)) == E_CAL_LOAD_LOADED;
+	return FALSE;
+}
+
+char *evo2_handle_key(const char *kind, const char *path)
+{
+	return g_strdup_printf("%p:%s:%s", (void *)g_main_context_get_thread_default(), kind, path);
+}
+
+GObject *evo2_handle_lookup(OSyncEvoEnv *env, const char *key)
+{
+	OSyncEvoHandle *handle = NULL;
+	GObject *object = NULL;
+
+	g_mutex_lock(env->handle_lock);
+	handle = g_hash_table_lookup(env->handles, key);
+	if (handle && evo2_handle_is_healthy(handle)) {
+		object = g_object_ref(handle->object);
+	} else if (handle) {
+		osync_trace(TRACE_INTERNAL, "Dropping stale handle for %s", key);
+		g_hash_table_remove(env->handles, key);
+	}
+	g_mutex_unlock(env->handle_lock);
+
+	osync_trace(TRACE_INTERNAL, "Handle cache %s for %s", object ? "hit" : "miss", key);
+	return object;
+}
+
+void evo2_handle_store(OSyncEvoEnv *env, const char *key, GObject *object)
+{
+	OSyncEvoHandle *handle = g_new0(OSyncEvoHandle, 1);
+
+	handle->object = g_object_ref(object);
+	handle->died_id = g_signal_connect(object, "backend_died", G_CALLBACK(evo2_handle_backend_died), handle);
+
+	g_mutex_lock(env->handle_lock);
+	g_hash_table_replace(env->handles, g_strdup(key), handle);
+	g_mutex_unlock(env->handle_lock);
+}
+
+void evo2_handle_invalidate(OSyncEvoEnv *env, const char *key)
+{
+	g_mutex_lock(env->handle_lock);
+	g_hash_table_remove(env->handles, key);
+	g_mutex_unlock(env->handle_lock);
+}
+
+/* Reads an unsigned integer from the plugin's advanced options, falling
+ * back to default_value if the option is missing or not a number. */
+unsigned int evo2_config_get_uint(OSyncPluginInfo *info, const char *name, unsigned int default_value)
+{
+	OSyncPluginConfig *config = osync_plugin_info_get_config(info);
+	OSyncPluginAdvancedOption *option = NULL;
+	const char *value = NULL;
+	char *end = NULL;
+	unsigned long result;
+
+	if (!config)
+		return default_value;
+
+	option = osync_plugin_config_get_advancedoption_value_by_name(config, name);
+	if (!option || !(value = osync_plugin_advancedoption_get_value(option)))
+		return default_value;
+
+	result = strtoul(value, &end, 10);
+	if (end == value) {
+		osync_trace(TRACE_INTERNAL, "Ignoring invalid value \"%s\" for option %s", value, name);
+		return default_value;
+	}
+
+	osync_trace(TRACE_INTERNAL, "Option %s set to %lu", name, result);
+	return (unsigned int) result;
+}
+
+/* Reads a string from the plugin's advanced options, falling back to
+ * default_value if the option is missing. */
+const char *evo2_config_get_string(OSyncPluginInfo *info, const char *name, const char *default_value)
+{
+	OSyncPluginConfig *config = osync_plugin_info_get_config(info);
+	OSyncPluginAdvancedOption *option = NULL;
+	const char *value = NULL;
+
+	if (!config)
+		return default_value;
+
+	option = osync_plugin_config_get_advancedoption_value_by_name(config, name);
+	if (!option || !(value = osync_plugin_advancedoption_get_value(option)))
+		return default_value;
+
+	osync_trace(TRACE_INTERNAL, "Option %s set to %s", name, value);
+	return value;
+}
+
+/* The sink state DBs and hashtables of all sinks are sqlite databases in
+ * the member's directory. With ParallelSinks the workers of several sinks
+ * would query them at the same time, and OpenSync neither locks them nor
+ * retries a busy database, so the sinks go through these wrappers, which
+ * serialize every access. Context reports need no lock: OpenSync hands
+ * them to its IPC queue, which may be fed from any thread. */
+G_LOCK_DEFINE_STATIC(osync_db);
+
+char *evo2_state_get(OSyncSinkStateDB *state_db, const char *key, OSyncError **error)
+{
+	char *value;
+
+	G_LOCK(osync_db);
+	value = osync_sink_state_get(state_db, key, error);
+	G_UNLOCK(osync_db);
+	return value;
+}
+
+osync_bool evo2_state_set(OSyncSinkStateDB *state_db, const char *key, const char *value, OSyncError **error)
+{
+	osync_bool stored;
+
+	G_LOCK(osync_db);
+	stored = osync_sink_state_set(state_db, key, value, error);
+	G_UNLOCK(osync_db);
+	return stored;
+}
+
+OSyncChangeType evo2_hashtable_get_changetype(OSyncHashTable *table, OSyncChange *change)
+{
+	OSyncChangeType type;
+
+	G_LOCK(osync_db);
+	type = osync_hashtable_get_changetype(table, change);
+	G_UNLOCK(osync_db);
+	return type;
+}
+
+void evo2_hashtable_update_change(OSyncHashTable *table, OSyncChange *change)
+{
+	G_LOCK(osync_db);
+	osync_hashtable_update_change(table, change);
+	G_UNLOCK(osync_db);
+}
+
+osync_bool evo2_hashtable_slowsync(OSyncHashTable *table, OSyncError **error)
+{
+	osync_bool success;
+
+	G_LOCK(osync_db);
+	success = osync_hashtable_slowsync(table, error);
+	G_UNLOCK(osync_db);
+	return success;
+}
+
+OSyncList *evo2_hashtable_get_deleted(OSyncHashTable *table)
+{
+	OSyncList *deleted;
+
+	G_LOCK(osync_db);
+	deleted = osync_hashtable_get_deleted(table);
+	G_UNLOCK(osync_db);
+	return deleted;
+}
+
+/* Like osync_sink_state_equal(), but a key that was never stored equals
+ * an empty value, so a newly stored anchor does not force a slow sync */
+osync_bool evo2_state_equal(OSyncSinkStateDB *state_db, const char *key, const char *value, osync_bool *match, OSyncError **error)
+{
+	char *stored = evo2_state_get(state_db, key, error);
+
+	if (!stored && osync_error_is_set(error))
+		return FALSE;
+
+	*match = !strcmp(stored ? stored : "", value ? value : "");
+	if (stored)
+		osync_free(stored);
+	return TRUE;
+}
+
+/* Creates the metrics of a sink and registers them with the environment,
+ * so they end up in the document written at finalize. */
+OSyncEvoMetrics *evo2_sink_metrics_new(OSyncEvoEnv *env, const char *name, void *userdata, OSyncError **error)
+{
+	OSyncEvoMetrics *metrics = evo2_metrics_new(name, userdata, error);
+	if (!metrics)
+		return NULL;
+
+	metrics->registry = &env->metrics;
+	metrics->path = env->metrics_path;
+	env->metrics = g_list_append(env->metrics, metrics);
+	return metrics;
+}
+
+/* UID presence index: the UIDs a backend holds, so that a commit can
+ * pick add or modify on the first attempt. The strings live in one
+ * GStringChunk, the hash table only points into it. */
+struct OSyncEvoUidIndex {
+	GHashTable *uids;
+	GStringChunk *chunk;
+};
+
+OSyncEvoUidIndex *evo2_uid_index_new(void)
+{
+	OSyncEvoUidIndex *index = g_new0(OSyncEvoUidIndex, 1);
+	index->uids = g_hash_table_new(g_str_hash, g_str_equal);
+	index->chunk = g_string_chunk_new(4096);
+	return index;
+}
+
+void evo2_uid_index_insert(OSyncEvoUidIndex *index, const char *uid)
+{
+	char *key = NULL;
+
+	if (!index || !uid)
+		return;
+	key = g_string_chunk_insert_const(index->chunk, uid);
+	g_hash_table_insert(index->uids, key, key);
+}
+
+void evo2_uid_index_remove(OSyncEvoUidIndex *index, const char *uid)
+{
+	if (index && uid)
+		g_hash_table_remove(index->uids, uid);
+}
+
+osync_bool evo2_uid_index_contains(OSyncEvoUidIndex *index, const char *uid)
+{
+	return uid && g_hash_table_lookup(index->uids, uid) != NULL;
+}
+
+void evo2_uid_index_free(OSyncEvoUidIndex *index)
+{
+	if (!index)
+		return;
+	g_hash_table_destroy(index->uids);
+	g_string_chunk_free(index->chunk);
+	g_free(index);
+}
+
+/* Reports change, which already carries uid, hash and change type, with
+ * the given data and records it in the sink's hashtable. Takes ownership
+ * of data. */
+void evo2_report_hashed_change(OSyncContext *ctx, OSyncHashTable *table, OSyncChange *change, OSyncObjFormat *format, char *data, unsigned int size)
+{
+	OSyncError *error = NULL;
+
+	OSyncData *odata = osync_data_new(data, size, format, &error);
+	if (!odata) {
+		osync_context_report_osyncwarning(ctx, error);
+		osync_error_unref(&error);
+		return;
+	}
+
+	osync_change_set_data(change, odata);
+	osync_data_unref(odata);
+
+	osync_context_report_change(ctx, change);
+	evo2_hashtable_update_change(table, change);
+	evo2_metrics_reported(size);
 }
 
 /* In initialize, we get the config for the plugin. Here we also must register
@@ -126,6 +535,17 @@ static void *evo2_initialize(OSyncPlugin *plugin, OSyncPluginInfo *info, OSyncEr
 
 
 	g_type_init();
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	env->handles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, evo2_handle_free);
+	env->handle_lock = g_mutex_new();
+
+	env->parallel = evo2_config_get_uint(info, "ParallelSinks", 0) ? TRUE : FALSE;
+	osync_trace(TRACE_INTERNAL, "Sinks run %s", env->parallel ? "in parallel worker threads" : "on the plugin thread");
+
+	env->metrics_path = evo2_config_get_string(info, "MetricsPath", NULL);
+	env->memory_budget = (gsize) evo2_config_get_uint(info, "MemoryBudget", 0) * 1024;
 
 	if (!evo2_ebook_initialize(env, info, error))
 		goto error_free_env;
@@ -153,6 +573,16 @@ static void evo2_finalize(void *data)
 {
 	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, data);
 	OSyncEvoEnv *env = (OSyncEvoEnv *)data;
+	OSyncError *error = NULL;
+
+	if (env->metrics && env->pluginInfo) {
+		char *path = g_build_filename(osync_plugin_info_get_configdir(env->pluginInfo), "evo2-metrics.json", NULL);
+		if (!evo2_metrics_write(env->metrics, path, &error)) {
+			osync_trace(TRACE_INTERNAL, "%s", osync_error_print(&error));
+			osync_error_unref(&error);
+		}
+		g_free(path);
+	}
 
 	/* cleanup OpenSync stuff */
 	if (env->pluginInfo) {
@@ -178,6 +608,31 @@ return version;
 }
 
 
+/* Discover of a single sink, run on the sink's worker if it has one */
+typedef struct OSyncEvoDiscover {
+	OSyncEvoEnv *env;
+	OSyncEvoCalendar *cal;
+	OSyncCapabilities *caps;
+} OSyncEvoDiscover;
+
+static osync_bool evo2_discover_sink(void *data, OSyncError **error)
+{
+	OSyncEvoDiscover *discover = (OSyncEvoDiscover *)data;
+
+	if (discover->cal)
+		return evo2_ecal_discover(discover->cal, discover->caps, error);
+	return evo2_ebook_discover(discover->env, discover->caps, error);
+}
+
+static osync_bool evo2_discover_on(OSyncEvoWorker *worker, OSyncEvoEnv *env, OSyncEvoCalendar *cal, OSyncCapabilities *caps, OSyncError **error)
+{
+	OSyncEvoDiscover discover = { env, cal, caps };
+
+	if (worker)
+		return evo2_worker_call(worker, evo2_discover_sink, &discover, error);
+	return evo2_discover_sink(&discover, error);
+}
+
 /* Here we actually tell opensync which sinks are available and their capabilities */
 
 static osync_bool evo2_discover(OSyncPluginInfo *info, void *data, OSyncError **error)
@@ -212,13 +667,15 @@ static osync_bool evo2_discover(OSyncPluginInfo *info, void *data, OSyncError **
 
 	OSyncCapabilities *capabilities;
 	capabilities = osync_capabilities_new("evo2-caps", error);
-	if (!evo2_ebook_discover(env, capabilities, error)) {
+	/* with ParallelSinks the handles are opened on the workers, where
+	 * connect looks for them */
+	if (!evo2_discover_on(env->contact_worker, env, NULL, capabilities, error)) {
 		goto error_free_capabilties;
 	}
 	int i, numcalendars = g_list_length(env->calendars);
 	for (i = 0; i < numcalendars; i++) {
 		OSyncEvoCalendar *cal = (OSyncEvoCalendar *)g_list_nth_data(env->calendars, i);
-		if (!cal || !evo2_ecal_discover(cal, capabilities, error)) {
+		if (!cal || !evo2_discover_on(cal->worker, env, cal, capabilities, error)) {
 			goto error_free_capabilties;
 		}
 	}
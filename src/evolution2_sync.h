@@ -28,6 +28,9 @@
 #include <libebook/e-book.h>
 #include <libedataserver/e-data-server-util.h>
 
+#include "evolution2_worker.h"
+#include "evolution2_metrics.h"
+
 #define icalreqstattype_as_string() See_evolution2_sync_h_for_note
 #define icalproperty_as_ical_string() See_evolution2_sync_h_for_note
 #define icalproperty_get_parameter_as_string() See_evolution2_sync_h_for_note
@@ -40,10 +43,25 @@
 #define e_cal_component_get_recurid_as_string() See_evolution2_sync_h_for_note
 
 
+typedef struct OSyncEvoSourceIndex OSyncEvoSourceIndex;
+typedef struct OSyncEvoUidIndex OSyncEvoUidIndex;
+
 #define STR_URI_KEY		"uri_"
+/* separates the sources of a resource Url syncing several calendars */
+#define EVO2_SOURCE_SEPARATOR	"|"
+/* separates series UID and RECURRENCE-ID of a detached instance */
+#define EVO2_INSTANCE_SEPARATOR	"#"
+
+#define EVO2_DEFAULT_BATCH_SIZE	100
+/* commit batching is opt-in, 1 commits every change on its own */
+#define EVO2_DEFAULT_COMMIT_BATCH_SIZE	1
+#define EVO2_DEFAULT_MAX_INFLIGHT	16
+
 
+typedef struct OSyncEvoParseCtx OSyncEvoParseCtx;
 
 typedef struct OSyncEvoCalendar {
+	struct OSyncEvoEnv *env;
 	char *uri_key;
 	const char *uri;
 	const char *objtype;
@@ -51,8 +69,31 @@ typedef struct OSyncEvoCalendar {
 	ECalSourceType source_type;
 	icalcomponent_kind ical_component;
 	ECal *calendar;
+	osync_bool hashed;
+	GHashTable *committed;
+	osync_bool checkpoint;
+	osync_bool probe_caps;
+	unsigned int batch_size;
+	unsigned int commit_batch_size;
+	GQueue *queue;
+	OSyncEvoParseCtx *parse_ctx;
+	/* added instances waiting for their series */
+	GList *orphans;
+	OSyncEvoUidIndex *uids;
+	OSyncEvoWorker *worker;
 	OSyncObjTypeSink *sink;
 	OSyncObjFormat *format;
+	osync_bool native;
+	/* the sources of the sink, just the sink itself for a single Url */
+	GList *members;
+	gchar **uris;
+	/* set on each member of a multi-source sink */
+	char *uid_prefix;
+	/* sync window in days around now, 0 leaves that side open */
+	unsigned int window_past;
+	unsigned int window_future;
+	time_t window_start;
+	time_t window_end;
 } OSyncEvoCalendar;
 
 typedef struct OSyncEvoEnv {
@@ -60,14 +101,73 @@ typedef struct OSyncEvoEnv {
 	
 	const char *addressbook_path;
 	EBook *addressbook;
+	unsigned int contact_batch_size;
+	GQueue *contact_queue;
+	unsigned int contact_inflight;
+	/* 0 for no limit */
+	unsigned int contact_max_inflight;
+	GHashTable *contact_inflight_uids;
+	osync_bool contact_hashed;
+	GHashTable *contact_committed;
+	osync_bool contact_checkpoint;
+	OSyncEvoUidIndex *contact_uids;
+	/* ContactFilter, compiled at connect */
+	const char *contact_filter_expr;
+	EBookQuery *contact_filter;
+	/* the hashtable holds the UIDs the peer has, see evo2_ebook_peer_has() */
+	osync_bool contact_tracked;
+	/* ContactFields, and what connect made of it */
+	const char *contact_fields;
+	gchar **contact_field_names;
+	GHashTable *contact_projection;
+	GList *contact_view_fields;
+	/* ContactBlobDedup */
+	osync_bool contact_blob_dedup;
+	OSyncEvoWorker *contact_worker;
 	OSyncObjTypeSink *contact_sink;
 	OSyncObjFormat *contact_format;
+	osync_bool contact_native;
 	
 	GList *calendars;
 
+	/* bytes a calendar slow sync may hold, 0 for no limit; the contact
+	 * view is not chunked */
+	gsize memory_budget;
+
+	GList *metrics;
+	const char *metrics_path;
+
+	GHashTable *handles;
+	GMutex *handle_lock;
+
+	OSyncEvoSourceIndex *book_sources;
+	OSyncEvoSourceIndex *cal_sources[E_CAL_SOURCE_TYPE_LAST];
+
 	OSyncPluginInfo *pluginInfo;	
 } OSyncEvoEnv;
 
-ESource *evo2_find_source(ESourceList *list, const char *uri);
+OSyncEvoSourceIndex *evo2_source_index_new(ESourceList *list);
+ESource *evo2_source_index_lookup(OSyncEvoSourceIndex *index, const char *key);
+void evo2_source_index_free(OSyncEvoSourceIndex *index);
+char *evo2_handle_key(const char *kind, const char *path);
+GObject *evo2_handle_lookup(OSyncEvoEnv *env, const char *key);
+void evo2_handle_store(OSyncEvoEnv *env, const char *key, GObject *object);
+void evo2_handle_invalidate(OSyncEvoEnv *env, const char *key);
+unsigned int evo2_config_get_uint(OSyncPluginInfo *info, const char *name, unsigned int default_value);
+const char *evo2_config_get_string(OSyncPluginInfo *info, const char *name, const char *default_value);
+char *evo2_state_get(OSyncSinkStateDB *state_db, const char *key, OSyncError **error);
+osync_bool evo2_state_set(OSyncSinkStateDB *state_db, const char *key, const char *value, OSyncError **error);
+OSyncChangeType evo2_hashtable_get_changetype(OSyncHashTable *table, OSyncChange *change);
+void evo2_hashtable_update_change(OSyncHashTable *table, OSyncChange *change);
+osync_bool evo2_hashtable_slowsync(OSyncHashTable *table, OSyncError **error);
+OSyncList *evo2_hashtable_get_deleted(OSyncHashTable *table);
+osync_bool evo2_state_equal(OSyncSinkStateDB *state_db, const char *key, const char *value, osync_bool *match, OSyncError **error);
+OSyncEvoMetrics *evo2_sink_metrics_new(OSyncEvoEnv *env, const char *name, void *userdata, OSyncError **error);
+OSyncEvoUidIndex *evo2_uid_index_new(void);
+void evo2_uid_index_insert(OSyncEvoUidIndex *index, const char *uid);
+void evo2_uid_index_remove(OSyncEvoUidIndex *index, const char *uid);
+osync_bool evo2_uid_index_contains(OSyncEvoUidIndex *index, const char *uid);
+void evo2_uid_index_free(OSyncEvoUidIndex *index);
+void evo2_report_hashed_change(OSyncContext *ctx, OSyncHashTable *table, OSyncChange *change, OSyncObjFormat *format, char *data, unsigned int size);
 
 #endif
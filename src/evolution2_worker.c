@@ -0,0 +1,238 @@
+/*
+ * evolution2_sync - A plugin for the opensync framework
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ * 
+ */
+
+#include <glib.h>
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-data.h>
+#include <opensync/opensync-plugin.h>
+
+#include "evolution2_worker.h"
+
+typedef enum {
+	EVO2_JOB_CONNECT,
+	EVO2_JOB_DISCONNECT,
+	EVO2_JOB_GET_CHANGES,
+	EVO2_JOB_COMMIT,
+	EVO2_JOB_COMMITTED_ALL,
+	EVO2_JOB_SYNC_DONE,
+	EVO2_JOB_CALL
+} OSyncEvoJobType;
+
+typedef struct OSyncEvoJob {
+	OSyncEvoJobType type;
+	OSyncObjTypeSink *sink;
+	OSyncPluginInfo *info;
+	OSyncContext *ctx;
+	OSyncChange *change;
+	osync_bool slow_sync;
+
+	/* EVO2_JOB_CALL, handed back through reply once it ran */
+	OSyncEvoCallFn func;
+	void *data;
+	OSyncError **error;
+	osync_bool result;
+	GAsyncQueue *reply;
+} OSyncEvoJob;
+
+static void evo2_worker_run_job(OSyncEvoWorker *worker, OSyncEvoJob *job)
+{
+	osync_trace(TRACE_INTERNAL, "%s worker running job %i", worker->name, job->type);
+
+	switch (job->type) {
+		case EVO2_JOB_CONNECT:
+			worker->connect(job->sink, job->info, job->ctx, worker->userdata);
+			break;
+		case EVO2_JOB_DISCONNECT:
+			worker->disconnect(job->sink, job->info, job->ctx, worker->userdata);
+			break;
+		case EVO2_JOB_GET_CHANGES:
+			worker->get_changes(job->sink, job->info, job->ctx, job->slow_sync, worker->userdata);
+			break;
+		case EVO2_JOB_COMMIT:
+			worker->commit(job->sink, job->info, job->ctx, job->change, worker->userdata);
+			break;
+		case EVO2_JOB_COMMITTED_ALL:
+			worker->committed_all(job->sink, job->info, job->ctx, worker->userdata);
+			break;
+		case EVO2_JOB_SYNC_DONE:
+			worker->sync_done(job->sink, job->info, job->ctx, worker->userdata);
+			break;
+		case EVO2_JOB_CALL:
+			job->result = job->func(job->data, job->error);
+			g_async_queue_push(job->reply, job);
+			return;
+	}
+
+	osync_context_unref(job->ctx);
+	if (job->change)
+		osync_change_unref(job->change);
+	g_free(job);
+}
+
+static gpointer evo2_worker_thread(gpointer data)
+{
+	OSyncEvoWorker *worker = (OSyncEvoWorker *)data;
+	gpointer job = NULL;
+
+	osync_trace(TRACE_INTERNAL, "%s worker started", worker->name);
+	g_main_context_push_thread_default(worker->context);
+
+	/* the worker itself is queued as the stop marker */
+	while ((job = g_async_queue_pop(worker->jobs)) != worker)
+		evo2_worker_run_job(worker, (OSyncEvoJob *)job);
+
+	g_main_context_pop_thread_default(worker->context);
+	osync_trace(TRACE_INTERNAL, "%s worker stopped", worker->name);
+	return NULL;
+}
+
+static void evo2_worker_push(OSyncEvoWorker *worker, OSyncEvoJobType type, OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change, osync_bool slow_sync)
+{
+	OSyncEvoJob *job = g_new0(OSyncEvoJob, 1);
+
+	job->type = type;
+	job->sink = sink;
+	job->info = info;
+	job->ctx = osync_context_ref(ctx);
+	job->change = change ? osync_change_ref(change) : NULL;
+	job->slow_sync = slow_sync;
+
+	g_async_queue_push(worker->jobs, job);
+}
+
+static void evo2_worker_connect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	evo2_worker_push((OSyncEvoWorker *)userdata, EVO2_JOB_CONNECT, sink, info, ctx, NULL, FALSE);
+}
+
+static void evo2_worker_disconnect(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	evo2_worker_push((OSyncEvoWorker *)userdata, EVO2_JOB_DISCONNECT, sink, info, ctx, NULL, FALSE);
+}
+
+static void evo2_worker_get_changes(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *userdata)
+{
+	evo2_worker_push((OSyncEvoWorker *)userdata, EVO2_JOB_GET_CHANGES, sink, info, ctx, NULL, slow_sync);
+}
+
+static void evo2_worker_commit(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change, void *userdata)
+{
+	evo2_worker_push((OSyncEvoWorker *)userdata, EVO2_JOB_COMMIT, sink, info, ctx, change, FALSE);
+}
+
+static void evo2_worker_committed_all(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	evo2_worker_push((OSyncEvoWorker *)userdata, EVO2_JOB_COMMITTED_ALL, sink, info, ctx, NULL, FALSE);
+}
+
+static void evo2_worker_sync_done(OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata)
+{
+	evo2_worker_push((OSyncEvoWorker *)userdata, EVO2_JOB_SYNC_DONE, sink, info, ctx, NULL, FALSE);
+}
+
+OSyncEvoWorker *evo2_worker_new(const char *name, void *userdata, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%s, %p, %p)", __func__, name, userdata, error);
+	GError *gerror = NULL;
+
+	OSyncEvoWorker *worker = osync_try_malloc0(sizeof(OSyncEvoWorker), error);
+	if (!worker)
+		goto error;
+
+	worker->name = g_strdup(name);
+	worker->userdata = userdata;
+	worker->context = g_main_context_new();
+	worker->jobs = g_async_queue_new();
+
+	worker->thread = g_thread_create(evo2_worker_thread, worker, TRUE, &gerror);
+	if (!worker->thread) {
+		osync_error_set(error, OSYNC_ERROR_GENERIC, "Unable to start %s worker: %s", name, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		goto error_free_worker;
+	}
+
+	osync_trace(TRACE_EXIT, "%s: %p", __func__, worker);
+	return worker;
+
+ error_free_worker:
+	g_async_queue_unref(worker->jobs);
+	g_main_context_unref(worker->context);
+	g_free(worker->name);
+	osync_free(worker);
+ error:
+	osync_trace(TRACE_EXIT_ERROR, "%s: %s", __func__, osync_error_print(error));
+	return NULL;
+}
+
+osync_bool evo2_worker_call(OSyncEvoWorker *worker, OSyncEvoCallFn func, void *data, OSyncError **error)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p, %p, %p, %p)", __func__, worker, func, data, error);
+	OSyncEvoJob *job = g_new0(OSyncEvoJob, 1);
+	osync_bool result;
+
+	job->type = EVO2_JOB_CALL;
+	job->func = func;
+	job->data = data;
+	job->error = error;
+	job->reply = g_async_queue_new();
+
+	g_async_queue_push(worker->jobs, job);
+	g_async_queue_pop(job->reply);
+
+	result = job->result;
+	g_async_queue_unref(job->reply);
+	g_free(job);
+
+	osync_trace(result ? TRACE_EXIT : TRACE_EXIT_ERROR, "%s: %i", __func__, result);
+	return result;
+}
+
+void evo2_worker_attach(OSyncEvoWorker *worker, OSyncObjTypeSink *sink)
+{
+	if (worker->connect)
+		osync_objtype_sink_set_connect_func(sink, evo2_worker_connect);
+	if (worker->disconnect)
+		osync_objtype_sink_set_disconnect_func(sink, evo2_worker_disconnect);
+	if (worker->get_changes)
+		osync_objtype_sink_set_get_changes_func(sink, evo2_worker_get_changes);
+	if (worker->commit)
+		osync_objtype_sink_set_commit_func(sink, evo2_worker_commit);
+	if (worker->committed_all)
+		osync_objtype_sink_set_committed_all_func(sink, evo2_worker_committed_all);
+	if (worker->sync_done)
+		osync_objtype_sink_set_sync_done_func(sink, evo2_worker_sync_done);
+
+	osync_objtype_sink_set_userdata(sink, worker);
+}
+
+void evo2_worker_free(OSyncEvoWorker *worker)
+{
+	osync_trace(TRACE_ENTRY, "%s(%p)", __func__, worker);
+
+	g_async_queue_push(worker->jobs, worker);
+	g_thread_join(worker->thread);
+
+	g_async_queue_unref(worker->jobs);
+	g_main_context_unref(worker->context);
+	g_free(worker->name);
+	osync_free(worker);
+
+	osync_trace(TRACE_EXIT, "%s", __func__);
+}
@@ -0,0 +1,90 @@
+/*
+ * evolution2_sync - A plugin for the opensync framework
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307  USA
+ * 
+ */
+
+#ifndef EVO2_WORKER_H
+#define EVO2_WORKER_H
+
+#include <glib.h>
+
+#include <opensync/opensync.h>
+#include <opensync/opensync-plugin.h>
+
+typedef void (* OSyncEvoSinkFn) (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, void *userdata);
+typedef void (* OSyncEvoGetChangesFn) (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, osync_bool slow_sync, void *userdata);
+typedef void (* OSyncEvoCommitFn) (OSyncObjTypeSink *sink, OSyncPluginInfo *info, OSyncContext *ctx, OSyncChange *change, void *userdata);
+typedef osync_bool (* OSyncEvoCallFn) (void *data, OSyncError **error);
+
+/*! @brief A thread that runs all sink functions of one objtype
+ *
+ * The thread owns a GMainContext that is pushed as its thread default, so
+ * EDS handles opened by the sink functions deliver their signals and
+ * async replies there. Sink calls are queued and run one after the other;
+ * the real sink function reports its context from the worker thread.
+ * Sink state DBs and hashtables are shared with the other workers and
+ * must only be used through the evo2_state_* and evo2_hashtable_*
+ * wrappers, which serialize them.
+ */
+typedef struct OSyncEvoWorker {
+	char *name;
+	GThread *thread;
+	GMainContext *context;
+	GAsyncQueue *jobs;
+	void *userdata;
+
+	OSyncEvoSinkFn connect;
+	OSyncEvoSinkFn disconnect;
+	OSyncEvoGetChangesFn get_changes;
+	OSyncEvoCommitFn commit;
+	OSyncEvoSinkFn committed_all;
+	OSyncEvoSinkFn sync_done;
+} OSyncEvoWorker;
+
+/*! @brief Starts a worker thread
+ *
+ * @param name Name used in traces, usually the objtype
+ * @param userdata The userdata the sink functions expect
+ * @param error Error information if NULL is returned
+ */
+OSyncEvoWorker *evo2_worker_new(const char *name, void *userdata, OSyncError **error);
+
+/*! @brief Runs func on the worker thread and waits for it
+ *
+ * Used for work outside the sink functions, such as discover, that should
+ * open its EDS handles in the worker's main context so that the sink
+ * functions find them in the handle cache later.
+ *
+ * @param worker The worker to run func on
+ * @param func The function to run
+ * @param data Passed to func
+ * @param error Passed to func
+ * @returns What func returned
+ */
+osync_bool evo2_worker_call(OSyncEvoWorker *worker, OSyncEvoCallFn func, void *data, OSyncError **error);
+
+/*! @brief Routes all sink functions set on the worker through its thread
+ *
+ * Replaces the sink's functions and userdata. Set the worker's function
+ * pointers before calling this.
+ */
+void evo2_worker_attach(OSyncEvoWorker *worker, OSyncObjTypeSink *sink);
+
+/*! @brief Stops the thread after all queued calls ran and frees the worker */
+void evo2_worker_free(OSyncEvoWorker *worker);
+
+#endif /* EVO2_WORKER_H */
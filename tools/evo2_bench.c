@@ -0,0 +1,609 @@
+/*
+ * evo2-bench - synthetic sync throughput benchmark for evo2-sync
+ *
+ * Creates file:// backed address book and calendars below a work directory,
+ * fills them with synthetic contacts and events, and drives osyncplugin
+ * through a slow sync, a fast sync after changing part of the data and a
+ * bulk commit (emptying all sources). Wall time, throughput, peak RSS and
+ * EDS round trips (from the plugin's metrics) of every phase are printed
+ * as JSON.
+ *
+ * If osynctool is installed, a bulk add phase in between slow syncs the
+ * sources with a second, empty set of sources, so every item is committed
+ * as an addition. osynctool has no plugin path, so this phase runs the
+ * evo2-sync OpenSync has installed, whatever --pluginpath says.
+ */
+// see note in ../src/evolution2_sync.h
+#define HANDLE_LIBICAL_MEMORY 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <libecal/e-cal.h>
+#include <libebook/e-book.h>
+
+#define BENCH_CAL_CHUNK 500
+
+static int n_contacts = 1000;
+static int n_events = 1000;
+static int photo_size = 0;
+static int attach_size = 0;
+static int recurring = 20;
+static double change_ratio = 0.01;
+static char *workdir = NULL;
+static char *pluginpath = NULL;
+static char *output = NULL;
+static char **options = NULL;
+static gboolean keep = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "contacts", 'c', 0, G_OPTION_ARG_INT, &n_contacts, "Number of contacts (default 1000)", "N" },
+	{ "events", 'e', 0, G_OPTION_ARG_INT, &n_events, "Number of events (default 1000)", "N" },
+	{ "photo-size", 0, 0, G_OPTION_ARG_INT, &photo_size, "Bytes of PHOTO data per contact (default 0)", "BYTES" },
+	{ "attach-size", 0, 0, G_OPTION_ARG_INT, &attach_size, "Bytes of inline ATTACH data per event (default 0)", "BYTES" },
+	{ "recurring", 'r', 0, G_OPTION_ARG_INT, &recurring, "Percentage of recurring events (default 20)", "PERCENT" },
+	{ "change-ratio", 0, 0, G_OPTION_ARG_DOUBLE, &change_ratio, "Fraction of items modified before the fast sync (default 0.01)", "RATIO" },
+	{ "workdir", 'w', 0, G_OPTION_ARG_FILENAME, &workdir, "Directory for sources and plugin state (default: temporary)", "DIR" },
+	{ "pluginpath", 'p', 0, G_OPTION_ARG_FILENAME, &pluginpath, "Directory containing the evo2-sync plugin", "DIR" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the JSON report to FILE instead of stdout", "FILE" },
+	{ "option", 0, 0, G_OPTION_ARG_STRING_ARRAY, &options, "Set plugin advanced option, e.g. ContactBatchSize=100", "NAME=VALUE" },
+	{ "keep", 'k', 0, G_OPTION_ARG_NONE, &keep, "Keep the work directory", NULL },
+	{ NULL }
+};
+
+typedef struct BenchPhase {
+	const char *name;
+	unsigned int items;
+	double seconds;
+	long peak_rss_kb;
+	long eds_calls;
+	int exit_status;
+} BenchPhase;
+
+static char *random_base64(int size)
+{
+	guchar *raw = g_malloc(size);
+	char *encoded = NULL;
+	int i;
+
+	for (i = 0; i < size; i++)
+		raw[i] = g_random_int_range(0, 256);
+	encoded = g_base64_encode(raw, size);
+	g_free(raw);
+	return encoded;
+}
+
+static EBook *open_book(const char *uri)
+{
+	GError *gerror = NULL;
+	EBook *book = e_book_new_from_uri(uri, &gerror);
+
+	if (!book || !e_book_open(book, FALSE, &gerror)) {
+		fprintf(stderr, "Unable to open %s: %s\n", uri, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		if (book)
+			g_object_unref(book);
+		return NULL;
+	}
+	return book;
+}
+
+static ECal *open_cal(const char *uri, ECalSourceType source_type)
+{
+	GError *gerror = NULL;
+	ECal *cal = e_cal_new_from_uri(uri, source_type);
+
+	if (!cal || !e_cal_open(cal, FALSE, &gerror)) {
+		fprintf(stderr, "Unable to open %s: %s\n", uri, gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+		if (cal)
+			g_object_unref(cal);
+		return NULL;
+	}
+	return cal;
+}
+
+static GPtrArray *populate_book(EBook *book)
+{
+	GPtrArray *uids = g_ptr_array_new();
+	GError *gerror = NULL;
+	int i;
+
+	for (i = 0; i < n_contacts; i++) {
+		GString *vcard = g_string_new("BEGIN:VCARD\r\nVERSION:3.0\r\n");
+		g_string_append_printf(vcard, "N:Contact%06d;Bench;;;\r\nFN:Bench Contact%06d\r\n", i, i);
+		g_string_append_printf(vcard, "EMAIL;TYPE=INTERNET:bench%06d@example.org\r\n", i);
+		g_string_append_printf(vcard, "TEL;TYPE=CELL:+4917%08d\r\nORG:Bench Org %d\r\n", i, i % 97);
+		g_string_append_printf(vcard, "ADR;TYPE=WORK:;;Street %d;City;;%05d;Country\r\n", i, i % 99999);
+		if (photo_size > 0) {
+			char *photo = random_base64(photo_size);
+			g_string_append_printf(vcard, "PHOTO;ENCODING=b;TYPE=JPEG:%s\r\n", photo);
+			g_free(photo);
+		}
+		g_string_append(vcard, "END:VCARD\r\n");
+
+		EContact *contact = e_contact_new_from_vcard(vcard->str);
+		g_string_free(vcard, TRUE);
+		if (!e_book_add_contact(book, contact, &gerror)) {
+			fprintf(stderr, "Unable to add contact %d: %s\n", i, gerror ? gerror->message : "None");
+			g_clear_error(&gerror);
+		} else {
+			g_ptr_array_add(uids, g_strdup(e_contact_get_const(contact, E_CONTACT_UID)));
+		}
+		g_object_unref(contact);
+	}
+	return uids;
+}
+
+static void append_event(GString *ical, int i)
+{
+	time_t start = time(NULL) - 180 * 86400 + (time_t) i * 3607 % (365 * 86400);
+	struct tm tm;
+	char dtstart[17], dtend[17];
+	time_t end = start + 3600;
+
+	strftime(dtstart, sizeof(dtstart), "%Y%m%dT%H%M%SZ", gmtime_r(&start, &tm));
+	strftime(dtend, sizeof(dtend), "%Y%m%dT%H%M%SZ", gmtime_r(&end, &tm));
+
+	g_string_append_printf(ical, "BEGIN:VEVENT\r\nUID:evo2-bench-event-%d\r\n", i);
+	g_string_append_printf(ical, "DTSTART:%s\r\nDTEND:%s\r\n", dtstart, dtend);
+	g_string_append_printf(ical, "SUMMARY:Bench event %d\r\nLOCATION:Room %d\r\n", i, i % 42);
+	if (i % 100 < recurring) {
+		/* mix of plain weekly series and series with exceptions */
+		g_string_append(ical, "RRULE:FREQ=WEEKLY;COUNT=52\r\n");
+		if (i % 2) {
+			time_t exdate = start + 7 * 86400;
+			strftime(dtstart, sizeof(dtstart), "%Y%m%dT%H%M%SZ", gmtime_r(&exdate, &tm));
+			g_string_append_printf(ical, "EXDATE:%s\r\n", dtstart);
+		}
+	}
+	if (attach_size > 0) {
+		char *attach = random_base64(attach_size);
+		g_string_append_printf(ical, "ATTACH;ENCODING=BASE64;VALUE=BINARY;FMTTYPE=application/octet-stream:%s\r\n", attach);
+		g_free(attach);
+	}
+	g_string_append(ical, "END:VEVENT\r\n");
+}
+
+static gboolean receive_events(ECal *cal, GString *ical)
+{
+	GError *gerror = NULL;
+	icalcomponent *icomp = NULL;
+	gboolean ret;
+
+	g_string_append(ical, "END:VCALENDAR\r\n");
+	if (!(icomp = icalcomponent_new_from_string(ical->str))) {
+		fprintf(stderr, "Unable to parse generated events\n");
+		return FALSE;
+	}
+	if (!(ret = e_cal_receive_objects(cal, icomp, &gerror))) {
+		fprintf(stderr, "Unable to store events: %s\n", gerror ? gerror->message : "None");
+		g_clear_error(&gerror);
+	}
+	icalcomponent_free(icomp);
+	return ret;
+}
+
+static gboolean populate_cal(ECal *cal)
+{
+	GString *ical = NULL;
+	int i;
+
+	for (i = 0; i < n_events; i++) {
+		if (!ical)
+			ical = g_string_new("BEGIN:VCALENDAR\r\nVERSION:2.0\r\nMETHOD:PUBLISH\r\nPRODID:-//OpenSync//evo2-bench//EN\r\n");
+		append_event(ical, i);
+		if ((i + 1) % BENCH_CAL_CHUNK == 0 || i + 1 == n_events) {
+			gboolean ret = receive_events(cal, ical);
+			g_string_free(ical, TRUE);
+			ical = NULL;
+			if (!ret)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Modifies every 1/change_ratio'th contact and event, returns the number
+ * of changed items. */
+static unsigned int mutate(EBook *book, GPtrArray *uids, ECal *cal)
+{
+	unsigned int changed = 0, i, stride;
+	GError *gerror = NULL;
+
+	if (change_ratio <= 0)
+		return 0;
+	stride = change_ratio >= 1 ? 1 : (unsigned int) (1 / change_ratio);
+
+	for (i = 0; i < uids->len; i += stride) {
+		EContact *contact = NULL;
+		if (!e_book_get_contact(book, g_ptr_array_index(uids, i), &contact, &gerror)) {
+			g_clear_error(&gerror);
+			continue;
+		}
+		e_contact_set(contact, E_CONTACT_NOTE, "changed by evo2-bench");
+		if (e_book_commit_contact(book, contact, &gerror))
+			changed++;
+		g_clear_error(&gerror);
+		g_object_unref(contact);
+	}
+
+	for (i = 0; i < (unsigned int) n_events; i += stride) {
+		icalcomponent *icomp = NULL;
+		char *uid = g_strdup_printf("evo2-bench-event-%d", i);
+		if (e_cal_get_object(cal, uid, NULL, &icomp, &gerror)) {
+			icalcomponent_set_summary(icomp, "Changed by evo2-bench");
+			if (e_cal_modify_object(cal, icomp, CALOBJ_MOD_ALL, &gerror))
+				changed++;
+			icalcomponent_free(icomp);
+		}
+		g_clear_error(&gerror);
+		g_free(uid);
+	}
+	return changed;
+}
+
+static gboolean write_config(const char *path, const char *dir)
+{
+	static const struct {
+		const char *objtype;
+		const char *format;
+		const char *source;
+	} resources[] = {
+		{ "contact", "vcard30", "book" },
+		{ "event", "vevent20", "events" },
+		{ "todo", "vtodo20", "tasks" },
+		{ "note", "vjournal", "memos" }
+	};
+	GString *config = g_string_new("<?xml version=\"1.0\"?>\n<config version=\"1.0\">\n");
+	GError *gerror = NULL;
+	gboolean ret;
+	unsigned int i;
+
+	if (options) {
+		g_string_append(config, "  <AdvancedOptions>\n");
+		for (i = 0; options[i]; i++) {
+			char **pair = g_strsplit(options[i], "=", 2);
+			if (pair[0] && pair[1])
+				g_string_append_printf(config, "    <AdvancedOption>\n      <MaxOccurs>1</MaxOccurs>\n      <Name>%s</Name>\n      <Type>string</Type>\n      <Value>%s</Value>\n    </AdvancedOption>\n", pair[0], pair[1]);
+			g_strfreev(pair);
+		}
+		g_string_append(config, "  </AdvancedOptions>\n");
+	}
+
+	g_string_append(config, "  <Resources>\n");
+	for (i = 0; i < G_N_ELEMENTS(resources); i++)
+		g_string_append_printf(config, "    <Resource>\n      <Enabled>1</Enabled>\n      <Formats>\n\t<Format>\n\t  <Name>%s</Name>\n\t</Format>\n      </Formats>\n      <ObjType>%s</ObjType>\n      <Url>file://%s/%s</Url>\n    </Resource>\n",
+				resources[i].format, resources[i].objtype, dir, resources[i].source);
+	g_string_append(config, "  </Resources>\n</config>\n");
+
+	if (!(ret = g_file_set_contents(path, config->str, -1, &gerror))) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, gerror->message);
+		g_clear_error(&gerror);
+	}
+	g_string_free(config, TRUE);
+	return ret;
+}
+
+/* Sums the per-sink EDS call counters of the metrics document the plugin
+ * writes at finalize, -1 if there is none. */
+static long read_eds_calls(const char *configdir)
+{
+	char *path = g_build_filename(configdir, "evo2-metrics.json", NULL);
+	char *json = NULL, *pos = NULL;
+	long calls = -1;
+
+	if (g_file_get_contents(path, &json, NULL, NULL)) {
+		calls = 0;
+		for (pos = json; (pos = strstr(pos, "\"eds_calls\":")); pos++)
+			calls += strtol(pos + strlen("\"eds_calls\":"), NULL, 10);
+		g_free(json);
+	}
+	g_remove(path);
+	g_free(path);
+	return calls;
+}
+
+/* Runs argv and records wall time and the peak resident set size of the
+ * child */
+static void run_child(BenchPhase *phase, char **argv)
+{
+	struct rusage usage;
+	GTimer *timer = NULL;
+	int status = 0;
+	pid_t pid;
+
+	timer = g_timer_new();
+	if ((pid = fork()) == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	memset(&usage, 0, sizeof(usage));
+	if (pid < 0 || wait4(pid, &status, 0, &usage) < 0)
+		status = -1;
+	phase->seconds = g_timer_elapsed(timer, NULL);
+	phase->peak_rss_kb = usage.ru_maxrss;
+	phase->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+	g_timer_destroy(timer);
+}
+
+/* Runs osyncplugin with the given actions and records wall time, the
+ * peak resident set size of the child and the EDS calls it made. */
+static void run_phase(BenchPhase *phase, const char *config, const char *configdir, const char **actions)
+{
+	GPtrArray *argv = g_ptr_array_new();
+
+	g_ptr_array_add(argv, "osyncplugin");
+	g_ptr_array_add(argv, "--plugin");
+	g_ptr_array_add(argv, "evo2-sync");
+	if (pluginpath) {
+		g_ptr_array_add(argv, "--pluginpath");
+		g_ptr_array_add(argv, pluginpath);
+	}
+	g_ptr_array_add(argv, "--config");
+	g_ptr_array_add(argv, (gpointer) config);
+	g_ptr_array_add(argv, "--configdir");
+	g_ptr_array_add(argv, (gpointer) configdir);
+	for (; *actions; actions++)
+		g_ptr_array_add(argv, (gpointer) *actions);
+	g_ptr_array_add(argv, NULL);
+
+	run_child(phase, (char **) argv->pdata);
+	phase->eds_calls = read_eds_calls(configdir);
+
+	g_ptr_array_free(argv, TRUE);
+}
+
+/* Runs an osynctool command that sets up the bulk add group */
+static gboolean osynctool(const char *configdir, const char *command, const char *arg1, const char *arg2)
+{
+	char *argv[] = { "osynctool", "--configdir", (char *) configdir, (char *) command, (char *) arg1, (char *) arg2, NULL };
+	GError *gerror = NULL;
+	int status = 0;
+
+	if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL, NULL, NULL, &status, &gerror)) {
+		fprintf(stderr, "Unable to run osynctool %s: %s\n", command, gerror->message);
+		g_clear_error(&gerror);
+		return FALSE;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "osynctool %s %s failed\n", command, arg1);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Slow syncs the sources below workdir into empty ones below workdir/fresh
+ * through a two-member osynctool group. The first sync of a group is a
+ * slow sync, and with nothing on the fresh side every item ends up there
+ * as an added change. */
+static void run_bulk_add(BenchPhase *phase)
+{
+	static const struct {
+		const char *name;
+		ECalSourceType type;
+	} calendars[] = {
+		{ "events", E_CAL_SOURCE_TYPE_EVENT },
+		{ "tasks", E_CAL_SOURCE_TYPE_TODO },
+		{ "memos", E_CAL_SOURCE_TYPE_JOURNAL }
+	};
+	char *groupdir = g_build_filename(workdir, "group", NULL);
+	char *fresh = g_build_filename(workdir, "fresh", NULL);
+	char *member[2] = { NULL, NULL };
+	char *argv[] = { "osynctool", "--configdir", groupdir, "--sync", "evo2-bench", NULL };
+	char *uri = NULL, *path = NULL;
+	EBook *book = NULL;
+	ECal *cal = NULL;
+	long calls;
+	unsigned int i;
+
+	phase->exit_status = -1;
+	phase->eds_calls = -1;
+
+	/* the plugin only opens sources that exist */
+	uri = g_strdup_printf("file://%s/book", fresh);
+	book = open_book(uri);
+	g_free(uri);
+	if (!book)
+		goto out;
+	g_object_unref(book);
+	for (i = 0; i < G_N_ELEMENTS(calendars); i++) {
+		uri = g_strdup_printf("file://%s/%s", fresh, calendars[i].name);
+		cal = open_cal(uri, calendars[i].type);
+		g_free(uri);
+		if (!cal)
+			goto out;
+		g_object_unref(cal);
+	}
+
+	g_mkdir_with_parents(groupdir, 0700);
+	if (!osynctool(groupdir, "--addgroup", "evo2-bench", NULL)
+	    || !osynctool(groupdir, "--addmember", "evo2-bench", "evo2-sync")
+	    || !osynctool(groupdir, "--addmember", "evo2-bench", "evo2-sync"))
+		goto out;
+
+	/* a new group and its members get the first free ids */
+	for (i = 0; i < 2; i++) {
+		member[i] = g_strdup_printf("%s/group1/%u", groupdir, i + 1);
+		path = g_build_filename(member[i], "evo2-sync.conf", NULL);
+		if (!write_config(path, i == 0 ? workdir : fresh)) {
+			g_free(path);
+			goto out;
+		}
+		g_free(path);
+	}
+	if (!osynctool(groupdir, "--discover", "evo2-bench", NULL))
+		goto out;
+
+	run_child(phase, argv);
+	for (i = 0; i < 2; i++) {
+		if ((calls = read_eds_calls(member[i])) >= 0)
+			phase->eds_calls = (phase->eds_calls < 0 ? 0 : phase->eds_calls) + calls;
+	}
+
+ out:
+	g_free(member[0]);
+	g_free(member[1]);
+	g_free(fresh);
+	g_free(groupdir);
+}
+
+static void print_report(FILE *out, BenchPhase *phases, unsigned int n)
+{
+	unsigned int i;
+
+	fprintf(out, "{\n  \"contacts\": %d,\n  \"events\": %d,\n  \"photo_size\": %d,\n  \"attach_size\": %d,\n", n_contacts, n_events, photo_size, attach_size);
+	fprintf(out, "  \"recurring_percent\": %d,\n  \"change_ratio\": %g,\n  \"phases\": [\n", recurring, change_ratio);
+	for (i = 0; i < n; i++) {
+		char eds_calls[32] = "null";
+		if (phases[i].eds_calls >= 0)
+			snprintf(eds_calls, sizeof(eds_calls), "%ld", phases[i].eds_calls);
+		fprintf(out, "    { \"name\": \"%s\", \"items\": %u, \"wall_seconds\": %.3f, \"items_per_second\": %.1f, \"peak_rss_kb\": %ld, \"eds_calls\": %s, \"exit_status\": %d }%s\n",
+			phases[i].name, phases[i].items, phases[i].seconds,
+			phases[i].seconds > 0 ? phases[i].items / phases[i].seconds : 0.0,
+			phases[i].peak_rss_kb, eds_calls, phases[i].exit_status, i + 1 < n ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+static void remove_tree(const char *path)
+{
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const char *name;
+
+	if (dir) {
+		while ((name = g_dir_read_name(dir))) {
+			char *child = g_build_filename(path, name, NULL);
+			remove_tree(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+	}
+	g_remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *slow_sync[] = { "--initialize", "--connect", "--slowsync", "--syncdone", "--disconnect", "--finalize", NULL };
+	static const char *fast_sync[] = { "--initialize", "--connect", "--sync", "--syncdone", "--disconnect", "--finalize", NULL };
+	static const char *bulk_commit[] = { "--initialize", "--connect", "--empty", "--committedall", "--syncdone", "--disconnect", "--finalize", NULL };
+	GOptionContext *context = NULL;
+	GError *gerror = NULL;
+	BenchPhase phases[4];
+	unsigned int n = 0, i;
+	EBook *book = NULL;
+	ECal *cal = NULL, *tasks = NULL, *memos = NULL;
+	GPtrArray *uids = NULL;
+	char *uri = NULL, *config = NULL, *configdir = NULL, *tool = NULL;
+	gboolean tmpdir = FALSE;
+	FILE *out = stdout;
+	int ret = 1;
+
+	g_type_init();
+
+	context = g_option_context_new("- evo2-sync throughput benchmark");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &gerror)) {
+		fprintf(stderr, "%s\n", gerror->message);
+		g_clear_error(&gerror);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	if (!workdir) {
+		workdir = g_strdup("/tmp/evo2-bench.XXXXXX");
+		if (!mkdtemp(workdir)) {
+			perror("mkdtemp");
+			return 1;
+		}
+		tmpdir = TRUE;
+	}
+	configdir = g_build_filename(workdir, "state", NULL);
+	config = g_build_filename(workdir, "evo2-sync.conf", NULL);
+	g_mkdir_with_parents(configdir, 0700);
+
+	uri = g_strdup_printf("file://%s/book", workdir);
+	book = open_book(uri);
+	g_free(uri);
+	uri = g_strdup_printf("file://%s/events", workdir);
+	cal = open_cal(uri, E_CAL_SOURCE_TYPE_EVENT);
+	g_free(uri);
+	uri = g_strdup_printf("file://%s/tasks", workdir);
+	tasks = open_cal(uri, E_CAL_SOURCE_TYPE_TODO);
+	g_free(uri);
+	uri = g_strdup_printf("file://%s/memos", workdir);
+	memos = open_cal(uri, E_CAL_SOURCE_TYPE_JOURNAL);
+	g_free(uri);
+	if (!book || !cal || !tasks || !memos)
+		goto out;
+
+	fprintf(stderr, "Populating %s with %d contacts and %d events\n", workdir, n_contacts, n_events);
+	uids = populate_book(book);
+	if (!populate_cal(cal) || !write_config(config, workdir))
+		goto out;
+
+	memset(phases, 0, sizeof(phases));
+	phases[n].name = "slow_sync";
+	phases[n].items = uids->len + n_events;
+	run_phase(&phases[n++], config, configdir, slow_sync);
+
+	phases[n].name = "fast_sync";
+	phases[n].items = mutate(book, uids, cal);
+	run_phase(&phases[n++], config, configdir, fast_sync);
+
+	if ((tool = g_find_program_in_path("osynctool"))) {
+		phases[n].name = "bulk_add";
+		phases[n].items = uids->len + n_events;
+		run_bulk_add(&phases[n++]);
+	} else {
+		fprintf(stderr, "osynctool not found, skipping bulk_add\n");
+	}
+
+	phases[n].name = "bulk_commit";
+	phases[n].items = uids->len + n_events;
+	run_phase(&phases[n++], config, configdir, bulk_commit);
+
+	if (output && !(out = fopen(output, "w"))) {
+		perror(output);
+		goto out;
+	}
+	print_report(out, phases, n);
+	if (out != stdout)
+		fclose(out);
+	ret = 0;
+	for (i = 0; i < n; i++) {
+		if (phases[i].exit_status)
+			ret = 1;
+	}
+
+ out:
+	if (uids) {
+		g_ptr_array_foreach(uids, (GFunc) g_free, NULL);
+		g_ptr_array_free(uids, TRUE);
+	}
+	if (book)
+		g_object_unref(book);
+	if (cal)
+		g_object_unref(cal);
+	if (tasks)
+		g_object_unref(tasks);
+	if (memos)
+		g_object_unref(memos);
+	if (tmpdir && !keep)
+		remove_tree(workdir);
+	g_free(tool);
+	g_free(config);
+	g_free(configdir);
+	return ret;
+}